@@ -0,0 +1,177 @@
+#include "audio.h"
+#include "kernels.h"
+#include "resample.h"
+#include <sndfile.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// libsndfile virtual I/O over a caller-owned byte range, so request bodies
+// are decoded in place without a round trip through the filesystem.
+namespace {
+    struct MemReader {
+        const char* data;
+        sf_count_t size;
+        sf_count_t pos;
+    };
+
+    sf_count_t mem_get_filelen(void* user) { return static_cast<MemReader*>(user)->size; }
+
+    sf_count_t mem_seek(sf_count_t offset, int whence, void* user) {
+        MemReader* m = static_cast<MemReader*>(user);
+        sf_count_t base = whence == SEEK_CUR ? m->pos : whence == SEEK_END ? m->size : 0;
+        sf_count_t p = base + offset;
+        if (p < 0 || p > m->size) return -1;
+        m->pos = p;
+        return p;
+    }
+
+    sf_count_t mem_read(void* ptr, sf_count_t count, void* user) {
+        MemReader* m = static_cast<MemReader*>(user);
+        sf_count_t n = min(count, m->size - m->pos);
+        if (n <= 0) return 0;
+        memcpy(ptr, m->data + m->pos, static_cast<size_t>(n));
+        m->pos += n;
+        return n;
+    }
+
+    sf_count_t mem_write(const void*, sf_count_t, void*) { return 0; }
+
+    sf_count_t mem_tell(void* user) { return static_cast<MemReader*>(user)->pos; }
+}
+
+// The open file, its virtual I/O state, and a block of interleaved frames
+// that is downmixed in place.
+struct AudioStream::File {
+    SNDFILE* snd = nullptr;
+    SF_INFO info{};
+    SF_VIRTUAL_IO vio{ mem_get_filelen, mem_seek, mem_read, mem_write, mem_tell };
+    MemReader reader{ nullptr, 0, 0 };
+    vector<float> block;
+    ~File() { if (snd) sf_close(snd); }
+
+    // Decodes up to `frames` (at most BLOCK_FRAMES) into the front of `block`.
+    size_t decode(size_t frames) {
+        sf_count_t got = sf_readf_float(snd, block.data(), static_cast<sf_count_t>(frames));
+        if (got <= 0) return 0;
+        downmix(block.data(), static_cast<size_t>(got), info.channels);
+        return static_cast<size_t>(got);
+    }
+};
+
+AudioStream::AudioStream() = default;
+AudioStream::~AudioStream() = default;
+
+bool AudioStream::open(const string& path) {
+    file_.reset(new File());
+    file_->snd = sf_open(path.c_str(), SFM_READ, &file_->info);
+    if (!file_->snd) {
+        cerr << "sf_open failed for " << path << "\n";
+        file_.reset();
+        return false;
+    }
+    return opened();
+}
+
+bool AudioStream::open(const void* data, size_t size) {
+    file_.reset(new File());
+    file_->reader = MemReader{ static_cast<const char*>(data), static_cast<sf_count_t>(size), 0 };
+    file_->snd = sf_open_virtual(&file_->vio, SFM_READ, &file_->info, &file_->reader);
+    if (!file_->snd) {
+        cerr << "sf_open_virtual failed: " << sf_strerror(nullptr) << "\n";
+        file_.reset();
+        return false;
+    }
+    return opened();
+}
+
+// Refuses rates the resampler does not take, before anything is decoded.
+bool AudioStream::opened() {
+    if (!supported_input_rate(file_->info.samplerate)) {
+        cerr << "unsupported sample rate " << file_->info.samplerate << " (accepted: "
+             << MIN_INPUT_RATE << "-" << MAX_INPUT_RATE << " Hz)\n";
+        file_.reset();
+        return false;
+    }
+    file_->block.resize(BLOCK_FRAMES * static_cast<size_t>(file_->info.channels));
+    rate_ = file_->info.samplerate;
+    return true;
+}
+
+uint64_t AudioStream::frames() const {
+    return file_ && file_->info.frames > 0 ? static_cast<uint64_t>(file_->info.frames) : 0;
+}
+
+const float* AudioStream::next(size_t& n) {
+    n = file_ ? file_->decode(BLOCK_FRAMES) : 0;
+    return n ? file_->block.data() : nullptr;
+}
+
+size_t AudioStream::read(vector<float>& mono, size_t frames) {
+    if (!file_) return 0;
+    size_t total = 0;
+    while (total < frames) {
+        size_t got = file_->decode(min(frames - total, BLOCK_FRAMES));
+        if (got == 0) break;
+        mono.insert(mono.end(), file_->block.data(), file_->block.data() + got);
+        total += got;
+    }
+    return total;
+}
+
+static bool load_all(AudioStream& in, vector<float>& mono, int& rate) {
+    rate = in.rate();
+    mono.clear();
+    mono.reserve(static_cast<size_t>(in.frames()));
+    while (in.read(mono, AudioStream::BLOCK_FRAMES) > 0) {}
+    return !mono.empty();
+}
+
+bool load_audio_mono(const string& path, vector<float>& mono, int& rate) {
+    AudioStream in;
+    return in.open(path) && load_all(in, mono, rate);
+}
+
+bool load_audio_mono(const void* data, size_t size, vector<float>& mono, int& rate) {
+    AudioStream in;
+    return in.open(data, size) && load_all(in, mono, rate);
+}
+
+static bool is_audio(const fs::path& p) {
+    string ext = p.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".wav" || ext == ".flac" || ext == ".ogg" || ext == ".aif"
+        || ext == ".aiff" || ext == ".mp3";
+}
+
+bool collect_audio_sources(const string& src, vector<AudioSource>& out) {
+    std::error_code ec;
+    if (fs::is_directory(src, ec)) {
+        for (auto it = fs::recursive_directory_iterator(src, ec); !ec && it != fs::end(it); it.increment(ec))
+            if (it->is_regular_file() && is_audio(it->path()))
+                out.push_back(AudioSource{ it->path().string(), it->path().filename().string(), "" });
+        sort(out.begin(), out.end(), [](const AudioSource& a, const AudioSource& b){ return a.path < b.path; });
+        return !ec;
+    }
+    ifstream in(src);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        AudioSource s;
+        istringstream fields(line);
+        getline(fields, s.path, '\t');
+        getline(fields, s.name, '\t');
+        getline(fields, s.url, '\t');
+        if (s.name.empty()) s.name = fs::path(s.path).filename().string();
+        out.push_back(std::move(s));
+    }
+    return true;
+}
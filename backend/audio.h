@@ -0,0 +1,55 @@
+#pragma once
+// Audio decoding via libsndfile, downmixed to mono float samples.
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Decodes a whole file, for callers that need all of it at once; the
+// ingestion and query paths stream it through an AudioStream instead.
+bool load_audio_mono(const std::string& path, std::vector<float>& mono, int& rate);
+// Decodes an in-memory file image (e.g. an HTTP request body).
+bool load_audio_mono(const void* data, size_t size, std::vector<float>& mono, int& rate);
+
+// Block-wise decoding: frames are read BLOCK_FRAMES at a time as float and
+// downmixed in place, so memory is bounded by one block however long or
+// wide the input (an hour of broadcast, a multichannel master).
+class AudioStream {
+public:
+    static const size_t BLOCK_FRAMES = 8192;
+
+    AudioStream();
+    ~AudioStream();
+    // Both fail for rates outside MIN_INPUT_RATE..MAX_INPUT_RATE (resample.h).
+    bool open(const std::string& path);
+    // Reads an in-memory file image, which must outlive the stream.
+    bool open(const void* data, size_t size);
+    int rate() const { return rate_; }
+    // Length as the file's header states it (it may be short of the real one).
+    uint64_t frames() const;
+    // Decodes the next block and returns its mono samples, valid until the
+    // next call; nullptr at the end.
+    const float* next(size_t& n);
+    // Appends up to `frames` mono samples to `mono`; returns how many (0 at the end).
+    size_t read(std::vector<float>& mono, size_t frames);
+
+private:
+    bool opened();
+
+    struct File;
+    std::unique_ptr<File> file_;
+    int rate_ = 0;
+};
+
+// An audio file to ingest or query, with its song name and optional URL.
+struct AudioSource {
+    std::string path;
+    std::string name;
+    std::string url;
+};
+
+// Lists `src`: a directory is scanned recursively for audio files (name = file
+// name, sorted by path); anything else is read as a manifest of
+// `path<TAB>name<TAB>url` lines, name and url optional.
+bool collect_audio_sources(const std::string& src, std::vector<AudioSource>& out);
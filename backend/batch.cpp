@@ -0,0 +1,104 @@
+#include "batch.h"
+#include "compute.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+namespace {
+    // Fewer distinct hashes than this per thread are not worth a thread.
+    static const size_t MIN_HASHES_PER_THREAD = 1 << 14;
+
+    // The postings of one distinct query hash, decoded once for every clip.
+    struct HashList {
+        uint32_t part;     // thread whose buffer holds the postings
+        uint32_t count;
+        size_t begin;
+        uint8_t weight;
+    };
+}
+
+// Two phases: the distinct hashes are split into ranges walked in hash order
+// (each thread decodes its range's lists into its own buffer), then the clips
+// are voted in parallel, each reading the shared lists.
+BatchStats vote_batch(const vector<const PostingIndex*>& parts, size_t numSongs,
+                      vector<BatchHash>& hashes, size_t numClips, unsigned threads,
+                      const Tombstones* dead, const function<void(size_t, VoteScorer&)>& done) {
+    BatchStats stats;
+    threads = max(threads, 1u);
+    sort(hashes.begin(), hashes.end(), [](const BatchHash& a, const BatchHash& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.clip < b.clip;
+    });
+
+    // Each clip's votes as (distinct hash index, query offset).
+    vector<uint32_t> distinct;
+    vector<vector<pair<uint32_t, int32_t>>> byClip(numClips);
+    for (const auto& h : hashes) {
+        if (distinct.empty() || distinct.back() != h.hash) distinct.push_back(h.hash);
+        byClip[h.clip].emplace_back(static_cast<uint32_t>(distinct.size() - 1), h.offset);
+    }
+
+    vector<const FlatIndex*> flat(parts.size());
+    for (size_t p = 0; p < parts.size(); ++p) flat[p] = dynamic_cast<const FlatIndex*>(parts[p]);
+    const HashPolicy& policy = hash_policy();
+    const unsigned walkers = static_cast<unsigned>(
+        max<size_t>(1, min<size_t>(threads, distinct.size() / MIN_HASHES_PER_THREAD)));
+    vector<HashList> lists(distinct.size());
+    vector<vector<Posting>> buffers(walkers);
+    atomic<size_t> postings{0}, skipped{0}, sampled{0};
+    compute::parallel_for(walkers, walkers, [&](unsigned, size_t w) {
+        const size_t lo = distinct.size() * w / walkers, hi = distinct.size() * (w + 1) / walkers;
+        vector<Posting>& buf = buffers[w];
+        vector<size_t> pos(parts.size(), 0);
+        size_t mySkipped = 0, mySampled = 0, myPostings = 0;
+        for (size_t d = lo; d < hi; ++d) {
+            const uint32_t h = distinct[d];
+            const size_t begin = buf.size();
+            for (size_t p = 0; p < parts.size(); ++p) {
+                if (!flat[p]) {
+                    if (parts[p]->lookup(h, buf, policy.maxListPostings) > policy.maxListPostings) ++mySkipped;
+                    continue;
+                }
+                pos[p] = flat[p]->seek(h, pos[p]);
+                if (pos[p] == flat[p]->num_hashes() || flat[p]->hash_at(pos[p]) != h) continue;
+                if (flat[p]->count_at(pos[p]) > policy.maxListPostings) { ++mySkipped; continue; }
+                flat[p]->decode_at(pos[p], buf);
+            }
+            myPostings += buf.size() - begin;
+            if (dead) dead->purge(buf, begin);
+            HashList& l = lists[d];
+            l.part = static_cast<uint32_t>(w);
+            l.begin = begin;
+            l.weight = UNIT_WEIGHT;
+            if (buf.size() > begin && policy.idf) l.weight = idf_weight(distinct_songs(buf.data() + begin, buf.size() - begin), numSongs);
+            if (sample_postings(buf, begin, policy.sampleListPostings)) ++mySampled;
+            l.count = static_cast<uint32_t>(buf.size() - begin);
+        }
+        postings += myPostings;
+        skipped += mySkipped;
+        sampled += mySampled;
+    });
+
+    atomic<size_t> votes{0};
+    const unsigned voters = static_cast<unsigned>(max<size_t>(1, min<size_t>(threads, numClips)));
+    vector<VoteScorer> scorers(voters);
+    compute::parallel_for(numClips, voters, [&](unsigned t, size_t c) {
+        VoteScorer& s = scorers[t];
+        s.clear();
+        size_t n = 0;
+        for (const auto& v : byClip[c]) {
+            const HashList& l = lists[v.first];
+            const Posting* p = buffers[l.part].data() + l.begin;
+            for (uint32_t k = 0; k < l.count; ++k) s.add(p[k].songId, p[k].offset, v.second, l.weight);
+            n += l.count;
+        }
+        votes += n;
+        done(c, s);
+    });
+    stats.postings = postings;
+    stats.votes = votes;
+    stats.skippedLists = skipped;
+    stats.sampledLists = sampled;
+    return stats;
+}
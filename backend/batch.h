@@ -0,0 +1,38 @@
+#pragma once
+// Batch voting: the hashes of many query clips are merged into one stream
+// sorted by hash and the index is walked once in that order, so each posting
+// list is found and decoded once however many clips share its hash, and the
+// directory is read front to back instead of searched per hash.
+#include "index.h"
+#include "scoring.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// One query hash of a batch: clip `clip` made `hash` at frame `offset`.
+struct BatchHash {
+    uint32_t hash;
+    uint32_t clip;
+    int32_t offset;
+};
+
+struct BatchStats {
+    size_t postings = 0;      // postings decoded (once per distinct hash)
+    size_t votes = 0;         // votes cast across all clips
+    size_t skippedLists = 0;  // lists over the policy's maxListPostings
+    size_t sampledLists = 0;  // lists thinned to the policy's sampleListPostings
+};
+
+// Votes the hashes of clips 0..numClips-1 as lookups against `parts` would
+// (one catalog of `numSongs` songs split over segments holding disjoint songs,
+// oldest first), under hash_policy(), and passes each clip's votes to
+// `done(clip, scorer)`, e.g. to rank them. Postings of songs in `dead` (if
+// given) are dropped as lists are decoded. Sorts `hashes`. Runs on up to
+// `threads` threads, the caller's and idle ones of the compute pool
+// (compute.h); each reuses one scorer, so only that many clips' votes are
+// held at once.
+BatchStats vote_batch(const std::vector<const PostingIndex*>& parts, size_t numSongs,
+                      std::vector<BatchHash>& hashes, size_t numClips, unsigned threads,
+                      const Tombstones* dead,
+                      const std::function<void(size_t clip, VoteScorer& scorer)>& done);
@@ -0,0 +1,453 @@
+// Benchmark and accuracy harness: fingerprints a reference catalog into an
+// in-memory index, replays a query set against it stage by stage and reports
+// latency percentiles, throughput, index memory and top-1/top-5 accuracy as
+// JSON, so runs can be compared across commits.
+//
+//   ./bench [-j threads] [-o results.json] [--queries dir|manifest]
+//           [--synthetic N] [--clip secs] [--snr dB] [--gain dB] [--seed N]
+//           [--index flat|map] [--batch N] <catalog directory | manifest>
+//
+// Queries are files (e.g. data/queries/*.wav; a manifest's name column gives
+// the expected catalog song, unlabelled queries only count for latency) and/or
+// N synthetic clips cut from catalog songs at random sample offsets. Every
+// query can get white noise at a given SNR and a gain change, and is then
+// re-encoded as 16-bit WAV, so each one goes through the same decode ->
+// fingerprint -> lookup -> scoring path as POST /recognize. Runs with the
+// same seed use the same clips and noise. With --batch the queries are also
+// run N at a time through the batch path (batch.h) and its throughput is
+// reported next to the one-by-one figure.
+#include "audio.h"
+#include "batch.h"
+#include "dsp.h"
+#include "fingerprint.h"
+#include "index.h"
+#include "kernels.h"
+#include "scoring.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+    using Clock = chrono::steady_clock;
+
+    struct Options {
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        string output;
+        string catalog;
+        string queries;
+        int synthetic = -1;      // -1: 200 unless --queries is given
+        double clipSeconds = 5;
+        double snrDb = NAN;      // NAN: no noise
+        double gainDb = 0;
+        unsigned seed = 1;
+        string index = "flat";
+        int batch = 0;           // clips per batch pass; 0: no batch run
+    };
+
+    struct Query {
+        string label;
+        int expected;            // catalog song, or -1 if unknown
+        string wav;              // encoded query body
+    };
+
+    enum Stage { DECODE, RESAMPLE, STFT, PEAKS, HASHING, LOOKUP, SCORING, TOTAL, NUM_STAGES };
+    const char* const STAGE_NAMES[NUM_STAGES] =
+        { "decode", "resample", "stft", "peaks", "hashing", "lookup", "scoring", "total" };
+
+    struct QueryResult {
+        double stage[NUM_STAGES] = {};   // seconds
+        size_t hashes = 0;
+        size_t hits = 0;
+        int expected = -1;
+        int rank = -1;                   // position of the expected song in the top 5
+    };
+
+    double seconds_since(Clock::time_point t0) {
+        return chrono::duration<double>(Clock::now() - t0).count();
+    }
+
+    void put_le(string& out, uint32_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i) out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+
+    // 16-bit mono PCM WAV, clipped to full scale.
+    string encode_wav(const vector<float>& mono, int rate) {
+        string out;
+        uint32_t dataSize = static_cast<uint32_t>(mono.size() * 2);
+        out.reserve(44 + dataSize);
+        out += "RIFF"; put_le(out, 36 + dataSize, 4); out += "WAVE";
+        out += "fmt "; put_le(out, 16, 4); put_le(out, 1, 2); put_le(out, 1, 2);
+        put_le(out, static_cast<uint32_t>(rate), 4); put_le(out, static_cast<uint32_t>(rate) * 2, 4);
+        put_le(out, 2, 2); put_le(out, 16, 2);
+        out += "data"; put_le(out, dataSize, 4);
+        for (float f : mono) {
+            double s = max(-1.0, min(1.0, static_cast<double>(f)));
+            put_le(out, static_cast<uint16_t>(static_cast<int16_t>(lrint(s * 32767.0))), 2);
+        }
+        return out;
+    }
+
+    // Gain change, then white noise at `snrDb` below the clip's power.
+    void perturb(vector<float>& mono, const Options& opt, mt19937& rng) {
+        const float gain = static_cast<float>(pow(10.0, opt.gainDb / 20.0));
+        double power = 0;
+        for (float& s : mono) { s *= gain; power += static_cast<double>(s) * s; }
+        if (std::isnan(opt.snrDb) || mono.empty()) return;
+        power /= mono.size();
+        normal_distribution<double> noise(0.0, sqrt(power / pow(10.0, opt.snrDb / 10.0)));
+        for (float& s : mono) s += static_cast<float>(noise(rng));
+    }
+
+    bool parse_args(int argc, char** argv, Options& opt) {
+        for (int i = 1; i < argc; ++i) {
+            string a = argv[i];
+            bool more = i + 1 < argc;
+            if (a == "-j" && more) opt.threads = max(1, atoi(argv[++i]));
+            else if (a == "-o" && more) opt.output = argv[++i];
+            else if (a == "--queries" && more) opt.queries = argv[++i];
+            else if (a == "--synthetic" && more) opt.synthetic = max(0, atoi(argv[++i]));
+            else if (a == "--clip" && more) opt.clipSeconds = atof(argv[++i]);
+            else if (a == "--snr" && more) opt.snrDb = atof(argv[++i]);
+            else if (a == "--gain" && more) opt.gainDb = atof(argv[++i]);
+            else if (a == "--seed" && more) opt.seed = static_cast<unsigned>(atoi(argv[++i]));
+            else if (a == "--index" && more) opt.index = argv[++i];
+            else if (a == "--batch" && more) opt.batch = max(0, atoi(argv[++i]));
+            else if (!a.empty() && a[0] != '-') opt.catalog = a;
+            else return false;
+        }
+        if (opt.synthetic < 0) opt.synthetic = opt.queries.empty() ? 200 : 0;
+        return !opt.catalog.empty() && opt.clipSeconds > 0 && (opt.index == "flat" || opt.index == "map");
+    }
+
+    // Catalog songs fingerprinted in parallel into one index. Song ids are
+    // positions in `sources`; songs that fail to decode just have no postings.
+    struct Catalog {
+        vector<AudioSource> sources;
+        vector<vector<float>> audio;    // kept for synthetic clips
+        vector<int> rates;
+        unique_ptr<PostingIndex> index;
+        HashStats stats;
+        size_t songs = 0;
+        double seconds = 0;
+    };
+
+    bool build_catalog(const Options& opt, Catalog& cat) {
+        if (!collect_audio_sources(opt.catalog, cat.sources) || cat.sources.empty()) {
+            cerr << "no catalog audio in " << opt.catalog << "\n";
+            return false;
+        }
+        const size_t n = cat.sources.size();
+        cat.audio.resize(n);
+        cat.rates.assign(n, 0);
+        vector<vector<pair<uint32_t, Posting>>> parts(opt.threads);
+        atomic<size_t> next{0};
+        auto t0 = Clock::now();
+        auto worker = [&](unsigned w) {
+            for (size_t j; (j = next.fetch_add(1)) < n; ) {
+                vector<float> mono; int rate = 0;
+                if (!load_audio_mono(cat.sources[j].path, mono, rate)) continue;
+                int32_t song = static_cast<int32_t>(j);
+                Fingerprinter fp([&](uint32_t h, int32_t offset){ parts[w].emplace_back(h, Posting{ song, offset }); }, rate);
+                fp.push(mono.data(), mono.size());
+                fp.finish();
+                cat.rates[j] = rate;
+                if (opt.synthetic > 0) cat.audio[j] = std::move(mono);
+            }
+        };
+        vector<thread> pool;
+        for (unsigned w = 0; w < opt.threads; ++w) pool.emplace_back(worker, w);
+        for (auto& t : pool) t.join();
+
+        vector<pair<uint32_t, Posting>> entries;
+        for (auto& p : parts) { entries.insert(entries.end(), p.begin(), p.end()); vector<pair<uint32_t, Posting>>().swap(p); }
+        sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        cat.songs = static_cast<size_t>(count_if(cat.rates.begin(), cat.rates.end(), [](int r){ return r > 0; }));
+        // The hash policy as index.bin would get it.
+        size_t i = 0;
+        PostingSource source = apply_hash_policy([&](uint32_t& hash, vector<Posting>& out) {
+            out.clear();
+            if (i >= entries.size()) return false;
+            hash = entries[i].first;
+            for (; i < entries.size() && entries[i].first == hash; ++i) out.push_back(entries[i].second);
+            return true;
+        }, cat.songs, &cat.stats);
+        if (opt.index == "map") {
+            auto map = make_unique<MapIndex>();
+            uint32_t hash;
+            vector<Posting> plist;
+            while (source(hash, plist))
+                for (const auto& p : plist) map->add(hash, p);
+            cat.index = std::move(map);
+        } else {
+            cat.index = make_unique<FlatSegment>(source);
+        }
+        cat.seconds = seconds_since(t0);
+        return cat.songs > 0;
+    }
+
+    bool build_queries(const Options& opt, const Catalog& cat, vector<Query>& queries) {
+        mt19937 rng(opt.seed);
+        if (!opt.queries.empty()) {
+            vector<AudioSource> files;
+            if (!collect_audio_sources(opt.queries, files)) {
+                cerr << "cannot read " << opt.queries << "\n";
+                return false;
+            }
+            unordered_map<string, int> byName;
+            for (size_t j = 0; j < cat.sources.size(); ++j)
+                if (cat.rates[j] > 0) byName.emplace(cat.sources[j].name, static_cast<int>(j));
+            for (const auto& f : files) {
+                vector<float> mono; int rate = 0;
+                if (!load_audio_mono(f.path, mono, rate)) { cerr << "cannot decode " << f.path << "\n"; continue; }
+                perturb(mono, opt, rng);
+                auto it = byName.find(f.name);
+                queries.push_back(Query{ f.path, it == byName.end() ? -1 : it->second, encode_wav(mono, rate) });
+            }
+        }
+        vector<int> usable;
+        for (size_t j = 0; j < cat.audio.size(); ++j)
+            if (cat.audio[j].size() > static_cast<size_t>(opt.clipSeconds * cat.rates[j])) usable.push_back(static_cast<int>(j));
+        if (opt.synthetic > 0 && usable.empty()) {
+            cerr << "no catalog song is longer than " << opt.clipSeconds << " s\n";
+            return false;
+        }
+        for (int i = 0; i < opt.synthetic; ++i) {
+            int song = usable[uniform_int_distribution<size_t>(0, usable.size() - 1)(rng)];
+            const vector<float>& audio = cat.audio[song];
+            size_t len = static_cast<size_t>(opt.clipSeconds * cat.rates[song]);
+            size_t start = uniform_int_distribution<size_t>(0, audio.size() - len)(rng);
+            vector<float> clip(audio.begin() + start, audio.begin() + start + len);
+            perturb(clip, opt, rng);
+            ostringstream label;
+            label << cat.sources[song].name << "@" << static_cast<double>(start) / cat.rates[song];
+            queries.push_back(Query{ label.str(), song, encode_wav(clip, cat.rates[song]) });
+        }
+        return !queries.empty();
+    }
+
+    // The /recognize path with each stage timed on its own: all hashes are
+    // made first, then looked up, then voted on.
+    void run_query(const Query& q, const Catalog& cat, VoteScorer& scorer, QueryResult& r) {
+        const HashPolicy& policy = hash_policy();
+        r.expected = q.expected;
+        auto t0 = Clock::now(), t = t0;
+        vector<float> mono; int rate = 0;
+        if (!load_audio_mono(q.wav.data(), q.wav.size(), mono, rate)) return;
+        r.stage[DECODE] = seconds_since(t);
+
+        vector<pair<uint32_t, int32_t>> hashes;
+        FingerprintTimes times;
+        Fingerprinter fp([&](uint32_t h, int32_t offset){ hashes.emplace_back(h, offset); }, rate);
+        fp.set_times(&times);
+        fp.push(mono.data(), mono.size());
+        fp.finish();
+        r.stage[RESAMPLE] = times.resample;
+        r.stage[STFT] = times.stft;
+        r.stage[PEAKS] = times.peaks;
+        r.stage[HASHING] = times.hashing;
+        r.hashes = hashes.size();
+
+        t = Clock::now();
+        struct Vote { int32_t songId, songOffset, queryOffset; uint8_t weight; };
+        vector<Vote> votes;
+        vector<Posting> hits;
+        for (const auto& h : hashes) {
+            hits.clear();
+            cat.index->lookup(h.first, hits, policy.maxListPostings);
+            if (hits.empty()) continue;
+            uint8_t w = policy.idf ? idf_weight(distinct_songs(hits), cat.songs) : UNIT_WEIGHT;
+            sample_postings(hits, 0, policy.sampleListPostings);
+            for (const auto& p : hits) votes.push_back(Vote{ p.songId, p.offset, h.second, w });
+        }
+        r.stage[LOOKUP] = seconds_since(t);
+        r.hits = votes.size();
+
+        t = Clock::now();
+        vector<SongScore> top;
+        scorer.clear();
+        for (const auto& v : votes) scorer.add(v.songId, v.songOffset, v.queryOffset, v.weight);
+        scorer.rank(5, top);
+        r.stage[SCORING] = seconds_since(t);
+        r.stage[TOTAL] = seconds_since(t0);
+        for (size_t i = 0; i < top.size(); ++i)
+            if (top[i].songId == q.expected) { r.rank = static_cast<int>(i); break; }
+    }
+
+    struct BatchResult {
+        double seconds = 0;
+        size_t top1 = 0;
+        size_t postings = 0;   // decoded, once per distinct hash of a pass
+    };
+
+    // The identify_batch() path: each pass fingerprints `opt.batch` queries
+    // in parallel, votes them in one hash-ordered walk and ranks them.
+    BatchResult run_batches(const Options& opt, const Catalog& cat, const vector<Query>& queries) {
+        BatchResult r;
+        auto parallel = [&](size_t n, const function<void(size_t)>& f) {
+            atomic<size_t> next{0};
+            vector<thread> pool;
+            for (unsigned w = 0; w < min<size_t>(opt.threads, n); ++w)
+                pool.emplace_back([&]{ for (size_t i; (i = next.fetch_add(1)) < n; ) f(i); });
+            for (auto& t : pool) t.join();
+        };
+        const vector<const PostingIndex*> parts{ cat.index.get() };
+        auto t0 = Clock::now();
+        for (size_t first = 0; first < queries.size(); first += static_cast<size_t>(opt.batch)) {
+            const size_t m = min(static_cast<size_t>(opt.batch), queries.size() - first);
+            vector<vector<pair<uint32_t, int32_t>>> fps(m);
+            parallel(m, [&](size_t c) {
+                const Query& q = queries[first + c];
+                vector<float> mono; int rate = 0;
+                if (!load_audio_mono(q.wav.data(), q.wav.size(), mono, rate)) return;
+                Fingerprinter fp([&](uint32_t h, int32_t offset){ fps[c].emplace_back(h, offset); }, rate);
+                fp.push(mono.data(), mono.size());
+                fp.finish();
+            });
+            vector<BatchHash> hashes;
+            for (size_t c = 0; c < m; ++c)
+                for (const auto& h : fps[c]) hashes.push_back(BatchHash{ h.first, static_cast<uint32_t>(c), h.second });
+            vector<int> best(m, -1);
+            r.postings += vote_batch(parts, cat.songs, hashes, m, opt.threads, nullptr, [&](size_t c, VoteScorer& scorer) {
+                vector<SongScore> top;
+                scorer.rank(5, top);
+                if (!top.empty()) best[c] = top[0].songId;
+            }).postings;
+            for (size_t c = 0; c < m; ++c)
+                if (queries[first + c].expected >= 0 && best[c] == queries[first + c].expected) ++r.top1;
+        }
+        r.seconds = seconds_since(t0);
+        return r;
+    }
+
+    double percentile(vector<double>& v, double p) {
+        if (v.empty()) return 0;
+        size_t k = min(v.size() - 1, static_cast<size_t>(p * (v.size() - 1) + 0.5));
+        nth_element(v.begin(), v.begin() + k, v.end());
+        return v[k];
+    }
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_args(argc, argv, opt)) {
+        cerr << "usage: " << argv[0] << " [-j threads] [-o results.json] [--queries dir|manifest]\n"
+             << "       [--synthetic N] [--clip secs] [--snr dB] [--gain dB] [--seed N]\n"
+             << "       [--index flat|map] [--batch N] <catalog directory | manifest>\n";
+        return 2;
+    }
+    // Catalog and queries use MUSICREC_PROFILE. Shares the server's FFTW wisdom.
+    set_active_profile(profile_from_env());
+    std::error_code ec;
+    filesystem::create_directories("./data", ec);
+    dsp_init("./data", active_profile().windowSize);
+
+    Catalog cat;
+    if (!build_catalog(opt, cat)) return 1;
+    cerr << "Catalog: " << cat.songs << " songs, " << cat.index->num_postings() << " postings, "
+         << cat.index->memory_bytes() << " index bytes (" << opt.index << "), "
+         << cat.seconds << " s\n  " << cat.stats.summary() << "\n";
+
+    vector<Query> queries;
+    if (!build_queries(opt, cat, queries)) return 1;
+    cat.audio.clear();
+
+    vector<QueryResult> results(queries.size());
+    atomic<size_t> next{0};
+    auto t0 = Clock::now();
+    vector<thread> pool;
+    for (unsigned w = 0; w < opt.threads; ++w) {
+        pool.emplace_back([&]() {
+            VoteScorer scorer;
+            for (size_t i; (i = next.fetch_add(1)) < queries.size(); )
+                run_query(queries[i], cat, scorer, results[i]);
+        });
+    }
+    for (auto& t : pool) t.join();
+    double wall = seconds_since(t0);
+
+    size_t labelled = 0, top1 = 0, top5 = 0, hashes = 0, hits = 0;
+    for (const auto& r : results) {
+        hashes += r.hashes;
+        hits += r.hits;
+        if (r.expected < 0) continue;
+        ++labelled;
+        if (r.rank == 0) ++top1;
+        if (r.rank >= 0) ++top5;
+    }
+    double qps = queries.size() / wall;
+    BatchResult batch;
+    if (opt.batch > 0) batch = run_batches(opt, cat, queries);
+
+    ostringstream json;
+    json.precision(6);
+    json << "{\n"
+         << "  \"build\": {\"profile\": \"" << active_profile().name << "\", \"sample_rate\": "
+         << active_profile().sampleRate << ", \"kernels\": \"" << kernel_isa()
+         << "\", \"index\": \"" << opt.index << "\"},\n"
+         << "  \"catalog\": {\"songs\": " << cat.songs << ", \"postings\": " << cat.index->num_postings()
+         << ", \"index_bytes\": " << cat.index->memory_bytes() << ", \"ingest_seconds\": " << cat.seconds << "},\n";
+    const HashPolicy& policy = hash_policy();
+    json << "  \"hash_policy\": {\"song_cap\": " << policy.songCap << ", \"stop_df\": " << policy.stopDf
+         << ", \"stop_min_songs\": " << policy.stopMinSongs << ", \"max_list_postings\": " << policy.maxListPostings
+         << ", \"sample_list_postings\": " << policy.sampleListPostings
+         << ", \"idf\": " << (policy.idf ? "true" : "false") << "},\n"
+         << "  \"hash_stats\": {\"hashes\": " << cat.stats.hashes << ", \"max_df\": " << cat.stats.maxDf
+         << ", \"stop_hashes\": " << cat.stats.stopHashes << ", \"stop_postings\": " << cat.stats.stopPostings
+         << ", \"capped_postings\": " << cat.stats.cappedPostings << ", \"df_histogram\": [";
+    for (int b = 0; b < HashStats::DF_BUCKETS; ++b) json << (b ? ", " : "") << cat.stats.dfHist[b];
+    json << "]},\n"
+         << "  \"queries\": {\"count\": " << queries.size() << ", \"labelled\": " << labelled
+         << ", \"synthetic\": " << opt.synthetic << ", \"clip_seconds\": " << opt.clipSeconds
+         << ", \"snr_db\": ";
+    if (std::isnan(opt.snrDb)) json << "null"; else json << opt.snrDb;
+    json << ", \"gain_db\": " << opt.gainDb << ", \"seed\": " << opt.seed
+         << ", \"hashes\": " << hashes << ", \"hits\": " << hits << "},\n"
+         << "  \"accuracy\": {\"top1\": " << (labelled ? static_cast<double>(top1) / labelled : 0)
+         << ", \"top5\": " << (labelled ? static_cast<double>(top5) / labelled : 0) << "},\n"
+         << "  \"throughput\": {\"threads\": " << opt.threads << ", \"seconds\": " << wall
+         << ", \"qps\": " << qps << ", \"qps_per_core\": " << qps / opt.threads << "},\n";
+    if (opt.batch > 0) {
+        double batchQps = queries.size() / batch.seconds;
+        json << "  \"batch\": {\"size\": " << opt.batch << ", \"seconds\": " << batch.seconds
+             << ", \"qps\": " << batchQps << ", \"speedup\": " << batchQps / qps
+             << ", \"top1\": " << (labelled ? static_cast<double>(batch.top1) / labelled : 0)
+             << ", \"postings_decoded\": " << batch.postings << "},\n";
+    }
+    json << "  \"latency_ms\": {";
+    vector<double> v(results.size());
+    for (int s = 0; s < NUM_STAGES; ++s) {
+        double sum = 0;
+        for (size_t i = 0; i < results.size(); ++i) { v[i] = results[i].stage[s] * 1e3; sum += v[i]; }
+        json << (s ? ",\n" : "\n") << "    \"" << STAGE_NAMES[s] << "\": {\"mean\": " << sum / v.size()
+             << ", \"p50\": " << percentile(v, 0.50) << ", \"p90\": " << percentile(v, 0.90)
+             << ", \"p99\": " << percentile(v, 0.99) << "}";
+    }
+    json << "\n  }\n}\n";
+
+    cerr << queries.size() << " queries (" << labelled << " labelled): top-1 " << top1 << ", top-5 " << top5
+         << "; " << qps << " queries/s on " << opt.threads << " threads\n";
+    if (opt.batch > 0)
+        cerr << "batches of " << opt.batch << ": top-1 " << batch.top1 << ", "
+             << queries.size() / batch.seconds << " queries/s\n";
+    if (opt.output.empty()) {
+        cout << json.str();
+    } else {
+        ofstream out(opt.output);
+        out << json.str();
+        if (!out) { cerr << "cannot write " << opt.output << "\n"; return 1; }
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+// Offline catalog loader: decodes and fingerprints many files in parallel and
+// writes them into data/index.bin in one merge, instead of POSTing each file
+// to /upload. Songs already in the data directory are kept. Run it while the
+// server is stopped.
+//
+//   ./bulk_ingest [-j threads] [-d data_dir] [-s i/N] <directory | manifest>
+//
+// A directory is scanned recursively for audio files (name = file name). A
+// manifest has one `path<TAB>name<TAB>youtube_url` line per song; name and
+// url are optional. With -s only every Nth file from the i-th on is loaded,
+// to build shard i of N (see shards.h).
+#include "audio.h"
+#include "dsp.h"
+#include "engine.h"
+#include "fingerprint.h"
+#include "index.h"
+#include "store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace {
+    // Postings a worker buffers before sorting them into a compressed run.
+    static const size_t RUN_POSTINGS = 1u << 23;
+
+    double seconds_since(chrono::steady_clock::time_point t0) {
+        return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    }
+}
+
+int main(int argc, char** argv) {
+    string dataDir = "./data";
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    string src;
+    int shard = 0, shards = 1;
+    bool badShard = false;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "-j" && i + 1 < argc) threads = max(1, atoi(argv[++i]));
+        else if (a == "-d" && i + 1 < argc) dataDir = argv[++i];
+        else if (a == "-s" && i + 1 < argc)
+            badShard = sscanf(argv[++i], "%d/%d", &shard, &shards) != 2 || shards < 1 || shard < 0 || shard >= shards;
+        else src = a;
+    }
+    if (src.empty() || badShard) {
+        cerr << "usage: " << argv[0] << " [-j threads] [-d data_dir] [-s i/N] <directory | manifest>\n";
+        return 2;
+    }
+
+    vector<AudioSource> jobs;
+    if (!collect_audio_sources(src, jobs)) {
+        cerr << "cannot read " << src << "\n";
+        return 1;
+    }
+    if (shards > 1) {
+        vector<AudioSource> mine;
+        for (size_t j = static_cast<size_t>(shard); j < jobs.size(); j += static_cast<size_t>(shards))
+            mine.push_back(std::move(jobs[j]));
+        jobs.swap(mine);
+    }
+
+    const string indexPath = dataDir + "/index.bin";
+    const string deltaPath = dataDir + "/delta.log";
+    fs::create_directories(dataDir);
+    if (fs::exists(dataDir + "/delta.compacting.log")) {
+        cerr << "an interrupted compaction is pending; start the server once to recover it\n";
+        return 1;
+    }
+
+    // The existing catalog: base file plus songs still in the delta log, less
+    // the songs deleted since the base was written (their postings are
+    // dropped in the merge). New files are fingerprinted with its profile;
+    // MUSICREC_PROFILE picks the profile of a new catalog.
+    const FingerprintProfile& wanted = profile_from_env();
+    const FingerprintProfile* profile = nullptr;
+    shared_ptr<const IndexFile> base;
+    if (fs::exists(indexPath)) {
+        base.reset(IndexFile::open(indexPath));
+        if (!base) return 1;
+        profile = find_profile(base->profile());
+        if (!profile) {
+            cerr << indexPath << " uses unknown fingerprint profile " << base->profile() << "\n";
+            return 1;
+        }
+        if (base->sample_rate() != static_cast<uint32_t>(profile->sampleRate)) {
+            cerr << indexPath << " was built at " << base->sample_rate() << " Hz, not "
+                 << profile->sampleRate << " Hz; move it aside to rebuild\n";
+            return 1;
+        }
+    }
+    vector<Song> songs;
+    if (base) base->read_songs(songs);
+    vector<pair<uint32_t, Posting>> deltaEntries;
+    Tombstones dead;
+    size_t otherRate = 0;
+    DeltaLog::replay(deltaPath, [&](const Song& song, uint32_t rate, uint32_t fpProfile,
+                                    const vector<pair<uint32_t,int32_t>>& fps) {
+        if (song.id != static_cast<int>(songs.size())) return; // compacted, or a gap
+        if (!profile) profile = find_profile(fpProfile);
+        if (!profile || fpProfile != profile->id || rate != static_cast<uint32_t>(profile->sampleRate)) {
+            ++otherRate;
+            return;
+        }
+        for (const auto& fp : fps) deltaEntries.emplace_back(fp.first, Posting{ song.id, fp.second });
+        songs.push_back(song);
+    }, [&](int songId) {
+        if (songId < 0 || songId >= static_cast<int>(songs.size()) || songs[songId].numFingerprints == 0) return;
+        dead.kill(songId);
+        songs[songId].numFingerprints = 0;
+    });
+    if (otherRate) {
+        cerr << deltaPath << " holds songs fingerprinted with another profile or sample rate\n";
+        return 1;
+    }
+    if (!profile) profile = &wanted;
+    if (profile != &wanted && getenv("MUSICREC_PROFILE"))
+        cerr << "ignoring MUSICREC_PROFILE=" << wanted.name << ": " << dataDir
+             << " is fingerprinted with the " << profile->name << " profile\n";
+    set_active_profile(*profile);
+    unique_ptr<FlatSegment> delta;
+    if (!deltaEntries.empty()) delta.reset(FlatSegment::from_entries(deltaEntries));
+    vector<pair<uint32_t, Posting>>().swap(deltaEntries);
+    const size_t existing = songs.size();
+
+    dsp_init(dataDir, profile->windowSize);
+    cerr << "Ingesting " << jobs.size() << " files on " << threads << " threads ("
+         << existing << " songs already in " << dataDir << ", " << profile->name << " profile)\n";
+
+    // Workers tag postings with the job index; ids are assigned once we know
+    // which files decoded. Each worker sorts its postings into compressed runs.
+    vector<size_t> counts(jobs.size(), 0);
+    vector<unique_ptr<FlatSegment>> runs;
+    std::mutex runsMtx;
+    atomic<size_t> nextJob{0}, done{0}, totalFps{0};
+    auto t0 = chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        vector<pair<uint32_t, Posting>> run;
+        auto flush = [&]() {
+            if (run.empty()) return;
+            FlatSegment* seg = FlatSegment::from_entries(run);
+            run.clear();
+            std::lock_guard<std::mutex> lock(runsMtx);
+            runs.emplace_back(seg);
+        };
+        for (size_t j; (j = nextJob.fetch_add(1)) < jobs.size(); ) {
+            // Decoded a block at a time straight into the fingerprinter.
+            AudioStream in;
+            if (!in.open(jobs[j].path) || in.rate() <= 0) continue;
+            const int rate = in.rate();
+            const size_t mark = run.size();
+            int32_t tag = static_cast<int32_t>(j);
+            Fingerprinter fp([&](uint32_t h, int32_t offset){ run.emplace_back(h, Posting{ tag, offset }); }, rate);
+            uint64_t samples = 0;
+            size_t got = 0;
+            while (const float* block = in.next(got)) {
+                fp.push(block, got);
+                samples += got;
+            }
+            if (samples * profile->sampleRate < static_cast<uint64_t>(profile->windowSize) * rate) {
+                run.resize(mark);
+                cerr << "too short, skipped: " << jobs[j].path << "\n";
+                continue;
+            }
+            fp.finish();
+            counts[j] = fp.hashes();
+            totalFps += fp.hashes();
+            if (run.size() >= RUN_POSTINGS) flush();
+            size_t n = ++done;
+            if (n % 1000 == 0)
+                cerr << "  " << n << " files, " << static_cast<size_t>(n / seconds_since(t0)) << " files/s\n";
+        }
+        flush();
+    };
+    vector<thread> pool;
+    for (unsigned i = 0; i < threads; ++i) pool.emplace_back(worker);
+    for (auto& t : pool) t.join();
+    double fpSecs = seconds_since(t0);
+
+    vector<int32_t> songIdOf(jobs.size(), -1);
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        if (counts[j] == 0) continue;
+        songIdOf[j] = static_cast<int32_t>(songs.size());
+        songs.push_back(Song{ songIdOf[j], jobs[j].name, counts[j], jobs[j].url });
+    }
+    size_t added = songs.size() - existing;
+    if (added == 0) {
+        cerr << "no files could be fingerprinted\n";
+        return 1;
+    }
+
+    // One pass over the old catalog and all runs, in hash order.
+    auto t1 = chrono::steady_clock::now();
+    vector<const FlatIndex*> oldParts, newParts;
+    if (base) oldParts.push_back(&base->index());
+    if (delta) oldParts.push_back(delta.get());
+    for (const auto& r : runs) newParts.push_back(r.get());
+    FlatMerger oldMerger(oldParts), newMerger(newParts);
+    size_t purged = 0;
+    PostingSource oldNext = dead.purged([&](uint32_t& h, vector<Posting>& out){ return oldMerger.next(h, out); }, &purged);
+    uint32_t oldHash = 0, newHash = 0;
+    vector<Posting> oldList, newList;
+    bool oldMore = oldNext(oldHash, oldList);
+    bool newMore = newMerger.next(newHash, newList);
+    HashStats stats;
+    bool ok = write_index_file(indexPath, songs, profile->sampleRate, profile->id, [&](uint32_t& h, vector<Posting>& out) {
+        if (!oldMore && !newMore) return false;
+        h = (!newMore || (oldMore && oldHash <= newHash)) ? oldHash : newHash;
+        out.clear();
+        if (oldMore && oldHash == h) {
+            out.swap(oldList);
+            oldMore = oldNext(oldHash, oldList);
+        }
+        if (newMore && newHash == h) {
+            for (const auto& p : newList) out.push_back(Posting{ songIdOf[p.songId], p.offset });
+            newMore = newMerger.next(newHash, newList);
+        }
+        return true;
+    }, &stats);
+    if (!ok) return 1;
+    // Everything the delta log held is in the base file now.
+    std::error_code ec;
+    fs::remove(deltaPath, ec);
+    double mergeSecs = seconds_since(t1);
+
+    cerr << "Added " << added << " songs (" << (jobs.size() - added) << " failed), "
+         << totalFps.load() << " fingerprints\n"
+         << "  fingerprinting: " << fpSecs << " s, "
+         << static_cast<size_t>(jobs.size() / fpSecs) << " files/s, "
+         << static_cast<size_t>(totalFps.load() / fpSecs) << " fingerprints/s\n"
+         << "  merge + write:  " << mergeSecs << " s, " << runs.size() << " runs -> "
+         << indexPath << " (" << songs.size() << " songs)\n"
+         << "  " << stats.summary() << "\n";
+    if (dead.count())
+        cerr << "  dropped " << purged << " postings of " << dead.count() << " deleted songs\n";
+    return 0;
+}
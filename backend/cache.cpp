@@ -0,0 +1,106 @@
+#include "cache.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+    // Signature positions per band: with 16 bands of 2, queries sharing 70%
+    // of their hashes share a band with near certainty.
+    static const size_t BAND_ROWS = 2;
+    static const size_t BANDS = SIGNATURE_SIZE / BAND_ROWS;
+
+    // MurmurHash3's 64-bit finalizer.
+    inline uint64_t fmix64(uint64_t k) {
+        k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    uint64_t band_key(const QuerySignature& sig, size_t band) {
+        uint64_t k = fmix64(band + 1);
+        for (size_t r = 0; r < BAND_ROWS; ++r) k = fmix64(k ^ sig.min[band * BAND_ROWS + r]);
+        return k;
+    }
+}
+
+QuerySignature query_signature(const pair<uint32_t, int32_t>* hashes, size_t n) {
+    QuerySignature sig;
+    fill(begin(sig.min), end(sig.min), UINT32_MAX);
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t h = fmix64(hashes[i].first);
+        // Position k keys the mix with k times the golden ratio.
+        for (size_t k = 0; k < SIGNATURE_SIZE; ++k) {
+            const uint32_t v = static_cast<uint32_t>(fmix64(h + k * 0x9e3779b97f4a7c15ULL));
+            sig.min[k] = min(sig.min[k], v);
+        }
+    }
+    return sig;
+}
+
+double signature_similarity(const QuerySignature& a, const QuerySignature& b) {
+    size_t same = 0;
+    for (size_t k = 0; k < SIGNATURE_SIZE; ++k) same += a.min[k] == b.min[k];
+    return static_cast<double>(same) / SIGNATURE_SIZE;
+}
+
+ResultCache::ResultCache(size_t capacity, chrono::seconds ttl)
+    : capacity_((capacity * BANDS + SHARDS - 1) / SHARDS), ttl_(ttl), shards_(new Shard[SHARDS]) {}
+
+bool ResultCache::find(const QuerySignature& sig, uint64_t catalog, string& reply) {
+    if (!enabled()) return false;
+    const auto now = chrono::steady_clock::now();
+    for (size_t b = 0; b < BANDS; ++b) {
+        const uint64_t key = band_key(sig, b);
+        Shard& s = shards_[key % SHARDS];
+        lock_guard<mutex> lock(s.mtx);
+        auto it = s.byBand.find(key);
+        if (it == s.byBand.end()) continue;
+        const Entry& e = *it->second->second;
+        if (e.catalog != catalog || e.expires <= now) {
+            s.lru.erase(it->second);
+            s.byBand.erase(it);
+            continue;
+        }
+        if (signature_similarity(sig, e.sig) < REUSE_SIMILARITY) continue;
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        reply = e.reply;
+        return true;
+    }
+    return false;
+}
+
+void ResultCache::insert(const QuerySignature& sig, uint64_t catalog, string reply) {
+    if (!enabled()) return;
+    auto e = make_shared<Entry>();
+    e->sig = sig;
+    e->catalog = catalog;
+    e->expires = chrono::steady_clock::now() + ttl_;
+    e->reply = std::move(reply);
+    for (size_t b = 0; b < BANDS; ++b) {
+        const uint64_t key = band_key(sig, b);
+        Shard& s = shards_[key % SHARDS];
+        lock_guard<mutex> lock(s.mtx);
+        auto it = s.byBand.find(key);
+        if (it != s.byBand.end()) {
+            it->second->second = e;
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            continue;
+        }
+        s.lru.emplace_front(key, e);
+        s.byBand.emplace(key, s.lru.begin());
+        while (s.lru.size() > capacity_) {
+            s.byBand.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+    }
+}
+
+size_t ResultCache::size() const {
+    size_t keys = 0;
+    for (size_t i = 0; i < SHARDS; ++i) {
+        lock_guard<mutex> lock(shards_[i].mtx);
+        keys += shards_[i].lru.size();
+    }
+    return keys / BANDS;
+}
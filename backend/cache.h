@@ -0,0 +1,67 @@
+#pragma once
+// Recognition result cache. A query is keyed by a MinHash signature of its
+// hash set, so a retry or another recording of the same segment (resampled,
+// re-encoded, a little noisier) finds the earlier reply even though its
+// hashes are not identical. Signatures are split into bands; a cached reply
+// is a candidate if any band matches, and is used only if the signatures
+// agree at REUSE_SIMILARITY or more (the reply's score and alignment belong to
+// the query that made it) and it was made for the current catalog.
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static const size_t SIGNATURE_SIZE = 32;
+// Signature agreement needed to reuse a reply: the same clip again, or a
+// clean resampled copy (~0.97). Clips of different songs reach ~0.35, as
+// common hashes are shared across the catalog.
+static const double REUSE_SIMILARITY = 0.95;
+
+// The minimum of a keyed hash over the query's distinct hashes, per key.
+// Two queries agree at each position with probability equal to the Jaccard
+// similarity of their hash sets.
+struct QuerySignature {
+    uint32_t min[SIGNATURE_SIZE];
+};
+QuerySignature query_signature(const std::pair<uint32_t, int32_t>* hashes, size_t n);
+// Fraction of positions where `a` and `b` agree.
+double signature_similarity(const QuerySignature& a, const QuerySignature& b);
+
+// A bounded LRU of replies, split into shards by band key so concurrent
+// queries rarely share a lock. Entries expire after `ttl` and are dropped
+// once the catalog they were made for has changed.
+class ResultCache {
+public:
+    ResultCache(size_t capacity, std::chrono::seconds ttl);
+    bool enabled() const { return capacity_ > 0; }
+
+    // The reply cached for a query like `sig` made against catalog `catalog`.
+    bool find(const QuerySignature& sig, uint64_t catalog, std::string& reply);
+    void insert(const QuerySignature& sig, uint64_t catalog, std::string reply);
+    size_t size() const;  // replies held, estimated from band keys
+
+private:
+    struct Entry {
+        QuerySignature sig;
+        uint64_t catalog;
+        std::chrono::steady_clock::time_point expires;
+        std::string reply;
+    };
+    using Lru = std::list<std::pair<uint64_t, std::shared_ptr<const Entry>>>;
+    struct Shard {
+        mutable std::mutex mtx;
+        Lru lru;  // most recently used first
+        std::unordered_map<uint64_t, Lru::iterator> byBand;
+    };
+    static const size_t SHARDS = 16;
+
+    size_t capacity_;      // band keys held per shard
+    std::chrono::seconds ttl_;
+    std::unique_ptr<Shard[]> shards_;
+};
@@ -0,0 +1,99 @@
+#include "compute.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// A call to parallel_for() posts one ticket per helper it could use. A pool
+// thread that takes a ticket joins the job unless the caller has already
+// finished it; the job lives on (shared) until its last ticket is taken,
+// but `f` is only called while the caller waits in parallel_for().
+namespace {
+    struct Job {
+        size_t n;
+        const function<void(unsigned, size_t)>* f;
+        atomic<size_t> next{0};
+        atomic<unsigned> joined{1};      // the caller is thread 0
+        mutex mtx;
+        condition_variable idle;
+        unsigned active = 0;             // pool threads inside run()
+        bool closed = false;             // the caller has returned
+
+        void run(unsigned t) {
+            for (size_t i; (i = next.fetch_add(1)) < n; ) (*f)(t, i);
+        }
+    };
+
+    struct Pool {
+        mutex mtx;
+        condition_variable ready;
+        deque<shared_ptr<Job>> tickets;
+        unsigned size = 0;
+
+        Pool() {
+            const char* v = getenv("MUSICREC_COMPUTE_THREADS");
+            int n = v ? atoi(v) : 0;
+            size = n > 0 ? static_cast<unsigned>(n) : max(1u, thread::hardware_concurrency());
+            for (unsigned i = 0; i < size; ++i) thread([this]{ serve(); }).detach();
+        }
+
+        void serve() {
+            for (;;) {
+                shared_ptr<Job> job;
+                {
+                    unique_lock<mutex> lock(mtx);
+                    ready.wait(lock, [&]{ return !tickets.empty(); });
+                    job = std::move(tickets.front());
+                    tickets.pop_front();
+                }
+                {
+                    lock_guard<mutex> lock(job->mtx);
+                    if (job->closed || job->next.load() >= job->n) continue;
+                    ++job->active;
+                }
+                job->run(job->joined.fetch_add(1));
+                lock_guard<mutex> lock(job->mtx);
+                if (--job->active == 0) job->idle.notify_all();
+            }
+        }
+    };
+
+    // Never destroyed: pool threads may still be waiting during exit.
+    Pool& pool() {
+        static Pool& p = *new Pool();
+        return p;
+    }
+}
+
+namespace compute {
+
+unsigned max_threads() { return pool().size + 1; }
+
+void parallel_for(size_t n, unsigned threads, const function<void(unsigned, size_t)>& f) {
+    const size_t useful = min<size_t>(min(max(threads, 1u), max_threads()), n);
+    const size_t helpers = useful > 1 ? useful - 1 : 0;
+    auto job = make_shared<Job>();
+    job->n = n;
+    job->f = &f;
+    if (helpers > 0) {
+        Pool& p = pool();
+        {
+            lock_guard<mutex> lock(p.mtx);
+            for (size_t i = 0; i < helpers; ++i) p.tickets.push_back(job);
+        }
+        if (helpers == 1) p.ready.notify_one();
+        else p.ready.notify_all();
+    }
+    job->run(0);
+    unique_lock<mutex> lock(job->mtx);
+    job->closed = true;
+    job->idle.wait(lock, [&]{ return job->active == 0; });
+}
+
+} // namespace compute
@@ -0,0 +1,22 @@
+#pragma once
+// One process-wide pool of compute threads for requests that split their
+// work (batches, /monitor). The pool has a fixed size however many requests
+// fan out at once: a caller always works on its own job, and is joined by
+// whichever pool threads are idle, so a busy pool slows a request down
+// instead of adding threads.
+#include <cstddef>
+#include <functional>
+
+namespace compute {
+
+// Threads a parallel_for() may use, the caller's included: the pool's size
+// (MUSICREC_COMPUTE_THREADS, default the CPU count) plus one.
+unsigned max_threads();
+
+// Runs f(t, i) for i in 0..n-1 on the calling thread and up to threads-1
+// idle pool threads. `t` (0 for the caller, below `threads`) identifies the
+// thread within this call, e.g. to pick a per-thread buffer. Returns once
+// every f has returned.
+void parallel_for(size_t n, unsigned threads, const std::function<void(unsigned t, size_t i)>& f);
+
+} // namespace compute
@@ -0,0 +1,87 @@
+#include "dsp.h"
+#include "kernels.h"
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+namespace {
+    struct Plan {
+        fftw_plan plan;
+        vector<double> window;
+    };
+
+    // Plans are made once per size and never destroyed. The FFTW planner is
+    // not thread-safe; every planner call goes through PLANNER_MTX.
+    std::mutex PLANNER_MTX;
+    map<int, Plan> PLANS;
+
+    void hann_window(vector<double>& win) {
+        int N = static_cast<int>(win.size());
+        for (int i = 0; i < N; ++i) {
+            win[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / (N - 1));
+        }
+    }
+
+    // Caller holds PLANNER_MTX.
+    const Plan& get_plan(int n, unsigned flags) {
+        auto it = PLANS.find(n);
+        if (it != PLANS.end()) return it->second;
+        double* in = static_cast<double*>(fftw_malloc(sizeof(double) * n));
+        fftw_complex* out = static_cast<fftw_complex*>(fftw_malloc(sizeof(fftw_complex) * (n/2 + 1)));
+        Plan& p = PLANS[n];
+        p.plan = fftw_plan_dft_r2c_1d(n, in, out, flags);
+        fftw_free(in);
+        fftw_free(out);
+        p.window.assign(n, 0.0);
+        hann_window(p.window);
+        return p;
+    }
+}
+
+void dsp_init(const string& data_dir, int n) {
+    std::lock_guard<std::mutex> lock(PLANNER_MTX);
+    if (PLANS.count(n)) return;
+    string wisdom = data_dir + "/fftw.wisdom";
+    bool had = fftw_import_wisdom_from_filename(wisdom.c_str()) != 0;
+    const char* patient = getenv("MUSICREC_FFTW_PATIENT");
+    unsigned flags = (patient && string(patient) == "1") ? FFTW_PATIENT : FFTW_MEASURE;
+    get_plan(n, flags);
+    if (!fftw_export_wisdom_to_filename(wisdom.c_str()))
+        cerr << "dsp: could not save FFTW wisdom to " << wisdom << "\n";
+    cerr << "FFT plan: n=" << n << (had ? " (with saved wisdom)" : " (measured)")
+         << ", kernels=" << kernel_isa() << "\n";
+}
+
+DspContext::DspContext(int n) : n_(n) {
+    {
+        std::lock_guard<std::mutex> lock(PLANNER_MTX);
+        // Sizes nobody passed to dsp_init get a cheaply estimated plan.
+        const Plan& p = get_plan(n, FFTW_ESTIMATE);
+        plan_ = p.plan;
+        window_ = p.window.data();
+    }
+    in_ = static_cast<double*>(fftw_malloc(sizeof(double) * n));
+    out_ = static_cast<fftw_complex*>(fftw_malloc(sizeof(fftw_complex) * (n/2 + 1)));
+}
+
+DspContext::~DspContext() {
+    fftw_free(in_);
+    fftw_free(out_);
+}
+
+void DspContext::execute() {
+    fftw_execute_dft_r2c(plan_, in_, out_);
+}
+
+DspContext& dsp_context(int n) {
+    thread_local vector<unique_ptr<DspContext>> contexts;
+    for (auto& c : contexts)
+        if (c->size() == n) return *c;
+    contexts.emplace_back(new DspContext(n));
+    return *contexts.back();
+}
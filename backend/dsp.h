@@ -0,0 +1,38 @@
+#pragma once
+// FFT plan cache and per-thread DSP scratch space.
+#include <fftw3.h>
+#include <string>
+#include <vector>
+
+// Plans the real FFT of size `n` for the whole process. FFTW wisdom is
+// loaded from and saved to `data_dir`/fftw.wisdom, so only the first start
+// pays for FFTW_MEASURE (or FFTW_PATIENT with MUSICREC_FFTW_PATIENT=1).
+void dsp_init(const std::string& data_dir, int n);
+
+// Aligned FFT buffers and the analysis window for one thread.
+// All threads share one plan per size (new-array execution is thread-safe),
+// so after dsp_init creating a context never runs the FFTW planner again.
+class DspContext {
+public:
+    explicit DspContext(int n);
+    ~DspContext();
+    DspContext(const DspContext&) = delete;
+    DspContext& operator=(const DspContext&) = delete;
+
+    int size() const { return n_; }
+    double* in() { return in_; }
+    const fftw_complex* out() const { return out_; }
+    const double* window() const { return window_; }
+    // Transforms in() into out().
+    void execute();
+
+private:
+    int n_;
+    double* in_;
+    fftw_complex* out_;
+    const double* window_;
+    fftw_plan plan_;
+};
+
+// The calling thread's context for transforms of size `n`, created on first use.
+DspContext& dsp_context(int n);
@@ -1,261 +1,1178 @@
 #include "engine.h"
-#include <sndfile.h>
-#include <fftw3.h>
-#include <cmath>
+#include "audio.h"
+#include "batch.h"
+#include "cache.h"
+#include "compute.h"
+#include "dsp.h"
+#include "fingerprint.h"
+#include "index.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "scoring.h"
+#include "store.h"
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <unordered_map>
 
 using namespace std;
 
 namespace {
-    static const int    WINDOW_SIZE       = 1024;
-    static const int    HOP_SIZE          = 512;
-    static const int    PEAKS_PER_FRAME   = 5;
-    static const int    MIN_FREQ_BIN      = 10;
-    static const int    FAN_MIN_DT        = 1;
-    static const int    FAN_MAX_DT        = 45;
-    static const int    FAN_MAX_TARGETS   = 5;
+    // Delta postings that trigger a background merge into the base index file.
+    static const size_t DELTA_COMPACT_POSTINGS = 1u << 21;
+    // Delta segments allowed before they are merged into one.
+    static const size_t MAX_DELTA_SEGMENTS = 8;
+    // Postings of deleted songs that trigger a merge that drops them, as a
+    // fraction of the index's postings.
+    static const double DEAD_COMPACT_FRACTION = 0.1;
+    // Clips of a batch fingerprinted and looked up in one walk of the index;
+    // bounds the query hashes and decoded lists held.
+    static const size_t BATCH_CLIPS_PER_PASS = 64;
+
+    const char* const STAGE_HELP = "Query time per pipeline stage (lookup is voting on the query's hashes).";
+    metrics::Histogram DECODE_SECONDS("musicrec_query_stage_seconds", R"(stage="decode")", STAGE_HELP);
+    metrics::Histogram RESAMPLE_SECONDS("musicrec_query_stage_seconds", R"(stage="resample")", STAGE_HELP);
+    metrics::Histogram STFT_SECONDS("musicrec_query_stage_seconds", R"(stage="stft")", STAGE_HELP);
+    metrics::Histogram PEAKS_SECONDS("musicrec_query_stage_seconds", R"(stage="peaks")", STAGE_HELP);
+    metrics::Histogram LOOKUP_SECONDS("musicrec_query_stage_seconds", R"(stage="lookup")", STAGE_HELP);
+    metrics::Histogram RANK_SECONDS("musicrec_query_stage_seconds", R"(stage="rank")", STAGE_HELP);
+    metrics::Histogram QUERY_HASHES("musicrec_query_hashes", "", "Hashes made per query.", metrics::size_buckets());
+    metrics::Histogram QUERY_POSTINGS("musicrec_query_postings_scanned", "",
+                                      "Postings read from the index per query.", metrics::size_buckets());
+    metrics::Counter SKIPPED_LISTS("musicrec_query_skipped_lists_total", "",
+                                   "Posting lists skipped at query time for exceeding MUSICREC_MAX_LIST_POSTINGS.");
+    metrics::Counter SAMPLED_LISTS("musicrec_query_sampled_lists_total", "",
+                                   "Posting lists thinned at query time to MUSICREC_SAMPLE_LIST_POSTINGS votes.");
+    const char* const CACHE_HELP = "Recognitions answered from the result cache, or not.";
+    metrics::Counter CACHE_HITS("musicrec_result_cache_requests_total", R"(result="hit")", CACHE_HELP);
+    metrics::Counter CACHE_MISSES("musicrec_result_cache_requests_total", R"(result="miss")", CACHE_HELP);
+    metrics::Counter BATCH_CLIPS("musicrec_batch_clips_total", "", "Clips recognized through identify_batch.");
+    metrics::Histogram BATCH_SECONDS("musicrec_batch_seconds", "",
+                                     "Time to look up and rank one pass of a batch (up to 64 clips).");
+    metrics::Histogram MONITOR_SECONDS("musicrec_monitor_audio_seconds", "", "Audio scanned per monitor request, in seconds.",
+                                       metrics::size_buckets());
+    metrics::Histogram INGEST_SECONDS("musicrec_ingest_seconds", "", "Decode-to-publish time per uploaded song.");
+    metrics::Histogram WRITE_LOCK_WAIT("musicrec_lock_wait_seconds", R"(lock="write")",
+                                       "Time spent blocked on a contended lock.");
 }
 
-struct Fingerprint {
-    uint64_t hash;
-    int songId;
-    int offset;
+// Readers see the catalog through an immutable Snapshot: the mmap'd base file
+// plus delta segments for songs added since the last compaction (mirrored by
+// the append-only delta log). Writers serialize on WRITE_MTX, build a new
+// Snapshot and publish it; readers never lock, and old snapshots are freed by
+// epoch-based reclamation once no reader can still hold them.
+//
+// A deleted song keeps its id and its slot in `songs`, with no fingerprints,
+// and is tombstoned in `dead` until a merge has dropped its postings.
+struct Snapshot {
+    uint64_t version = 0;
+    shared_ptr<const IndexFile> base;
+    // base->index(), or a MapIndex copy of it when MUSICREC_INDEX=map is set
+    // (for comparing the two index engines).
+    shared_ptr<const PostingIndex> baseIndex;
+    vector<shared_ptr<const FlatSegment>> deltas; // oldest first
+    shared_ptr<const vector<Song>> songs;
+    size_t live = 0;                              // songs not deleted
+    shared_ptr<const Tombstones> dead;            // never null
 };
 
-struct Peak {
-    int t;
-    int f;
-    float mag;
-};
+static RcuPtr<Snapshot> SNAPSHOT;
+static std::mutex WRITE_MTX;
+static std::condition_variable COMPACT_CV;
+static size_t FROZEN_DELTAS = 0;   // leading deltas owned by a running compaction
+static size_t DELTA_POSTINGS = 0;  // postings in the other deltas
+// Postings of tombstoned songs not yet dropped; written under WRITE_MTX.
+static std::atomic<size_t> DEAD_POSTINGS{0};
+static DeltaLog DELTA_LOG;
+static std::string DATA_DIR = ".";
 
-static inline uint64_t make_hash(uint16_t f1, uint16_t f2, uint16_t dt) {
-    f1 &= 0x3FF; f2 &= 0x3FF; dt &= 0x0FFF;
-    uint64_t h = (static_cast<uint64_t>(f1) << 22)
-               | (static_cast<uint64_t>(f2) << 12)
-               | (static_cast<uint64_t>(dt));
-    return h;
+// This process's shard (MUSICREC_SHARD=i/N); 0 of 1 when unsharded.
+static int SHARD_INDEX = 0;
+static int SHARD_COUNT = 1;
+
+// Replies of recent recognitions (cache.h), keyed to the snapshot version
+// they were made against, so any catalog change retires them.
+static ResultCache& result_cache() {
+    static ResultCache cache = [] {
+        auto env = [](const char* name, double def) {
+            const char* v = getenv(name);
+            return v ? atof(v) : def;
+        };
+        return ResultCache(static_cast<size_t>(max(0.0, env("MUSICREC_CACHE_ENTRIES", 4096))),
+                           std::chrono::seconds(static_cast<long>(max(1.0, env("MUSICREC_CACHE_TTL", 300)))));
+    }();
+    return cache;
 }
 
-static unordered_map<uint64_t, vector<pair<int,int>>> FP_DB;
-static vector<Song> SONGS;
-static std::mutex DB_MTX;
-static std::string DATA_DIR = ".";
+static string index_path()      { return DATA_DIR + "/index.bin"; }
+static string delta_path()      { return DATA_DIR + "/delta.log"; }
+static string compacting_path() { return DATA_DIR + "/delta.compacting.log"; }
 
-static bool load_audio_mono(const string& path, vector<double>& mono, int& rate) {
-    SF_INFO info{};
-    SNDFILE* snd = sf_open(path.c_str(), SFM_READ, &info);
-    if (!snd) {
-        cerr << "sf_open failed for " << path << "\n";
-        return false;
-    }
-    rate = info.samplerate;
-    vector<double> buf(static_cast<size_t>(info.frames) * info.channels);
-    sf_count_t got = sf_readf_double(snd, buf.data(), info.frames);
-    sf_close(snd);
-    if (got <= 0) return false;
-    mono.resize(static_cast<size_t>(got));
-    if (info.channels == 1) {
-        for (sf_count_t i = 0; i < got; ++i) mono[i] = buf[i];
-    } else {
-        for (sf_count_t i = 0; i < got; ++i) {
-            double s = 0.0;
-            for (int c = 0; c < info.channels; ++c)
-                s += buf[static_cast<size_t>(i)*info.channels + c];
-            mono[i] = s / info.channels;
-        }
-    }
-    return true;
+// Gathers the postings of `hash` across the base and delta segments (in song
+// order: each song lives in one segment, and segments are oldest first),
+// skipping lists longer than the policy allows.
+static void lookup_postings(const Snapshot& snap, uint32_t hash, vector<Posting>& out) {
+    const size_t limit = hash_policy().maxListPostings;
+    out.clear();
+    if (snap.baseIndex && snap.baseIndex->lookup(hash, out, limit) > limit) SKIPPED_LISTS.inc();
+    for (const auto& d : snap.deltas)
+        if (d->lookup(hash, out, limit) > limit) SKIPPED_LISTS.inc();
+}
+
+// Looks `hash` up and votes for each posting found, weighted by how many
+// songs share the hash when IDF weighting is on (or by `weight`, if given). A
+// long list votes through an even sample of its postings, so each query hash
+// costs a bounded number of votes. Returns the postings read.
+static size_t vote_hash(const Snapshot& snap, uint32_t hash, int32_t qOffset,
+                        vector<Posting>& hits, VoteScorer& scorer, const uint8_t* weight = nullptr) {
+    lookup_postings(snap, hash, hits);
+    const size_t read = hits.size();
+    if (snap.dead->count()) snap.dead->purge(hits);
+    if (hits.empty()) return read;
+    const HashPolicy& policy = hash_policy();
+    uint8_t w = weight ? *weight : policy.idf ? idf_weight(distinct_songs(hits), snap.live) : UNIT_WEIGHT;
+    if (sample_postings(hits, 0, policy.sampleListPostings)) SAMPLED_LISTS.inc();
+    for (const auto& m : hits) scorer.add(m.songId, m.offset, qOffset, w);
+    return read;
 }
 
-static void hann_window(vector<double>& win) {
-    int N = static_cast<int>(win.size());
-    for (int i = 0; i < N; ++i) {
-        win[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / (N - 1));
+static shared_ptr<const PostingIndex> make_base_index(const shared_ptr<const IndexFile>& file) {
+    if (!file) return nullptr;
+    const char* engine = getenv("MUSICREC_INDEX");
+    if (!engine || string(engine) != "map") return shared_ptr<const PostingIndex>(file, &file->index());
+    auto map = make_shared<MapIndex>();
+    vector<Posting> pl;
+    for (size_t i = 0; i < file->index().num_hashes(); ++i) {
+        pl.clear();
+        file->index().decode_at(i, pl);
+        for (const auto& p : pl) map->add(file->index().hash_at(i), p);
     }
+    return map;
+}
+
+// Merges the unfrozen tail of `deltas` into one segment once it grows too
+// long, so lookups touch a bounded number of segments, dropping the postings
+// of songs in `dead` on the way. Caller holds WRITE_MTX.
+static void merge_deltas(vector<shared_ptr<const FlatSegment>>& deltas, const Tombstones& dead) {
+    if (deltas.size() - FROZEN_DELTAS <= MAX_DELTA_SEGMENTS) return;
+    vector<const FlatIndex*> parts;
+    for (size_t i = FROZEN_DELTAS; i < deltas.size(); ++i) parts.push_back(deltas[i].get());
+    FlatMerger merger(parts);
+    size_t purged = 0;
+    auto merged = make_shared<const FlatSegment>(
+        dead.purged([&](uint32_t& h, vector<Posting>& out){ return merger.next(h, out); }, &purged));
+    deltas.resize(FROZEN_DELTAS);
+    deltas.push_back(std::move(merged));
+    DELTA_POSTINGS -= purged;
+    DEAD_POSTINGS -= purged;
 }
 
-static void compute_spectrogram(const vector<double>& mono, vector<vector<float>>& spec) {
-    if (mono.size() < static_cast<size_t>(WINDOW_SIZE)) { spec.clear(); return; }
-    int numFrames = 1 + static_cast<int>((mono.size() - WINDOW_SIZE) / HOP_SIZE);
-    spec.assign(numFrames, vector<float>(WINDOW_SIZE/2, 0.0f));
+// Postings in the base file and the deltas. Caller holds WRITE_MTX.
+static size_t index_postings(const Snapshot& snap) {
+    size_t n = snap.baseIndex ? snap.baseIndex->num_postings() : 0;
+    for (const auto& d : snap.deltas) n += d->num_postings();
+    return n;
+}
+
+// True once the deltas or the postings of deleted songs are worth a merge
+// into the base file. Caller holds WRITE_MTX.
+static bool compaction_due() {
+    if (DELTA_POSTINGS >= DELTA_COMPACT_POSTINGS) return true;
+    return DEAD_POSTINGS > 0 && DEAD_POSTINGS >= DEAD_COMPACT_FRACTION * index_postings(*SNAPSHOT.load());
+}
+
+// Appends the live delta log onto an orphaned compacting log and makes the
+// result the live log again. Caller holds WRITE_MTX with DELTA_LOG closed.
+static void fold_compacting_log() {
+    std::error_code ec;
+    if (!std::filesystem::exists(compacting_path(), ec)) return;
+    FILE* dst = fopen(compacting_path().c_str(), "ab");
+    FILE* src = fopen(delta_path().c_str(), "rb");
+    if (dst && src) {
+        char buf[1 << 16]; size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), src)) > 0) fwrite(buf, 1, n, dst);
+    }
+    if (src) fclose(src);
+    if (dst) fclose(dst);
+    std::filesystem::rename(compacting_path(), delta_path(), ec);
+}
 
-    vector<double> window(WINDOW_SIZE, 0.0);
-    hann_window(window);
+// New records are tagged with the catalog's rate and profile.
+static void open_delta_log() {
+    const FingerprintProfile& profile = active_profile();
+    DELTA_LOG.open(delta_path(), static_cast<uint32_t>(profile.sampleRate), profile.id);
+}
 
-    double* in = (double*) fftw_malloc(sizeof(double) * WINDOW_SIZE);
-    fftw_complex* out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * (WINDOW_SIZE/2 + 1));
-    fftw_plan plan = fftw_plan_dft_r2c_1d(WINDOW_SIZE, in, out, FFTW_ESTIMATE);
+// Gives a failed compaction's segments back to the live delta.
+static void abort_compaction(size_t frozenPostings) {
+    std::lock_guard<std::mutex> lock(WRITE_MTX);
+    DELTA_LOG.close();
+    fold_compacting_log();
+    open_delta_log();
+    FROZEN_DELTAS = 0;
+    DELTA_POSTINGS += frozenPostings;
+}
 
-    for (int t = 0; t < numFrames; ++t) {
-        size_t start = static_cast<size_t>(t) * HOP_SIZE;
-        for (int i = 0; i < WINDOW_SIZE; ++i) in[i] = mono[start + i] * window[i];
-        fftw_execute(plan);
-        for (int k = 0; k < WINDOW_SIZE/2; ++k) {
-            double re = out[k][0], im = out[k][1];
-            double mag = sqrt(re*re + im*im);
-            float db = static_cast<float>(20.0 * log10(mag + 1e-9));
-            spec[t][k] = db;
+// Merges the base file and the frozen deltas into a new base file, dropping
+// the postings of the songs deleted so far. Holds WRITE_MTX only to freeze
+// and to publish, so uploads and deletes continue meanwhile and queries are
+// never blocked; songs deleted after the freeze stay tombstoned.
+static bool compact_once() {
+    shared_ptr<const IndexFile> base;
+    vector<shared_ptr<const FlatSegment>> frozen;
+    shared_ptr<const vector<Song>> songs;
+    shared_ptr<const Tombstones> dead;
+    size_t frozenPostings = 0, deadPostings = 0, live = 0;
+    {
+        std::unique_lock<std::mutex> lock(WRITE_MTX, std::defer_lock);
+        metrics::lock(lock, WRITE_LOCK_WAIT);
+        const Snapshot* cur = SNAPSHOT.load(); // stable: only replaced under WRITE_MTX
+        if (cur->deltas.empty() && cur->dead->count() == 0) return true;
+        DELTA_LOG.close();
+        if (rename(delta_path().c_str(), compacting_path().c_str()) != 0) {
+            perror("rename delta log");
+            open_delta_log();
+            return false;
         }
+        open_delta_log();
+        base = cur->base;
+        frozen = cur->deltas;
+        songs = cur->songs;
+        live = cur->live;
+        dead = cur->dead;
+        FROZEN_DELTAS = frozen.size();
+        frozenPostings = DELTA_POSTINGS;
+        DELTA_POSTINGS = 0;
+        deadPostings = DEAD_POSTINGS;
     }
-    fftw_destroy_plan(plan);
-    fftw_free(in);
-    fftw_free(out);
-}
-
-static void pick_peaks(const vector<vector<float>>& spec, vector<Peak>& peaks) {
-    peaks.clear();
-    if (spec.empty()) return;
-    const int T = static_cast<int>(spec.size());
-    const int F = static_cast<int>(spec[0].size());
-    for (int t = 0; t < T; ++t) {
-        vector<pair<float,int>> mags; mags.reserve(F);
-        for (int f = MIN_FREQ_BIN; f < F; ++f) mags.emplace_back(spec[t][f], f);
-        if ((int)mags.size() > PEAKS_PER_FRAME) {
-            nth_element(mags.begin(), mags.begin()+PEAKS_PER_FRAME, mags.end(),
-                        [](const auto& a, const auto& b){ return a.first > b.first; });
-            mags.resize(PEAKS_PER_FRAME);
+
+    vector<const FlatIndex*> parts;
+    if (base) parts.push_back(&base->index());
+    for (const auto& d : frozen) parts.push_back(d.get());
+    FlatMerger merger(parts);
+    shared_ptr<const IndexFile> fresh;
+    HashStats stats;
+    size_t purged = 0;
+    if (write_index_file(index_path(), *songs, active_profile().sampleRate, active_profile().id,
+                         dead->purged([&](uint32_t& h, vector<Posting>& out){ return merger.next(h, out); }, &purged),
+                         &stats))
+        fresh.reset(IndexFile::open(index_path()));
+    if (!fresh) {
+        abort_compaction(frozenPostings);
+        return false;
+    }
+    {
+        std::unique_lock<std::mutex> lock(WRITE_MTX, std::defer_lock);
+        metrics::lock(lock, WRITE_LOCK_WAIT);
+        const Snapshot* cur = SNAPSHOT.load();
+        Snapshot* next = new Snapshot();
+        next->version = cur->version + 1;
+        next->base = fresh;
+        next->baseIndex = make_base_index(fresh);
+        next->deltas.assign(cur->deltas.begin() + FROZEN_DELTAS, cur->deltas.end());
+        next->songs = cur->songs;
+        next->live = cur->live;
+        if (dead->count()) {
+            auto live = make_shared<Tombstones>(*cur->dead);
+            live->forget(*dead);
+            next->dead = std::move(live);
+        } else {
+            next->dead = cur->dead;
         }
-        for (const auto& mf : mags) peaks.push_back(Peak{ t, mf.second, mf.first });
+        FROZEN_DELTAS = 0;
+        // Postings counted for a song deleted before the freeze are gone,
+        // including those the hash policy had already left out.
+        DEAD_POSTINGS -= deadPostings;
+        SNAPSHOT.publish(next);
     }
-    sort(peaks.begin(), peaks.end(), [](const Peak& a, const Peak& b){
-        if (a.t != b.t) return a.t < b.t;
-        return a.f < b.f;
-    });
+    remove(compacting_path().c_str());
+    cerr << "Compacted index: " << live << " songs, "
+         << fresh->index().num_postings() << " postings, "
+         << fresh->index().memory_bytes() << " index bytes, "
+         << purged << " postings of " << dead->count() << " deleted songs dropped\n"
+         << "  " << stats.summary() << "\n";
+    return true;
 }
 
-static void make_fingerprints(const vector<Peak>& peaks, vector<Fingerprint>& fps, int songId) {
-    fps.clear();
-    if (peaks.empty()) return;
-    int maxT = 0; for (const auto& p : peaks) if (p.t > maxT) maxT = p.t;
-    vector<vector<int>> byT(maxT + 1);
-    for (int i = 0; i < (int)peaks.size(); ++i) byT[peaks[i].t].push_back(i);
-
-    for (int i = 0; i < (int)peaks.size(); ++i) {
-        const Peak& anchor = peaks[i];
-        int fanCount = 0;
-        for (int dt = FAN_MIN_DT; dt <= FAN_MAX_DT && fanCount < FAN_MAX_TARGETS; ++dt) {
-            int tt = anchor.t + dt;
-            if (tt > maxT) break;
-            for (int idx : byT[tt]) {
-                const Peak& target = peaks[idx];
-                uint16_t f1 = static_cast<uint16_t>(anchor.f);
-                uint16_t f2 = static_cast<uint16_t>(target.f);
-                uint16_t d  = static_cast<uint16_t>(dt);
-                uint64_t h = make_hash(f1, f2, d);
-                fps.push_back(Fingerprint{ h, songId, anchor.t });
-                ++fanCount;
-                if (fanCount >= FAN_MAX_TARGETS) break;
-            }
+static void compactor_loop() {
+    std::unique_lock<std::mutex> lock(WRITE_MTX);
+    while (true) {
+        // Wake up now and then to free snapshots whose last reader has left.
+        if (!COMPACT_CV.wait_for(lock, std::chrono::seconds(1), compaction_due)) {
+            lock.unlock();
+            rcu::collect();
+            lock.lock();
+            continue;
         }
+        lock.unlock();
+        if (!compact_once()) std::this_thread::sleep_for(std::chrono::seconds(60));
+        lock.lock();
     }
 }
 
+static size_t open_sessions();
+
+// Catalog and index size, read from the current snapshot at scrape time.
+static void register_gauges() {
+    auto with_snapshot = [](double (*f)(const Snapshot&)) {
+        return [f]{ rcu::ReadGuard guard; return f(*SNAPSHOT.load()); };
+    };
+    metrics::gauge("musicrec_songs", "", "Songs in the catalog.",
+                   with_snapshot([](const Snapshot& s){ return static_cast<double>(s.live); }));
+    metrics::gauge("musicrec_tombstones", "", "Deleted songs whose postings are still in the index.",
+                   with_snapshot([](const Snapshot& s){ return static_cast<double>(s.dead->count()); }));
+    metrics::gauge("musicrec_dead_postings", "", "Postings of deleted songs not yet dropped by a merge.",
+                   []{ return static_cast<double>(DEAD_POSTINGS.load()); });
+    metrics::gauge("musicrec_index_postings", R"(segment="base")", "Postings in the index.",
+                   with_snapshot([](const Snapshot& s){ return s.baseIndex ? static_cast<double>(s.baseIndex->num_postings()) : 0.0; }));
+    metrics::gauge("musicrec_index_postings", R"(segment="delta")", "Postings in the index.",
+                   with_snapshot([](const Snapshot& s){
+                       double n = 0;
+                       for (const auto& d : s.deltas) n += static_cast<double>(d->num_postings());
+                       return n;
+                   }));
+    metrics::gauge("musicrec_index_bytes", "", "Memory held by the index, base and delta segments.",
+                   with_snapshot([](const Snapshot& s){
+                       double n = s.baseIndex ? static_cast<double>(s.baseIndex->memory_bytes()) : 0.0;
+                       for (const auto& d : s.deltas) n += static_cast<double>(d->memory_bytes());
+                       return n;
+                   }));
+    metrics::gauge("musicrec_delta_segments", "", "Delta segments not yet compacted into index.bin.",
+                   with_snapshot([](const Snapshot& s){ return static_cast<double>(s.deltas.size()); }));
+    metrics::gauge("musicrec_snapshot_version", "", "Catalog snapshots published since startup.",
+                   with_snapshot([](const Snapshot& s){ return static_cast<double>(s.version); }));
+    metrics::gauge("musicrec_rcu_pending", "", "Retired snapshots waiting for readers to leave.",
+                   []{ return static_cast<double>(rcu::pending()); });
+    metrics::gauge("musicrec_result_cache_entries", "", "Replies held by the result cache.",
+                   []{ return static_cast<double>(result_cache().size()); });
+    metrics::gauge("musicrec_stream_sessions", "", "Open streaming recognition sessions.",
+                   []{ return static_cast<double>(open_sessions()); });
+}
+
+static int global_id(int songId) { return songId * SHARD_COUNT + SHARD_INDEX; }
+// The local id of a global id, or -1 if the song is another shard's.
+static int local_id(int globalId) {
+    return globalId >= 0 && globalId % SHARD_COUNT == SHARD_INDEX ? globalId / SHARD_COUNT : -1;
+}
+
+static void load_shard_config() {
+    const char* v = getenv("MUSICREC_SHARD");
+    if (!v || !*v) return;
+    int i = -1, n = 0;
+    if (sscanf(v, "%d/%d", &i, &n) != 2 || n < 1 || i < 0 || i >= n) {
+        cerr << "Ignoring MUSICREC_SHARD=" << v << " (expected i/N with 0 <= i < N)\n";
+        return;
+    }
+    SHARD_INDEX = i;
+    SHARD_COUNT = n;
+    cerr << "Serving shard " << i << " of " << n << "\n";
+}
+
 void engine_init(const std::string& data_dir) {
     DATA_DIR = data_dir;
+    load_shard_config();
     std::filesystem::create_directories(DATA_DIR);
     std::filesystem::create_directories(DATA_DIR + "/uploads");
     std::filesystem::create_directories(DATA_DIR + "/queries");
+
+    std::lock_guard<std::mutex> lock(WRITE_MTX);
+    Snapshot* snap = new Snapshot();
+    snap->base.reset(IndexFile::open(index_path()));
+    // Starting empty would let the next compaction overwrite the catalog.
+    std::error_code ec;
+    if (!snap->base && std::filesystem::exists(index_path(), ec)) {
+        cerr << "Refusing to start: " << index_path() << " cannot be used\n";
+        exit(1);
+    }
+    // The catalog's profile: the base file's, else the delta log's first
+    // record's, else MUSICREC_PROFILE for a new catalog.
+    const FingerprintProfile& wanted = profile_from_env();
+    const FingerprintProfile* profile = nullptr;
+    if (snap->base) {
+        profile = find_profile(snap->base->profile());
+        if (!profile) {
+            cerr << "Refusing to start: " << index_path() << " uses unknown fingerprint profile "
+                 << snap->base->profile() << "\n";
+            exit(1);
+        }
+        if (snap->base->sample_rate() != static_cast<uint32_t>(profile->sampleRate)) {
+            cerr << "Refusing to start: " << index_path() << " was built at "
+                 << snap->base->sample_rate() << " Hz, fingerprints are now made at "
+                 << profile->sampleRate << " Hz; rebuild it from the audio with bulk_ingest\n";
+            exit(1);
+        }
+    }
+    snap->baseIndex = make_base_index(snap->base);
+    auto songs = make_shared<vector<Song>>();
+    if (snap->base) snap->base->read_songs(*songs);
+
+    // A compaction interrupted by a crash leaves its input log behind; fold the
+    // newer log onto it so everything not yet in the base replays in order.
+    fold_compacting_log();
+
+    size_t replayed = 0, otherRate = 0;
+    vector<pair<uint32_t, Posting>> entries;
+    auto dead = make_shared<Tombstones>();
+    DeltaLog::replay(delta_path(), [&](const Song& song, uint32_t rate, uint32_t fpProfile,
+                                       const vector<pair<uint32_t,int32_t>>& fps) {
+        if (song.id < static_cast<int>(songs->size())) return; // already compacted
+        if (song.id != static_cast<int>(songs->size())) return; // gap: ignore the rest
+        if (!profile) profile = find_profile(fpProfile);
+        if (!profile || fpProfile != profile->id || rate != static_cast<uint32_t>(profile->sampleRate)) {
+            ++otherRate;
+            return;
+        }
+        for (const auto& fp : fps) entries.emplace_back(fp.first, Posting{ song.id, fp.second });
+        DELTA_POSTINGS += fps.size();
+        songs->push_back(song);
+        ++replayed;
+    }, [&](int songId) {
+        if (songId < 0 || songId >= static_cast<int>(songs->size())) return;
+        Song& song = (*songs)[songId];
+        if (song.numFingerprints == 0) return; // deleted before the last compaction
+        dead->kill(songId);
+        DEAD_POSTINGS += song.numFingerprints;
+        song.numFingerprints = 0;
+    });
+    if (otherRate) {
+        cerr << "Refusing to start: " << delta_path() << " holds songs fingerprinted with another"
+             << " profile or sample rate; move it aside and upload them again\n";
+        exit(1);
+    }
+    if (!profile) profile = &wanted;
+    if (profile != &wanted && getenv("MUSICREC_PROFILE"))
+        cerr << "Ignoring MUSICREC_PROFILE=" << wanted.name << ": the catalog in " << DATA_DIR
+             << " is fingerprinted with the " << profile->name << " profile\n";
+    set_active_profile(*profile);
+    dsp_init(DATA_DIR, profile->windowSize);
+    if (!entries.empty()) snap->deltas.emplace_back(FlatSegment::from_entries(entries));
+    snap->songs = songs;
+    snap->live = static_cast<size_t>(count_if(songs->begin(), songs->end(),
+                                              [](const Song& s){ return s.numFingerprints > 0; }));
+    snap->dead = dead;
+    open_delta_log();
+
+    cerr << "Index: " << snap->live << " songs ("
+         << (snap->baseIndex ? snap->baseIndex->num_postings() : 0) << " base postings in "
+         << (snap->baseIndex ? snap->baseIndex->memory_bytes() : 0) << " bytes, "
+         << replayed << " songs replayed from delta log, "
+         << dead->count() << " deleted songs awaiting a merge, "
+         << profile->name << " fingerprint profile)\n";
+    SNAPSHOT.publish(snap);
+    register_gauges();
+
+    std::thread(compactor_loop).detach();
+    COMPACT_CV.notify_one();
 }
 
-int add_song_to_db(const string& path, const string& displayName, const string& youtube_url) {
-    vector<double> mono; int rate = 0;
-    if (!load_audio_mono(path, mono, rate)) return -1;
-    if (mono.size() < static_cast<size_t>(1024)) return -1;
+// True if `n` samples at `rate` do not fill one analysis window.
+static bool too_short(size_t n, int rate) {
+    const FingerprintProfile& profile = active_profile();
+    return static_cast<uint64_t>(n) * profile.sampleRate < static_cast<uint64_t>(profile.windowSize) * rate;
+}
 
-    vector<vector<float>> spec; compute_spectrogram(mono, spec);
-    if (spec.empty()) return -1;
+// Pushes the rest of `in` into `fp` a block at a time; returns the samples
+// pushed. Adds the time spent decoding to `*decodeSeconds` if given.
+static size_t push_stream(AudioStream& in, Fingerprinter& fp, double* decodeSeconds = nullptr) {
+    size_t total = 0, n = 0;
+    while (true) {
+        auto t0 = decodeSeconds ? metrics::Clock::now() : metrics::Clock::time_point();
+        const float* block = in.next(n);
+        if (decodeSeconds) *decodeSeconds += chrono::duration<double>(metrics::Clock::now() - t0).count();
+        if (!block) break;
+        fp.push(block, n);
+        total += n;
+    }
+    return total;
+}
 
-    vector<Peak> peaks; pick_peaks(spec, peaks);
-    if (peaks.empty()) return -1;
+// Fingerprints a song into `rec`; false if it is unusable. Only the song's
+// hashes are held, never its decoded audio.
+static bool fingerprint_song(AudioStream& in, vector<pair<uint32_t,int32_t>>& rec) {
+    const int rate = in.rate();
+    if (rate <= 0) return false;
+    Fingerprinter fp([&](uint32_t h, int32_t offset){ rec.emplace_back(h, offset); }, rate);
+    if (too_short(push_stream(in, fp), rate)) return false;
+    fp.finish();
+    return !rec.empty();
+}
 
-    vector<Fingerprint> fps; int songId;
-    {
-        std::lock_guard<std::mutex> lock(DB_MTX);
-        songId = static_cast<int>(SONGS.size());
-        make_fingerprints(peaks, fps, songId);
-        if (fps.empty()) return -1;
-        for (const auto& fp : fps) FP_DB[fp.hash].emplace_back(fp.songId, fp.offset);
-        SONGS.push_back(Song{ songId, displayName, fps.size(), youtube_url });
-    }
-    cerr << "Added: [" << songId << "] " << displayName
-         << " peaks=" << peaks.size()
-         << " fps=" << fps.size() << "\n";
-    return songId;
+// True if local song `songId` exists and is not deleted.
+static bool song_live(const Snapshot& snap, int songId) {
+    return songId >= 0 && songId < static_cast<int>(snap.songs->size()) && (*snap.songs)[songId].numFingerprints > 0;
 }
 
-std::vector<Song> get_song_list() {
-    std::lock_guard<std::mutex> lock(DB_MTX);
-    return SONGS;
+// Tombstones `songId` in `next` (a copy of the current snapshot, whose
+// `songs` it owns). Caller holds WRITE_MTX and has logged the delete.
+static void retire_song(Snapshot& next, vector<Song>& songs, int songId) {
+    auto dead = make_shared<Tombstones>(*next.dead);
+    dead->kill(songId);
+    next.dead = std::move(dead);
+    DEAD_POSTINGS += songs[songId].numFingerprints;
+    songs[songId].numFingerprints = 0;
+    --next.live;
 }
 
-static string identify_from_samples(const vector<double>& mono) {
-    if (mono.size() < static_cast<size_t>(1024)) return R"({"error":"too_short"})";
+// Logs and publishes a new song with fingerprints `rec`, in the same snapshot
+// as the deletion of local song `replaces` unless that is -1. Returns the new
+// song's local id, -1 if it could not be logged, or -2 if `replaces` is not a
+// live song.
+static int publish_song(const vector<pair<uint32_t,int32_t>>& rec, const string& displayName,
+                        const string& youtube_url, int replaces) {
+    int songId;
+    bool retired = false;
     {
-        std::lock_guard<std::mutex> lock(DB_MTX);
-        if (SONGS.empty()) return R"({"error":"db_empty"})";
+        std::unique_lock<std::mutex> lock(WRITE_MTX, std::defer_lock);
+        metrics::lock(lock, WRITE_LOCK_WAIT);
+        const Snapshot* cur = SNAPSHOT.load();
+        if (replaces >= 0 && !song_live(*cur, replaces)) return -2;
+        songId = static_cast<int>(cur->songs->size());
+        Song song{ songId, displayName, rec.size(), youtube_url };
+        if (replaces >= 0) {
+            if (song.name.empty()) song.name = (*cur->songs)[replaces].name;
+            if (song.youtube_url.empty()) song.youtube_url = (*cur->songs)[replaces].youtube_url;
+        }
+        // The new song is logged first: a crash in between leaves both, not neither.
+        if (!DELTA_LOG.append(song, rec)) return -1;
+        retired = replaces >= 0 && DELTA_LOG.append_delete(replaces);
+        vector<pair<uint32_t, Posting>> entries; entries.reserve(rec.size());
+        for (const auto& r : rec) entries.emplace_back(r.first, Posting{ songId, r.second });
+
+        Snapshot* next = new Snapshot(*cur);
+        next->version = cur->version + 1;
+        auto songs = make_shared<vector<Song>>(*cur->songs);
+        songs->push_back(std::move(song));
+        if (retired) retire_song(*next, *songs, replaces);
+        next->deltas.emplace_back(FlatSegment::from_entries(entries));
+        merge_deltas(next->deltas, *next->dead);
+        next->songs = std::move(songs);
+        ++next->live;
+        DELTA_POSTINGS += rec.size();
+        SNAPSHOT.publish(next);
     }
-    vector<vector<float>> spec; compute_spectrogram(mono, spec);
-    vector<Peak> peaks; pick_peaks(spec, peaks);
-    vector<Fingerprint> qfps; make_fingerprints(peaks, qfps, -1);
-    if (qfps.empty()) return R"({"error":"no_query_fps"})";
+    COMPACT_CV.notify_one();
+    cerr << "Added: [" << songId << "] " << displayName << " fps=" << rec.size();
+    if (retired) cerr << ", replacing [" << replaces << "]";
+    cerr << "\n";
+    return songId;
+}
 
-    unordered_map<int, unordered_map<int,int>> votes;
-    int bestSong=-1, bestCount=0, bestOffset=0;
+static int add_song_from_stream(AudioStream& in, const string& displayName, const string& youtube_url) {
+    vector<pair<uint32_t,int32_t>> rec;
+    if (!fingerprint_song(in, rec)) return -1;
+    return publish_song(rec, displayName, youtube_url, -1);
+}
+
+int add_song_to_db(const string& path, const string& displayName, const string& youtube_url) {
+    auto t0 = metrics::start();
+    AudioStream in;
+    if (!in.open(path)) return -1;
+    int id = add_song_from_stream(in, displayName, youtube_url);
+    INGEST_SECONDS.observe_since(t0);
+    return id < 0 ? -1 : global_id(id);
+}
+
+int add_song_from_buffer(const void* data, size_t size, const string& displayName, const string& youtube_url) {
+    auto t0 = metrics::start();
+    AudioStream in;
+    if (!in.open(data, size)) return -1;
+    int id = add_song_from_stream(in, displayName, youtube_url);
+    INGEST_SECONDS.observe_since(t0);
+    return id < 0 ? -1 : global_id(id);
+}
 
+int replace_song_from_buffer(int songId, const void* data, size_t size,
+                             const string& displayName, const string& youtube_url) {
+    const int local = local_id(songId);
     {
-        std::lock_guard<std::mutex> lock(DB_MTX);
-        for (const auto& q : qfps) {
-            auto it = FP_DB.find(q.hash);
-            if (it == FP_DB.end()) continue;
-            for (const auto& m : it->second) {
-                int songId = m.first;
-                int dbOffset = m.second;
-                int delta = dbOffset - q.offset;
-                int c = ++votes[songId][delta];
-                if (c > bestCount) { bestCount = c; bestSong = songId; bestOffset = delta; }
-            }
-        }
+        rcu::ReadGuard guard;
+        if (!song_live(*SNAPSHOT.load(), local)) return -2;
     }
+    auto t0 = metrics::start();
+    AudioStream in;
+    vector<pair<uint32_t,int32_t>> rec;
+    if (!in.open(data, size) || !fingerprint_song(in, rec)) return -1;
+    int id = publish_song(rec, displayName, youtube_url, local);
+    INGEST_SECONDS.observe_since(t0);
+    return id < 0 ? id : global_id(id);
+}
 
-    if (bestSong < 0) return R"({"match":null,"score":0})";
+bool delete_song(int songId) {
+    const int local = local_id(songId);
+    {
+        std::unique_lock<std::mutex> lock(WRITE_MTX, std::defer_lock);
+        metrics::lock(lock, WRITE_LOCK_WAIT);
+        const Snapshot* cur = SNAPSHOT.load();
+        if (!song_live(*cur, local) || !DELTA_LOG.append_delete(local)) return false;
+        Snapshot* next = new Snapshot(*cur);
+        next->version = cur->version + 1;
+        auto songs = make_shared<vector<Song>>(*cur->songs);
+        retire_song(*next, *songs, local);
+        next->songs = std::move(songs);
+        SNAPSHOT.publish(next);
+    }
+    COMPACT_CV.notify_one();
+    cerr << "Deleted: [" << local << "]\n";
+    return true;
+}
 
-    vector<pair<int,int>> perSong;
-    for (auto& kv : votes) {
-        int sId = kv.first;
-        int top = 0;
-        for (auto& dv : kv.second) top = max(top, dv.second);
-        perSong.emplace_back(top, sId);
+std::vector<Song> get_song_list() {
+    rcu::ReadGuard guard;
+    vector<Song> songs;
+    for (const auto& s : *SNAPSHOT.load()->songs) {
+        if (s.numFingerprints == 0) continue;
+        songs.push_back(s);
+        songs.back().id = global_id(s.id);
     }
-    sort(perSong.begin(), perSong.end(), greater<>());
+    return songs;
+}
+
+uint64_t catalog_version() {
+    rcu::ReadGuard guard;
+    return SNAPSHOT.load()->version;
+}
+
+std::string hits_json(const std::vector<SearchHit>& top, const std::string& fields) {
+    if (top.empty()) return "{" + fields + R"("match":null,"score":0})";
 
     std::ostringstream oss;
-    oss << R"({"match":)" << bestSong
-        << R"(,"name":")" << SONGS[bestSong].name << R"(")"
+    oss << "{" << fields << R"("match":)" << top[0].songId
+        << R"(,"name":")" << top[0].name << R"(")"
         // Add the URL for the main match
-        << R"(,"url":")" << SONGS[bestSong].youtube_url << R"(")"
-        << R"(,"score":)" << bestCount
-        << R"(,"offset_frames":)" << bestOffset
+        << R"(,"url":")" << top[0].url << R"(")"
+        << R"(,"score":)" << top[0].score
+        << R"(,"offset_frames":)" << top[0].offset
         << R"(,"top":[)";
-    for (size_t i=0;i<perSong.size() && i<5;++i) {
+    for (size_t i=0;i<top.size();++i) {
         if (i) oss << ",";
-        oss << R"({"songId":)" << perSong[i].second
-            << R"(,"name":")" << SONGS[perSong[i].second].name
+        oss << R"({"songId":)" << top[i].songId
+            << R"(,"name":")" << top[i].name
             // Add the URL for each top candidate
-            << R"(","url":")" << SONGS[perSong[i].second].youtube_url
-            << R"(", "score":)" << perSong[i].first << "}";
+            << R"(","url":")" << top[i].url
+            << R"(", "score":)" << top[i].score << "}";
     }
     oss << "]}";
     return oss.str();
 }
 
+static vector<SearchHit> to_hits(const vector<Song>& songs, const vector<SongScore>& top) {
+    vector<SearchHit> hits;
+    for (const auto& s : top) {
+        const Song& song = songs[s.songId];
+        hits.push_back(SearchHit{ global_id(s.songId), s.count, s.delta, song.name, song.youtube_url });
+    }
+    return hits;
+}
+
+// The result object for a ranked query; `fields` (e.g. `"done":true,`) go first.
+static string match_json(const vector<Song>& songs, const vector<SongScore>& top, const string& fields) {
+    return hits_json(to_hits(songs, top), fields);
+}
+
+// Fingerprints a query into `hashes` as it is decoded; "" on success, else
+// the error reply.
+static string fingerprint_stream(AudioStream& in, vector<pair<uint32_t, int32_t>>& hashes) {
+    const int rate = in.rate();
+    if (rate <= 0) return R"({"error":"load_failed"})";
+    hashes.clear();
+    Fingerprinter fp([&](uint32_t h, int32_t qOffset){ hashes.emplace_back(h, qOffset); }, rate);
+    FingerprintTimes times;
+    double decode = 0;
+    const bool timed = metrics::enabled();
+    if (timed) fp.set_times(&times);
+    const size_t n = push_stream(in, fp, timed ? &decode : nullptr);
+    if (n == 0) return R"({"error":"load_failed"})";
+    if (too_short(n, rate)) return R"({"error":"too_short"})";
+    fp.finish();
+    if (hashes.empty()) return R"({"error":"no_query_fps"})";
+    if (timed) {
+        DECODE_SECONDS.observe(decode);
+        RESAMPLE_SECONDS.observe(times.resample);
+        STFT_SECONDS.observe(times.stft);
+        PEAKS_SECONDS.observe(times.peaks);
+        QUERY_HASHES.observe(static_cast<double>(hashes.size()));
+    }
+    return "";
+}
+
+static string identify_from_stream(AudioStream& in) {
+    {
+        rcu::ReadGuard guard;
+        if (SNAPSHOT.load()->live == 0) return R"({"error":"db_empty"})";
+    }
+    thread_local vector<pair<uint32_t, int32_t>> hashes;
+    string err = fingerprint_stream(in, hashes);
+    if (!err.empty()) return err;
+
+    rcu::ReadGuard guard;
+    const Snapshot* snap = SNAPSHOT.load();
+    ResultCache& cache = result_cache();
+    QuerySignature sig;
+    if (cache.enabled()) {
+        sig = query_signature(hashes.data(), hashes.size());
+        string reply;
+        if (cache.find(sig, snap->version, reply)) { CACHE_HITS.inc(); return reply; }
+        CACHE_MISSES.inc();
+    }
+
+    thread_local VoteScorer scorer;
+    scorer.clear();
+    vector<SongScore> top;
+    auto t0 = metrics::start();
+    vector<Posting> hits;
+    size_t scanned = 0;
+    for (const auto& h : hashes) scanned += vote_hash(*snap, h.first, h.second, hits, scorer);
+    LOOKUP_SECONDS.observe_since(t0);
+    QUERY_POSTINGS.observe(static_cast<double>(scanned));
+    t0 = metrics::start();
+    scorer.rank(5, top);
+    RANK_SECONDS.observe_since(t0);
+    string reply = match_json(*snap->songs, top, "");
+    if (cache.enabled()) cache.insert(sig, snap->version, reply);
+    return reply;
+}
+
 std::string identify_from_file(const std::string& path) {
-    vector<double> mono; int rate=0;
-    if (!load_audio_mono(path, mono, rate)) return R"({"error":"load_failed"})";
-    return identify_from_samples(mono);
-}
\ No newline at end of file
+    AudioStream in;
+    if (!in.open(path)) return R"({"error":"load_failed"})";
+    return identify_from_stream(in);
+}
+
+std::string identify_from_buffer(const void* data, size_t size) {
+    AudioStream in;
+    if (!in.open(data, size)) return R"({"error":"load_failed"})";
+    return identify_from_stream(in);
+}
+
+std::vector<std::string> identify_batch(const vector<pair<const void*, size_t>>& clips) {
+    vector<string> out(clips.size());
+    const unsigned threads = compute::max_threads();
+    for (size_t first = 0; first < clips.size(); first += BATCH_CLIPS_PER_PASS) {
+        const size_t m = min(BATCH_CLIPS_PER_PASS, clips.size() - first);
+        vector<vector<pair<uint32_t, int32_t>>> fps(m);
+        compute::parallel_for(m, threads, [&](unsigned, size_t c){ out[first + c] = fingerprint_buffer(clips[first + c].first, clips[first + c].second, fps[c]); });
+
+        rcu::ReadGuard guard;
+        const Snapshot* snap = SNAPSHOT.load();
+        const vector<Song>& songs = *snap->songs;
+        if (snap->live == 0) {
+            for (size_t c = 0; c < m; ++c)
+                if (out[first + c].empty()) out[first + c] = R"({"error":"db_empty"})";
+            continue;
+        }
+        // Clips answered from the cache are left out of the walk.
+        ResultCache& cache = result_cache();
+        vector<QuerySignature> sigs(cache.enabled() ? m : 0);
+        vector<BatchHash> hashes;
+        for (size_t c = 0; c < m; ++c) {
+            if (!out[first + c].empty()) continue;
+            if (cache.enabled()) {
+                sigs[c] = query_signature(fps[c].data(), fps[c].size());
+                if (cache.find(sigs[c], snap->version, out[first + c])) { CACHE_HITS.inc(); continue; }
+                CACHE_MISSES.inc();
+            }
+            for (const auto& h : fps[c]) hashes.push_back(BatchHash{ h.first, static_cast<uint32_t>(c), h.second });
+        }
+        vector<vector<pair<uint32_t, int32_t>>>().swap(fps);
+        auto t0 = metrics::start();
+        vector<const PostingIndex*> parts;
+        if (snap->baseIndex) parts.push_back(snap->baseIndex.get());
+        for (const auto& d : snap->deltas) parts.push_back(d.get());
+        const Tombstones* dead = snap->dead->count() ? snap->dead.get() : nullptr;
+        BatchStats stats = vote_batch(parts, snap->live, hashes, m, threads, dead, [&](size_t c, VoteScorer& scorer) {
+            if (!out[first + c].empty()) return;
+            vector<SongScore> top;
+            scorer.rank(5, top);
+            out[first + c] = match_json(songs, top, "");
+            if (cache.enabled()) cache.insert(sigs[c], snap->version, out[first + c]);
+        });
+        SKIPPED_LISTS.inc(stats.skippedLists);
+        SAMPLED_LISTS.inc(stats.sampledLists);
+        BATCH_SECONDS.observe_since(t0);
+        BATCH_CLIPS.inc(m);
+    }
+    return out;
+}
+
+std::string fingerprint_buffer(const void* data, size_t size, vector<pair<uint32_t, int32_t>>& hashes) {
+    AudioStream in;
+    if (!in.open(data, size)) return R"({"error":"load_failed"})";
+    return fingerprint_stream(in, hashes);
+}
+
+std::vector<uint32_t> hash_songs(const pair<uint32_t, int32_t>* hashes, size_t n, size_t& songs) {
+    rcu::ReadGuard guard;
+    const Snapshot* snap = SNAPSHOT.load();
+    vector<uint32_t> df(n, 0);
+    vector<Posting> hits;
+    for (size_t i = 0; i < n; ++i) {
+        lookup_postings(*snap, hashes[i].first, hits);
+        if (snap->dead->count()) snap->dead->purge(hits);
+        df[i] = static_cast<uint32_t>(distinct_songs(hits));
+    }
+    songs = snap->live;
+    return df;
+}
+
+std::vector<SearchHit> search_hashes(const pair<uint32_t, int32_t>* hashes, size_t n, size_t topN,
+                                     const uint8_t* weights) {
+    thread_local VoteScorer scorer;
+    scorer.clear();
+    vector<SongScore> top;
+
+    rcu::ReadGuard guard;
+    const Snapshot* snap = SNAPSHOT.load();
+    auto t0 = metrics::start();
+    vector<Posting> hits;
+    size_t scanned = 0;
+    for (size_t i = 0; i < n; ++i)
+        scanned += vote_hash(*snap, hashes[i].first, hashes[i].second, hits, scorer, weights ? weights + i : nullptr);
+    LOOKUP_SECONDS.observe_since(t0);
+    QUERY_POSTINGS.observe(static_cast<double>(scanned));
+    t0 = metrics::start();
+    scorer.rank(topN, top);
+    RANK_SECONDS.observe_since(t0);
+    return to_hits(*snap->songs, top);
+}
+// ---- Timeline monitoring ----
+//
+// A long recording is cut into overlapping windows, each recognized on its
+// own; windows are decoded a pass at a time (one per thread the compute pool
+// can lend) and scored in parallel on it, so memory is bounded by a pass
+// whatever the recording's length, and concurrent monitors share the pool's
+// threads instead of starting their own.
+// Confident window matches of one song at one alignment are then joined into
+// segments.
+
+namespace {
+    static const double MONITOR_WINDOW_SECONDS = 10;
+    static const double MONITOR_HOP_SECONDS = 5;
+    // Window matches of one song whose alignments differ by up to this many
+    // frames, with at most this many unmatched windows between them, join.
+    static const double MONITOR_ALIGN_FRAMES = 8;
+    static const size_t MONITOR_MAX_GAP = 1;
+
+    // A window is matched if its best song has at least this score and this
+    // many times the runner-up's.
+    int monitor_min_score() {
+        static const int v = [] {
+            const char* s = getenv("MUSICREC_MONITOR_MIN_SCORE");
+            return s ? max(1, atoi(s)) : 40;
+        }();
+        return v;
+    }
+    double monitor_margin() {
+        static const double v = [] {
+            const char* s = getenv("MUSICREC_MONITOR_MARGIN");
+            return s ? max(1.0, atof(s)) : 2.0;
+        }();
+        return v;
+    }
+
+    struct WindowMatch {
+        int songId = -1;       // -1: no confident match
+        int score = 0;
+        int runnerUp = 0;
+        double align = 0;      // song frame - recording frame
+    };
+
+    struct Segment {
+        int songId;
+        size_t first, last;    // windows
+        size_t matched;        // windows matched within [first, last]
+        int score;             // best window score
+        double align;          // of the first window
+        double confidence;     // sum over matched windows
+    };
+}
+
+static string monitor_stream(AudioStream& in) {
+    const int rate = in.rate();
+    const FingerprintProfile& profile = active_profile();
+    {
+        rcu::ReadGuard guard;
+        if (SNAPSHOT.load()->live == 0) return R"({"error":"db_empty"})";
+    }
+    if (rate <= 0) return R"({"error":"load_failed"})";
+    const size_t window = static_cast<size_t>(MONITOR_WINDOW_SECONDS * rate);
+    const size_t hop = static_cast<size_t>(MONITOR_HOP_SECONDS * rate);
+    const unsigned perPass = compute::max_threads();
+
+    vector<WindowMatch> matches;
+    vector<float> buf;         // samples from bufStart on
+    size_t bufStart = 0;
+    bool eof = false;
+    for (size_t k = 0; ; ) {
+        const size_t need = (k + perPass - 1) * hop + window;
+        while (!eof && bufStart + buf.size() < need)
+            eof = in.read(buf, need - bufStart - buf.size()) == 0;
+        // Whole windows, and a last one if over half full.
+        size_t n = 0;
+        while (n < perPass) {
+            const size_t start = (k + n) * hop;
+            const size_t have = bufStart + buf.size() > start ? bufStart + buf.size() - start : 0;
+            if (have < window && !(eof && have > window / 2)) break;
+            ++n;
+        }
+        if (n == 0) break;
+        matches.resize(k + n);
+
+        rcu::ReadGuard guard;
+        const Snapshot* snap = SNAPSHOT.load();
+        compute::parallel_for(n, perPass, [&](unsigned, size_t i) {
+            const size_t start = (k + i) * hop;
+            const float* samples = buf.data() + (start - bufStart);
+            const size_t len = min(window, bufStart + buf.size() - start);
+            thread_local VoteScorer scorer;
+            thread_local vector<Posting> hits;
+            scorer.clear();
+            auto vote = [&](uint32_t h, int32_t qOffset){ vote_hash(*snap, h, qOffset, hits, scorer); };
+            Fingerprinter fp(std::ref(vote), rate);
+            fp.push(samples, len);
+            fp.finish();
+            vector<SongScore> top;
+            scorer.rank(2, top);
+            if (top.empty()) return;
+            WindowMatch& m = matches[k + i];
+            m.score = top[0].count;
+            m.runnerUp = top.size() > 1 ? top[1].count : 0;
+            if (m.score < monitor_min_score() || m.score < monitor_margin() * max(m.runnerUp, 1)) return;
+            m.songId = top[0].songId;
+            m.align = top[0].delta - static_cast<double>(start) * profile.sampleRate / rate / profile.hopSize;
+        });
+        k += n;
+        const size_t keep = min(k * hop, bufStart + buf.size());
+        buf.erase(buf.begin(), buf.begin() + static_cast<ptrdiff_t>(keep - bufStart));
+        bufStart = keep;
+    }
+    const double seconds = static_cast<double>(bufStart + buf.size()) / rate;
+
+    // Join matched windows into segments; several may be open at once (a
+    // crossfade, or talk over a song that drops some windows).
+    vector<Segment> segments;
+    vector<size_t> open;       // indexes into segments
+    for (size_t k = 0; k < matches.size(); ++k) {
+        const WindowMatch& m = matches[k];
+        open.erase(remove_if(open.begin(), open.end(), [&](size_t s){ return k - segments[s].last > MONITOR_MAX_GAP + 1; }),
+                   open.end());
+        if (m.songId < 0) continue;
+        const double confidence = 1.0 - static_cast<double>(m.runnerUp) / m.score;
+        auto it = find_if(open.begin(), open.end(), [&](size_t s) {
+            return segments[s].songId == m.songId && fabs(segments[s].align - m.align) <= MONITOR_ALIGN_FRAMES;
+        });
+        if (it == open.end()) {
+            open.push_back(segments.size());
+            segments.push_back(Segment{ m.songId, k, k, 1, m.score, m.align, confidence });
+            continue;
+        }
+        Segment& s = segments[*it];
+        s.last = k;
+        ++s.matched;
+        s.score = max(s.score, m.score);
+        s.confidence += confidence;
+    }
+
+    rcu::ReadGuard guard;
+    const vector<Song>& songs = *SNAPSHOT.load()->songs;
+    std::ostringstream oss;
+    oss.setf(std::ios::fixed);
+    oss.precision(2);
+    oss << R"({"seconds":)" << seconds << R"(,"windows":)" << matches.size() << R"(,"segments":[)";
+    bool firstOut = true;
+    for (const auto& s : segments) {
+        if (s.songId >= static_cast<int>(songs.size())) continue;
+        const Song& song = songs[s.songId];
+        // Window bounds, but not before the song itself starts.
+        const double alignSeconds = s.align * profile.hopSize / profile.sampleRate;
+        const double start = max(s.first * MONITOR_HOP_SECONDS, -alignSeconds);
+        const double end = min(seconds, s.last * MONITOR_HOP_SECONDS + MONITOR_WINDOW_SECONDS);
+        oss << (firstOut ? "" : ",")
+            << R"({"songId":)" << global_id(s.songId)
+            << R"(,"name":")" << song.name
+            << R"(","url":")" << song.youtube_url
+            << R"(","start":)" << start
+            << R"(,"end":)" << end
+            << R"(,"song_offset":)" << start + alignSeconds
+            << R"(,"score":)" << s.score
+            // Mean window certainty, scaled by how much of the span matched.
+            << R"(,"confidence":)" << s.confidence / (s.last - s.first + 1)
+            << "}";
+        firstOut = false;
+    }
+    oss << "]}";
+    MONITOR_SECONDS.observe(seconds);
+    return oss.str();
+}
+
+std::string monitor_from_file(const std::string& path) {
+    AudioStream in;
+    if (!in.open(path)) return R"({"error":"load_failed"})";
+    return monitor_stream(in);
+}
+
+std::string monitor_from_buffer(const void* data, size_t size) {
+    AudioStream in;
+    if (!in.open(data, size)) return R"({"error":"load_failed"})";
+    return monitor_stream(in);
+}
+
+// ---- Streaming recognition ----
+//
+// A session owns a Fingerprinter whose hashes are looked up and voted on as
+// each chunk arrives; after every chunk the votes are ranked and the session
+// answers as soon as the leader is clear of the runner-up.
+
+namespace {
+    // Sessions are dropped after this long without a chunk.
+    static const auto SESSION_IDLE = std::chrono::seconds(60);
+    static const size_t MAX_SESSIONS = 1024;
+    // Audio after which a session answers with whatever it has.
+    static const int SESSION_MAX_SECONDS = 30;
+
+    // Early answer: the best song needs at least this many votes at one
+    // offset, and this many times the runner-up's.
+    int stream_min_score() {
+        static const int v = [] {
+            const char* s = getenv("MUSICREC_STREAM_MIN_SCORE");
+            return s ? max(1, atoi(s)) : 40;
+        }();
+        return v;
+    }
+    double stream_margin() {
+        static const double v = [] {
+            const char* s = getenv("MUSICREC_STREAM_MARGIN");
+            return s ? max(1.0, atof(s)) : 4.0;
+        }();
+        return v;
+    }
+}
+
+struct StreamSession {
+    explicit StreamSession(int rate)
+        : rate(rate),
+          fp([this](uint32_t h, int32_t qOffset){
+              vote_hash(*snap, h, qOffset, hits, scorer);
+          }, rate) {}
+
+    std::mutex mtx;                       // chunks of one session run in order
+    int rate;
+    uint64_t samples = 0;
+    const Snapshot* snap = nullptr;       // valid while a chunk is processed
+    vector<Posting> hits;
+    VoteScorer scorer;
+    Fingerprinter fp;
+    chrono::steady_clock::time_point lastUsed = chrono::steady_clock::now();
+};
+
+static std::mutex SESSIONS_MTX;
+static unordered_map<uint64_t, shared_ptr<StreamSession>> SESSIONS;
+
+static size_t open_sessions() {
+    std::lock_guard<std::mutex> lock(SESSIONS_MTX);
+    return SESSIONS.size();
+}
+
+static bool confident(const vector<SongScore>& top) {
+    if (top.empty() || top[0].count < stream_min_score()) return false;
+    int runnerUp = top.size() > 1 ? top[1].count : 0;
+    return top[0].count >= stream_margin() * max(runnerUp, 1);
+}
+
+static shared_ptr<StreamSession> find_session(uint64_t id, bool remove) {
+    std::lock_guard<std::mutex> lock(SESSIONS_MTX);
+    auto it = SESSIONS.find(id);
+    if (it == SESSIONS.end()) return nullptr;
+    auto s = it->second;
+    if (remove) SESSIONS.erase(it);
+    return s;
+}
+
+uint64_t session_open(int sampleRate) {
+    if (!supported_input_rate(sampleRate)) return 0;
+    static thread_local std::mt19937_64 rng{ std::random_device{}() };
+    auto session = make_shared<StreamSession>(sampleRate);
+    auto now = chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(SESSIONS_MTX);
+    for (auto it = SESSIONS.begin(); it != SESSIONS.end(); )
+        it = now - it->second->lastUsed > SESSION_IDLE ? SESSIONS.erase(it) : std::next(it);
+    if (SESSIONS.size() >= MAX_SESSIONS) return 0;
+    uint64_t id;
+    do id = rng() >> 1; while (id == 0 || SESSIONS.count(id));
+    SESSIONS.emplace(id, std::move(session));
+    return id;
+}
+
+// Ranks what the session has heard; `final` answers even without a margin.
+// The session's best `n` songs still live in its snapshot: votes cast before a
+// song was deleted stay in the scorer, so more are ranked until `n` remain.
+static void rank_live(StreamSession& s, size_t n, vector<SongScore>& top) {
+    for (size_t want = n; ; want *= 2) {
+        s.scorer.rank(want, top);
+        const size_t ranked = top.size();
+        top.erase(remove_if(top.begin(), top.end(), [&](const SongScore& t) {
+            return !song_live(*s.snap, t.songId) || s.snap->dead->dead(t.songId);
+        }), top.end());
+        if (top.size() >= n || ranked < want) break;
+    }
+    if (top.size() > n) top.resize(n);
+}
+
+static string session_verdict(StreamSession& s, bool final, bool& done) {
+    vector<SongScore> top;
+    rank_live(s, 5, top);
+    done = final || confident(top);
+    std::ostringstream fields;
+    fields << R"("done":)" << (done ? "true" : "false")
+           << R"(,"seconds":)" << static_cast<double>(s.samples) / s.rate << ",";
+    if (!done) {
+        return "{" + fields.str() + R"("score":)" + to_string(top.empty() ? 0 : top[0].count)
+             + R"(,"runner_up":)" + to_string(top.size() > 1 ? top[1].count : 0) + "}";
+    }
+    return match_json(*s.snap->songs, top, fields.str());
+}
+
+std::string session_feed(uint64_t id, const float* samples, size_t n) {
+    auto session = find_session(id, false);
+    if (!session) return "";
+    StreamSession& s = *session;
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.lastUsed = chrono::steady_clock::now();
+
+    rcu::ReadGuard guard;
+    s.snap = SNAPSHOT.load();
+    if (s.snap->live == 0) { find_session(id, true); return R"({"error":"db_empty"})"; }
+    s.fp.push(samples, n);
+    s.samples += n;
+    bool final = s.samples >= static_cast<uint64_t>(SESSION_MAX_SECONDS) * s.rate;
+    if (final) s.fp.finish();
+    bool done;
+    string verdict = session_verdict(s, final, done);
+    if (done) find_session(id, true);
+    return verdict;
+}
+
+std::string session_close(uint64_t id) {
+    auto session = find_session(id, true);
+    if (!session) return "";
+    StreamSession& s = *session;
+    std::lock_guard<std::mutex> lock(s.mtx);
+    if (too_short(s.samples, s.rate)) return R"({"error":"too_short"})";
+    rcu::ReadGuard guard;
+    s.snap = SNAPSHOT.load();
+    s.fp.finish();
+    bool done;
+    return session_verdict(s, true, done);
+}
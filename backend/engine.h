@@ -1,16 +1,77 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 struct Song {
     int id;
     std::string name;
-    size_t numFingerprints;
+    size_t numFingerprints;  // 0 once deleted
     std::string youtube_url; // <-- ADD THIS LINE
 };
 
 void engine_init(const std::string& data_dir);
-// Update function signature to accept the URL
+// Both return the new song's id (global, see Sharding), or -1 if the audio
+// cannot be fingerprinted.
 int add_song_to_db(const std::string& path, const std::string& displayName, const std::string& youtube_url = "");
+// Decodes from an in-memory file image (e.g. an HTTP request body) instead of a path.
+int add_song_from_buffer(const void* data, size_t size, const std::string& displayName, const std::string& youtube_url = "");
 std::string identify_from_file(const std::string& path);
-std::vector<Song> get_song_list();
\ No newline at end of file
+std::string identify_from_buffer(const void* data, size_t size);
+// Recognizes many clips together: they are fingerprinted in parallel on the
+// shared compute pool (compute.h) and their hashes looked up in one walk of
+// the index in hash order (batch.h).
+// One reply per clip, as identify_from_buffer() would give.
+std::vector<std::string> identify_batch(const std::vector<std::pair<const void*, size_t>>& clips);
+// Timeline monitoring: finds every catalog song played in a long recording
+// (a broadcast, a DJ set). The audio is decoded block by block and recognized
+// in overlapping windows on all cores; the reply lists one
+// {"songId","name","url","start","end","song_offset","score","confidence"}
+// segment (times in seconds) per stretch where one song plays.
+std::string monitor_from_file(const std::string& path);
+std::string monitor_from_buffer(const void* data, size_t size);
+// Online edits. A deleted song disappears from replies and from
+// get_song_list() at once; its postings are skipped until a background merge
+// drops them. delete_song() is false for an unknown or already deleted id.
+// A replacement gets a new id and takes the old one's name and url unless
+// given; it returns -1 if the audio is unusable, -2 for an unknown id.
+bool delete_song(int songId);
+int replace_song_from_buffer(int songId, const void* data, size_t size,
+                             const std::string& displayName = "", const std::string& youtube_url = "");
+// The songs not deleted.
+std::vector<Song> get_song_list();
+// Changes whenever the catalog does (uploads, compaction), so callers can
+// keep what they derive from get_song_list() until it moves.
+uint64_t catalog_version();
+// Streaming recognition: open a session for mono float samples at `sampleRate`
+// (0 if the rate is unusable or too many sessions are open), feed it chunks as
+// they are recorded, and read "done" in each reply; a done reply carries the
+// match and ends the session. session_close() answers with what was heard.
+// Both return "" for an unknown or expired session.
+uint64_t session_open(int sampleRate);
+std::string session_feed(uint64_t id, const float* samples, size_t n);
+std::string session_close(uint64_t id);
+
+// ---- Sharding ----
+// With MUSICREC_SHARD=i/N this process holds shard i of N: its songs report
+// global ids (local id * N + i) everywhere, so a front end can merge shards.
+// A front end fingerprints a query once with fingerprint_buffer() ("" on
+// success, else the error reply) and sends the hashes to every shard, which
+// ranks them with search_hashes(). For IDF weights that match one process
+// holding the whole catalog, it first sums each shard's hash_songs().
+struct SearchHit {
+    int songId;
+    int score;
+    int32_t offset;
+    std::string name;
+    std::string url;
+};
+std::string fingerprint_buffer(const void* data, size_t size, std::vector<std::pair<uint32_t, int32_t>>& hashes);
+// Live songs of this process holding each hash, and its live song count in `songs`.
+std::vector<uint32_t> hash_songs(const std::pair<uint32_t, int32_t>* hashes, size_t n, size_t& songs);
+// `weights` (one per hash) replace this process's own IDF weights when given.
+std::vector<SearchHit> search_hashes(const std::pair<uint32_t, int32_t>* hashes, size_t n, size_t topN,
+                                     const uint8_t* weights = nullptr);
+// The recognize reply for ranked hits; `fields` (e.g. `"done":true,`) go first.
+std::string hits_json(const std::vector<SearchHit>& top, const std::string& fields);
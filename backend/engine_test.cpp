@@ -0,0 +1,459 @@
+// Checks of the posting list coding and directory seeks of the flat index,
+// vote ranking, resampling, the result cache (reuse threshold, ttl, catalog versions), and of catalog
+// edits against a temporary data directory: deletes, replacements,
+// the merge that drops a deleted song's postings, and a restart replaying the
+// delta log's delete (SNGD) records.
+// The engine keeps one catalog per process, so each phase runs in a child
+// process and a restart is the next child opening the same directory.
+// Exits non-zero if anything differs.
+//
+//   ./engine_test
+#include "cache.h"
+#include "engine.h"
+#include "index.h"
+#include "resample.h"
+#include "scoring.h"
+#include "store.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Outside the anonymous namespace, so std algorithms find them for Posting.
+static bool operator<(const Posting& a, const Posting& b) {
+    return a.songId != b.songId ? a.songId < b.songId : a.offset < b.offset;
+}
+static bool operator==(const Posting& a, const Posting& b) { return a.songId == b.songId && a.offset == b.offset; }
+
+namespace {
+    const int RATE = 11025;
+    // Enough songs that the phase 1 edits stay below the dead-posting
+    // fraction that starts a merge, so their deletes are only in the log.
+    const int SONGS = 24;
+    // Audio of the song that replaces song REPLACED.
+    const unsigned REPLACEMENT_SEED = 100;
+    const int DELETED = 3, REPLACED = 5;
+    // Deleted in phase 2, enough to start a merge into index.bin.
+    const int PURGED[] = { 7, 8, 9 };
+
+    string dataDir;
+    int failures = 0;
+
+    void fail(const char* phase, const string& what) {
+        ++failures;
+        fprintf(stderr, "FAIL %s: %s\n", phase, what.c_str());
+    }
+
+    // A few seconds of tones that change every 100 ms; `seed` picks them.
+    vector<float> tune(unsigned seed, double seconds) {
+        mt19937 rng(seed);
+        uniform_real_distribution<double> freq(300, 3000);
+        vector<float> out(static_cast<size_t>(seconds * RATE));
+        double f[3] = {};
+        for (size_t i = 0; i < out.size(); ++i) {
+            if (i % (RATE / 10) == 0) for (double& v : f) v = freq(rng);
+            const double t = static_cast<double>(i) / RATE;
+            out[i] = static_cast<float>((sin(2 * M_PI * f[0] * t) + sin(2 * M_PI * f[1] * t) + sin(2 * M_PI * f[2] * t)) / 4);
+        }
+        return out;
+    }
+
+    // 16-bit mono WAV file image of `samples[from, from + n)`.
+    string wav(const vector<float>& samples, size_t from = 0, size_t n = SIZE_MAX) {
+        n = min(n, samples.size() - from);
+        string out;
+        auto put = [&](uint32_t v, int bytes) { for (int i = 0; i < bytes; ++i) out += static_cast<char>(v >> (8 * i)); };
+        out += "RIFF"; put(static_cast<uint32_t>(36 + 2 * n), 4); out += "WAVEfmt ";
+        put(16, 4); put(1, 2); put(1, 2); put(RATE, 4); put(2 * RATE, 4); put(2, 2); put(16, 2);
+        out += "data"; put(static_cast<uint32_t>(2 * n), 4);
+        for (size_t i = from; i < from + n; ++i) put(static_cast<uint16_t>(lround(samples[i] * 32767)), 2);
+        return out;
+    }
+
+    string song_audio(unsigned seed) { return wav(tune(seed, 8)); }
+    string clip_audio(unsigned seed) { return wav(tune(seed, 8), 2 * RATE, 4 * RATE); }
+
+    // The id a clip is recognized as, or -1.
+    int recognize(unsigned seed) {
+        const string clip = clip_audio(seed);
+        const string reply = identify_from_buffer(clip.data(), clip.size());
+        auto p = reply.find("\"match\":");
+        return p == string::npos ? -1 : atoi(reply.c_str() + p + 8);
+    }
+
+    const Song* find_song(const vector<Song>& songs, int id) {
+        for (const auto& s : songs) if (s.id == id) return &s;
+        return nullptr;
+    }
+
+    string url(int i) { return "https://example.com/" + to_string(i); }
+
+    // The replacement holds the replaced song's name and url under a new id,
+    // and the deleted songs are neither listed nor recognized.
+    void check_catalog(const char* phase, const vector<int>& deleted) {
+        const vector<Song> songs = get_song_list();
+        const size_t want = SONGS + 1 - 1 - deleted.size();   // + replacement - replaced
+        if (songs.size() != want) fail(phase, to_string(songs.size()) + " songs listed, want " + to_string(want));
+        for (int id : deleted) {
+            if (find_song(songs, id)) fail(phase, "deleted song " + to_string(id) + " is listed");
+            if (recognize(static_cast<unsigned>(id)) == id) fail(phase, "deleted song " + to_string(id) + " is recognized");
+        }
+        if (find_song(songs, REPLACED)) fail(phase, "replaced song is listed");
+        const Song* s = find_song(songs, SONGS);
+        if (!s) fail(phase, "replacement is not listed");
+        else if (s->name != "song" + to_string(REPLACED) || s->youtube_url != url(REPLACED))
+            fail(phase, "replacement is named '" + s->name + "' (" + s->youtube_url + ")");
+        if (recognize(REPLACEMENT_SEED) != SONGS) fail(phase, "replacement audio is not recognized as the replacement");
+        if (recognize(1) != 1) fail(phase, "song 1 is not recognized");
+    }
+
+    void phase_edit() {
+        engine_init(dataDir);
+        for (int i = 0; i < SONGS; ++i) {
+            const string audio = song_audio(static_cast<unsigned>(i));
+            const int id = add_song_from_buffer(audio.data(), audio.size(), "song" + to_string(i), url(i));
+            if (id != i) fail("edit", "song " + to_string(i) + " was added as " + to_string(id));
+        }
+        if (!delete_song(DELETED)) fail("edit", "delete_song failed");
+        if (delete_song(DELETED)) fail("edit", "a second delete_song succeeded");
+        if (delete_song(1000)) fail("edit", "delete_song of an unknown id succeeded");
+        const string audio = song_audio(REPLACEMENT_SEED);
+        const int id = replace_song_from_buffer(REPLACED, audio.data(), audio.size());
+        if (id != SONGS) fail("edit", "replacement got id " + to_string(id));
+        if (replace_song_from_buffer(DELETED, audio.data(), audio.size()) != -2)
+            fail("edit", "replacing a deleted song did not return -2");
+        check_catalog("edit", { DELETED });
+        if (filesystem::exists(dataDir + "/index.bin"))
+            fail("edit", "a merge wrote index.bin, so the restart would not replay the deletes");
+    }
+
+    void phase_restart() {
+        engine_init(dataDir);
+        check_catalog("restart", { DELETED });
+    }
+
+    // Deletes enough songs to start a merge and waits for its index.bin.
+    void phase_purge() {
+        engine_init(dataDir);
+        for (int id : PURGED)
+            if (!delete_song(id)) fail("purge", "delete_song(" + to_string(id) + ") failed");
+        check_catalog("purge", { DELETED, PURGED[0], PURGED[1], PURGED[2] });
+        unique_ptr<IndexFile> base;
+        for (int waited = 0; !base && waited < 300; ++waited) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+            if (filesystem::exists(dataDir + "/index.bin")) base.reset(IndexFile::open(dataDir + "/index.bin"));
+        }
+        if (!base) { fail("purge", "no merge into index.bin within 30 s"); return; }
+        const vector<int> dead = { DELETED, REPLACED, PURGED[0], PURGED[1], PURGED[2] };
+        vector<Song> songs;
+        base->read_songs(songs);
+        for (int id : dead)
+            if (id >= static_cast<int>(songs.size()) || songs[id].numFingerprints != 0)
+                fail("purge", "index.bin lists deleted song " + to_string(id) + " as live");
+        const FlatIndex& index = base->index();
+        vector<Posting> postings;
+        size_t kept = 0;
+        for (size_t i = 0; i < index.num_hashes(); ++i) {
+            postings.clear();
+            index.decode_at(i, postings);
+            for (const auto& p : postings)
+                if (find(dead.begin(), dead.end(), p.songId) != dead.end()) ++kept;
+        }
+        if (kept) fail("purge", to_string(kept) + " postings of deleted songs are in index.bin");
+    }
+
+    void phase_reopen() {
+        engine_init(dataDir);
+        check_catalog("reopen", { DELETED, PURGED[0], PURGED[1], PURGED[2] });
+    }
+
+    // Postings of a few songs, many close together, with repeats and ids
+    // and offsets that need every varint length.
+    vector<Posting> random_postings(mt19937& rng, size_t n) {
+        uniform_int_distribution<int32_t> song(0, 7), bigSong(0, INT32_MAX), offset(0, 2000), bigOffset(0, INT32_MAX);
+        vector<Posting> out;
+        for (size_t i = 0; i < n; ++i) {
+            const bool big = rng() % 8 == 0;
+            out.push_back(Posting{ big ? bigSong(rng) : song(rng), big ? bigOffset(rng) : offset(rng) });
+            if (rng() % 16 == 0) out.push_back(out.back());
+        }
+        return out;
+    }
+
+    // encode_postings() sorts a list by (songId, offset); decode_postings()
+    // gives back that order and stops right after the list.
+    void check_postings() {
+        mt19937 rng(3);
+        for (size_t round = 0; round < 2000; ++round) {
+            vector<Posting> postings = random_postings(rng, round % 300 + 1);
+            vector<Posting> want = postings;
+            sort(want.begin(), want.end());
+            string blob;
+            encode_postings(postings, blob);
+            const size_t len = blob.size();
+            blob.push_back('\0');   // slack for the decoder's two-byte peek, as in FlatSegment
+            vector<Posting> got(want.size());
+            const uint8_t* p = reinterpret_cast<const uint8_t*>(blob.data());
+            const uint8_t* end = decode_postings(p, static_cast<uint32_t>(got.size()), got.data());
+            if (postings != want) fail("postings", "encode_postings did not sort the list");
+            if (got != want) fail("postings", "round trip of " + to_string(want.size()) + " postings differs");
+            if (end != p + len) fail("postings", "decode_postings did not stop at the end of the list");
+        }
+    }
+
+    // seek() and lookup() against a sorted copy of the directory, for a
+    // directory searched whole and one behind a bucket table.
+    void check_seek() {
+        mt19937 rng(5);
+        for (size_t numHashes : { size_t(1000), FlatIndex::MIN_BUCKETED_HASHES * 3 }) {
+            vector<pair<uint32_t, Posting>> entries;
+            // A tight range too, so neighbouring hashes are in the directory.
+            uniform_int_distribution<uint32_t> any(0, UINT32_MAX), tight(0, static_cast<uint32_t>(numHashes));
+            for (size_t i = 0; i < numHashes; ++i) {
+                const uint32_t h = i % 2 ? any(rng) : tight(rng);
+                for (const Posting& p : random_postings(rng, rng() % 3 + 1)) entries.emplace_back(h, p);
+            }
+            vector<pair<uint32_t, Posting>> sorted = entries;
+            sort(sorted.begin(), sorted.end(), [](const pair<uint32_t, Posting>& a, const pair<uint32_t, Posting>& b) {
+                return a.first != b.first ? a.first < b.first : a.second < b.second;
+            });
+            vector<uint32_t> hashes;
+            for (const auto& e : sorted) if (hashes.empty() || hashes.back() != e.first) hashes.push_back(e.first);
+            unique_ptr<FlatSegment> index(FlatSegment::from_entries(entries));
+            const string what = " of " + to_string(hashes.size()) + " hashes";
+            if (index->num_hashes() != hashes.size() || index->num_postings() != sorted.size())
+                fail("seek", "wrong size for a directory" + what);
+
+            for (size_t probe = 0; probe < 20000; ++probe) {
+                uint32_t h = probe % 3 == 0 ? any(rng) : hashes[rng() % hashes.size()] + static_cast<uint32_t>(probe % 3 - 1);
+                if (probe == 0) h = 0;
+                if (probe == 1) h = UINT32_MAX;
+                const size_t from = rng() % (hashes.size() + 1);
+                const size_t want = max(from, static_cast<size_t>(lower_bound(hashes.begin(), hashes.end(), h) - hashes.begin()));
+                if (index->seek(h, from) != want) {
+                    fail("seek", "seek(" + to_string(h) + ", " + to_string(from) + ") in a directory" + what);
+                    break;
+                }
+            }
+
+            vector<Posting> got;
+            size_t i = 0;
+            for (uint32_t h : hashes) {
+                vector<Posting> want;
+                for (; i < sorted.size() && sorted[i].first == h; ++i) want.push_back(sorted[i].second);
+                got.clear();
+                if (index->lookup(h, got) != want.size() || got != want) {
+                    fail("seek", "lookup(" + to_string(h) + ") in a directory" + what);
+                    break;
+                }
+                got.clear();
+                if (index->lookup(h + 1, got) != 0 && !binary_search(hashes.begin(), hashes.end(), h + 1)) {
+                    fail("seek", "lookup of an absent hash found postings in a directory" + what);
+                    break;
+                }
+            }
+        }
+    }
+
+    struct Vote {
+        int32_t songId, songOffset, queryOffset;
+        uint8_t weight;
+    };
+
+    // The `n` best songs by summing each (song, delta)'s weights in a map.
+    vector<SongScore> rank_slowly(const vector<Vote>& votes, size_t n) {
+        map<pair<int32_t, int32_t>, int> runs;
+        for (const Vote& v : votes) runs[{ v.songId, v.songOffset - v.queryOffset }] += v.weight;
+        vector<SongScore> best;   // per song: the heaviest run, the smallest delta on ties
+        for (const auto& r : runs)
+            if (best.empty() || best.back().songId != r.first.first) best.push_back(SongScore{ r.first.first, r.second, r.first.second });
+            else if (r.second > best.back().count) best.back() = SongScore{ r.first.first, r.second, r.first.second };
+        stable_sort(best.begin(), best.end(), [](const SongScore& a, const SongScore& b){ return a.count > b.count; });
+        if (best.size() > n) best.resize(n);
+        for (auto& s : best) s.count = (s.count + UNIT_WEIGHT / 2) / UNIT_WEIGHT;
+        return best;
+    }
+
+    // VoteScorer::rank() against rank_slowly(), with close scores so ties
+    // are common, and ranking again after more votes as a stream does.
+    void check_rank() {
+        mt19937 rng(9);
+        VoteScorer scorer;
+        vector<SongScore> got;
+        for (size_t round = 0; round < 500; ++round) {
+            const int32_t songs = static_cast<int32_t>(rng() % 50 + 1);
+            // Deltas from far below zero up to (nearly) the 2^24 frame span.
+            const int32_t span = round % 2 ? (1 << 24) - 1 : 40;
+            const int32_t base = static_cast<int32_t>(rng() % 1000000) - 500000;
+            uniform_int_distribution<int32_t> song(0, songs - 1), delta(0, span);
+            uniform_int_distribution<int> weight(1, UNIT_WEIGHT);
+            vector<Vote> votes;
+            scorer.clear();
+            for (int pass = 0; pass < 2; ++pass) {
+                const size_t n = rng() % 3000;
+                for (size_t i = 0; i < n; ++i) {
+                    const int32_t queryOffset = static_cast<int32_t>(rng() % 500);
+                    const Vote v{ song(rng), base + delta(rng) + queryOffset, queryOffset,
+                                  static_cast<uint8_t>(rng() % 2 ? UNIT_WEIGHT : weight(rng)) };
+                    votes.push_back(v);
+                    scorer.add(v.songId, v.songOffset, v.queryOffset, v.weight);
+                }
+                const size_t top = rng() % 12;
+                scorer.rank(top, got);
+                const vector<SongScore> want = rank_slowly(votes, top);
+                bool same = got.size() == want.size();
+                for (size_t i = 0; same && i < got.size(); ++i)
+                    same = got[i].songId == want[i].songId && got[i].count == want[i].count && got[i].delta == want[i].delta;
+                if (!same) {
+                    fail("rank", "top " + to_string(top) + " of " + to_string(votes.size()) + " votes in round " + to_string(round));
+                    return;
+                }
+            }
+        }
+    }
+
+    vector<float> sine(double hz, int rate, size_t n) {
+        vector<float> out(n);
+        for (size_t i = 0; i < n; ++i) out[i] = static_cast<float>(sin(2 * M_PI * hz * i / rate));
+        return out;
+    }
+
+    double rms(const float* x, size_t n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) sum += static_cast<double>(x[i]) * x[i];
+        return n ? sqrt(sum / n) : 0;
+    }
+
+    // Resampling to the fingerprint rate from every accepted kind of input
+    // rate: the output does not depend on how the input is split into pushes
+    // or on reusing a resampler through reset(), has the expected length, and
+    // passes a tone below the output Nyquist while removing one above it.
+    void check_resample() {
+        const int OUT = 11025;
+        const int rates[] = { MIN_INPUT_RATE, OUT, 16000, 22050, 44100, 44123, 48000, 96000, MAX_INPUT_RATE };
+        mt19937 rng(13);
+        Resampler reused(MAX_INPUT_RATE, OUT);
+        for (int rate : rates) {
+            const string what = " at " + to_string(rate) + " Hz";
+            const size_t n = static_cast<size_t>(rate) * 2;
+            const vector<float> in = sine(1000, rate, n);
+            vector<float> whole, chunked, again;
+            Resampler(rate, OUT).push(in.data(), in.size(), whole);
+            Resampler r(rate, OUT);
+            for (size_t i = 0; i < n; ) {
+                const size_t take = min<size_t>(n - i, rng() % 3000 + 1);
+                r.push(in.data() + i, take, chunked);
+                i += take;
+            }
+            reused.reset(rate, OUT);
+            reused.push(in.data(), in.size(), again);
+            if (chunked != whole) fail("resample", "chunked pushes differ from one push" + what);
+            if (again != whole) fail("resample", "a reset resampler differs from a new one" + what);
+            if (rate == OUT && whole != in) fail("resample", "equal rates did not pass samples through");
+            const double want = static_cast<double>(n) * OUT / rate;
+            if (fabs(static_cast<double>(whole.size()) - want) > want * 0.002 + 2)
+                fail("resample", to_string(whole.size()) + " samples out, want about " + to_string(lround(want)) + what);
+            // Away from the filter's warm-up at the start.
+            const size_t from = whole.size() / 4;
+            const double level = rms(whole.data() + from, whole.size() - from);
+            if (fabs(level - sqrt(0.5)) > 0.01) fail("resample", "a 1 kHz tone came out at rms " + to_string(level) + what);
+            if (rate >= 2 * 7000) {
+                const vector<float> high = sine(7000, rate, n);
+                vector<float> out;
+                Resampler(rate, OUT).push(high.data(), high.size(), out);
+                const double alias = rms(out.data() + from, out.size() - from);
+                if (alias > 1e-3) fail("resample", "a 7 kHz tone aliased at rms " + to_string(alias) + what);
+            }
+        }
+    }
+
+    // A signature whose band b holds `b` in both rows.
+    QuerySignature signature() {
+        QuerySignature sig;
+        for (size_t k = 0; k < SIGNATURE_SIZE; ++k) sig.min[k] = static_cast<uint32_t>(k / 2);
+        return sig;
+    }
+
+    void check_cache() {
+        const QuerySignature sig = signature();
+        // Differs in one, then two positions, both in band 0: the other bands
+        // still make the entry a candidate.
+        QuerySignature near = sig, far = sig;
+        near.min[0] = far.min[0] = far.min[1] = 1000;
+        string reply;
+
+        ResultCache cache(16, chrono::seconds(60));
+        cache.insert(sig, 1, "reply");
+        if (!cache.find(sig, 1, reply) || reply != "reply") fail("cache", "an identical query missed");
+        if (!cache.find(near, 1, reply)) fail("cache", "31 of 32 positions (over REUSE_SIMILARITY) missed");
+        if (cache.find(far, 1, reply)) fail("cache", "30 of 32 positions (under REUSE_SIMILARITY) hit");
+        // A new catalog version drops the entry, so the old one misses too.
+        if (cache.find(sig, 2, reply)) fail("cache", "a reply for another catalog version hit");
+        if (cache.find(sig, 1, reply)) fail("cache", "a reply was kept after a newer catalog version");
+        if (cache.size() != 0) fail("cache", to_string(cache.size()) + " replies held after invalidation");
+
+        ResultCache expiring(16, chrono::seconds(1));
+        expiring.insert(sig, 1, "reply");
+        if (!expiring.find(sig, 1, reply)) fail("cache", "a fresh reply missed");
+        this_thread::sleep_for(chrono::milliseconds(1100));
+        if (expiring.find(sig, 1, reply)) fail("cache", "a reply hit after its ttl");
+
+        ResultCache disabled(0, chrono::seconds(60));
+        disabled.insert(sig, 1, "reply");
+        if (disabled.find(sig, 1, reply)) fail("cache", "a disabled cache hit");
+    }
+
+    // Runs `phase` in a child process with the engine's log silenced.
+    void run(const char* name, void (*phase)()) {
+        fflush(stdout);
+        const pid_t pid = fork();
+        if (pid == 0) {
+            cerr.rdbuf(nullptr);
+            failures = 0;   // the phases before this one are the parent's
+            phase();
+            _exit(failures ? 1 : 0);
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fail(name, "phase failed");
+        else
+            printf("%s: ok\n", name);
+    }
+}
+
+int main() {
+    unsetenv("MUSICREC_SHARD");
+    unsetenv("MUSICREC_PROFILE");
+    char dir[] = "/tmp/engine_test.XXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    dataDir = dir;
+    run("postings", check_postings);
+    run("seek", check_seek);
+    run("rank", check_rank);
+    run("resample", check_resample);
+    run("cache", check_cache);
+    run("edit", phase_edit);
+    run("restart", phase_restart);
+    run("purge", phase_purge);
+    run("reopen", phase_reopen);
+    error_code ec;
+    filesystem::remove_all(dataDir, ec);
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,255 @@
+#include "fingerprint.h"
+#include "dsp.h"
+#include "kernels.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+template <class P>
+static inline uint32_t make_hash(uint16_t f1, uint16_t f2, uint16_t dt) {
+    constexpr uint32_t BIN_MASK = (1u << P::BIN_BITS) - 1, DT_MASK = (1u << P::DT_BITS) - 1;
+    return ((f1 & BIN_MASK) << (P::BIN_BITS + P::DT_BITS))
+         | ((f2 & BIN_MASK) << P::DT_BITS)
+         | (dt & DT_MASK);
+}
+
+namespace {
+    // Input samples resampled per step, bounding the scratch buffer.
+    static const size_t RESAMPLE_BLOCK = 1 << 14;
+
+    using Clock = std::chrono::steady_clock;
+
+    // Stage timing, skipped when no FingerprintTimes is attached.
+    inline Clock::time_point lap_start(const FingerprintTimes* times) {
+        return times ? Clock::now() : Clock::time_point();
+    }
+    // Adds the time since `t` to `stage` and restarts `t`.
+    inline void lap(FingerprintTimes* times, double FingerprintTimes::* stage, Clock::time_point& t) {
+        if (!times) return;
+        Clock::time_point now = Clock::now();
+        times->*stage += std::chrono::duration<double>(now - t).count();
+        t = now;
+    }
+}
+
+// ---- Profiles ----
+
+namespace {
+    template <class P>
+    constexpr FingerprintProfile describe() {
+        return FingerprintProfile{ P::ID, P::NAME, P::SAMPLE_RATE, P::WINDOW_SIZE, P::HOP_SIZE,
+                                   P::PEAKS_PER_FRAME, P::FAN_MAX_TARGETS };
+    }
+
+    // Indexed by profile id.
+    constexpr FingerprintProfile PROFILES[] = {
+        describe<StandardProfile>(), describe<CompactProfile>(), describe<DenseProfile>(),
+    };
+    static_assert(PROFILES[CompactProfile::ID].id == CompactProfile::ID &&
+                  PROFILES[DenseProfile::ID].id == DenseProfile::ID, "PROFILES is indexed by id");
+
+    std::atomic<const FingerprintProfile*> ACTIVE{ &PROFILES[StandardProfile::ID] };
+}
+
+const FingerprintProfile* find_profile(uint32_t id) {
+    return id < sizeof(PROFILES) / sizeof(PROFILES[0]) ? &PROFILES[id] : nullptr;
+}
+
+const FingerprintProfile* find_profile(const string& name) {
+    for (const auto& p : PROFILES)
+        if (name == p.name) return &p;
+    return nullptr;
+}
+
+const FingerprintProfile& profile_from_env() {
+    const char* v = getenv("MUSICREC_PROFILE");
+    if (!v || !*v) return PROFILES[StandardProfile::ID];
+    const FingerprintProfile* p = find_profile(string(v));
+    if (!p) {
+        cerr << "Unknown MUSICREC_PROFILE=" << v << " (expected";
+        for (const auto& q : PROFILES) cerr << " " << q.name;
+        cerr << ")\n";
+        exit(1);
+    }
+    return *p;
+}
+
+const FingerprintProfile& active_profile() { return *ACTIVE.load(std::memory_order_relaxed); }
+void set_active_profile(const FingerprintProfile& profile) { ACTIVE.store(&profile); }
+
+// ---- Pipeline ----
+
+class Fingerprinter::Impl {
+public:
+    virtual ~Impl() = default;
+    virtual void push(const float* samples, size_t n) = 0;
+    virtual void finish() = 0;
+    // Readies a used pipeline for a new stream.
+    virtual void reset(int inputRate) = 0;
+
+    Sink sink;
+    FingerprintTimes* times = nullptr;
+    int frames = 0;       // frames analysed so far
+    size_t numPeaks = 0;
+    size_t numHashes = 0;
+};
+
+namespace {
+template <class P>
+class ProfilePipeline final : public Fingerprinter::Impl {
+    static constexpr int BINS = P::WINDOW_SIZE / 2;
+    static constexpr int MIN_FREQ_BIN = (P::MIN_FREQ_HZ * P::WINDOW_SIZE + P::SAMPLE_RATE / 2) / P::SAMPLE_RATE;
+    static constexpr int RING = P::FAN_MAX_DT + 1;
+    static_assert(BINS <= (1 << P::BIN_BITS), "bins must fit the hash's bin fields");
+    static_assert(P::FAN_MAX_DT < (1 << P::DT_BITS), "frame deltas must fit the hash's dt field");
+    static_assert(2 * P::BIN_BITS + P::DT_BITS <= 32, "hash fields must fit 32 bits");
+    static_assert(P::PEAKS_PER_FRAME <= TOP_K_MAX, "top_k caps k");
+    static_assert(P::HOP_SIZE <= P::WINDOW_SIZE, "frames must not skip samples");
+
+public:
+    ProfilePipeline(Fingerprinter::Sink s, int inputRate) : resampler_(inputRate, P::SAMPLE_RATE) { sink = std::move(s); }
+
+    void push(const float* samples, size_t n) override {
+        if (resampler_.passthrough()) { analyse(samples, n); return; }
+        while (n > 0) {
+            size_t take = min(n, RESAMPLE_BLOCK);
+            resampled_.clear();
+            Clock::time_point t = lap_start(times);
+            resampler_.push(samples, take, resampled_);
+            lap(times, &FingerprintTimes::resample, t);
+            analyse(resampled_.data(), resampled_.size());
+            samples += take; n -= take;
+        }
+    }
+
+    void finish() override {
+        Clock::time_point t = lap_start(times);
+        while (emitted_ < frames) emit_anchor_frame(emitted_++);
+        lap(times, &FingerprintTimes::hashing, t);
+    }
+
+    void reset(int inputRate) override {
+        times = nullptr;
+        frames = 0;
+        numPeaks = 0;
+        numHashes = 0;
+        resampler_.reset(inputRate, P::SAMPLE_RATE);
+        fill_ = 0;
+        emitted_ = 0;
+    }
+
+private:
+    struct FramePeaks {
+        int n;
+        uint16_t f[P::PEAKS_PER_FRAME];   // ascending bin
+    };
+
+    void analyse(const float* samples, size_t n) {
+        while (n > 0) {
+            size_t take = min(n, static_cast<size_t>(P::WINDOW_SIZE) - fill_);
+            memcpy(samples_ + fill_, samples, take * sizeof(float));
+            fill_ += take; samples += take; n -= take;
+            if (fill_ < static_cast<size_t>(P::WINDOW_SIZE)) break;
+            process_frame();
+            // Keep the overlap with the next window.
+            memmove(samples_, samples_ + P::HOP_SIZE, (P::WINDOW_SIZE - P::HOP_SIZE) * sizeof(float));
+            fill_ = P::WINDOW_SIZE - P::HOP_SIZE;
+        }
+    }
+
+    void process_frame() {
+        Clock::time_point t = lap_start(times);
+        DspContext& ctx = dsp_context(P::WINDOW_SIZE);
+        double* in = ctx.in();
+        const double* window = ctx.window();
+        for (int i = 0; i < P::WINDOW_SIZE; ++i) in[i] = samples_[i] * window[i];
+        ctx.execute();
+        // Bins are ranked on power; only the order matters.
+        power_spectrum(ctx.out(), power_, BINS);
+        lap(times, &FingerprintTimes::stft, t);
+
+        int top[TOP_K_MAX];
+        int n = top_k(power_ + MIN_FREQ_BIN, BINS - MIN_FREQ_BIN, P::PEAKS_PER_FRAME, top);
+        sort(top, top + n);
+        FramePeaks& fp = ring_[frames % RING];
+        fp.n = n;
+        for (int i = 0; i < n; ++i) fp.f[i] = static_cast<uint16_t>(top[i] + MIN_FREQ_BIN);
+        numPeaks += n;
+        ++frames;
+        lap(times, &FingerprintTimes::peaks, t);
+
+        // The oldest pending anchor frame now has all FAN_MAX_DT targets in the ring.
+        if (frames - 1 - emitted_ >= P::FAN_MAX_DT) emit_anchor_frame(emitted_++);
+        lap(times, &FingerprintTimes::hashing, t);
+    }
+
+    void emit_anchor_frame(int t) {
+        const FramePeaks& anchors = ring_[t % RING];
+        for (int a = 0; a < anchors.n; ++a) {
+            int fanCount = 0;
+            for (int dt = P::FAN_MIN_DT; dt <= P::FAN_MAX_DT && fanCount < P::FAN_MAX_TARGETS; ++dt) {
+                int tt = t + dt;
+                if (tt >= frames) break;
+                const FramePeaks& targets = ring_[tt % RING];
+                for (int b = 0; b < targets.n; ++b) {
+                    sink(make_hash<P>(anchors.f[a], targets.f[b], static_cast<uint16_t>(dt)), t);
+                    ++numHashes;
+                    if (++fanCount >= P::FAN_MAX_TARGETS) break;
+                }
+            }
+        }
+    }
+
+    Resampler resampler_;
+    std::vector<float> resampled_;
+    float samples_[P::WINDOW_SIZE];
+    size_t fill_ = 0;
+    float power_[BINS];
+    FramePeaks ring_[RING];
+    int emitted_ = 0;     // anchor frames whose hashes went out
+};
+
+// A destroyed Fingerprinter leaves its pipeline to the next one its thread
+// constructs for the profile, so a warmed-up thread fingerprints without
+// allocating. A pipeline is kept by the thread that destroys it, if that
+// thread has none idle; a second Fingerprinter alive on a thread at once
+// (e.g. a streaming session's) gets a pipeline of its own.
+unique_ptr<Fingerprinter::Impl>& idle_pipeline(uint32_t id) {
+    thread_local unique_ptr<Fingerprinter::Impl> idle[sizeof(PROFILES) / sizeof(PROFILES[0])];
+    return idle[find_profile(id) ? id : StandardProfile::ID];
+}
+}
+
+Fingerprinter::Fingerprinter(Sink sink, int inputRate, const FingerprintProfile& profile) : profile_(profile) {
+    auto& idle = idle_pipeline(profile.id);
+    if (idle) {
+        impl_ = std::move(idle);
+        impl_->reset(inputRate);
+        impl_->sink = std::move(sink);
+        return;
+    }
+    switch (profile.id) {
+    case CompactProfile::ID: impl_.reset(new ProfilePipeline<CompactProfile>(std::move(sink), inputRate)); break;
+    case DenseProfile::ID:   impl_.reset(new ProfilePipeline<DenseProfile>(std::move(sink), inputRate)); break;
+    default:                 impl_.reset(new ProfilePipeline<StandardProfile>(std::move(sink), inputRate)); break;
+    }
+}
+
+Fingerprinter::~Fingerprinter() {
+    auto& idle = idle_pipeline(profile_.id);
+    if (idle) return;
+    impl_->sink = nullptr;   // drops the caller's captures
+    idle = std::move(impl_);
+}
+
+void Fingerprinter::push(const float* samples, size_t n) { impl_->push(samples, n); }
+void Fingerprinter::finish() { impl_->finish(); }
+int Fingerprinter::frames() const { return impl_->frames; }
+size_t Fingerprinter::peaks() const { return impl_->numPeaks; }
+size_t Fingerprinter::hashes() const { return impl_->numHashes; }
+void Fingerprinter::set_times(FingerprintTimes* times) { impl_->times = times; }
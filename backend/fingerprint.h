@@ -0,0 +1,144 @@
+#pragma once
+// Streaming fingerprint extraction: mono samples in, (hash, frame) pairs out.
+#include "resample.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+constexpr int pow2_floor(int n) { int p = 1; while (p * 2 <= n) p *= 2; return p; }
+
+// ---- Profiles ----
+//
+// A profile fixes every parameter of the pipeline: the rate fingerprints are
+// made at, the analysis window and hop, peaks per frame, the fan-out and the
+// hash bit layout (anchor bin | target bin | frame delta). Each is a constexpr
+// type and the pipeline is compiled once per profile, so buffers are sized
+// and loops bounded at compile time. Fingerprints of different profiles
+// never match: a catalog is made with one, recorded in its index file and
+// delta log, and queries against it are fingerprinted with the same one.
+
+// ~23 ms analysis windows (~43 Hz bins) with 50% overlap at 11025 Hz, which
+// keeps everything below ~5 kHz. The default, and the profile of every index
+// written before profiles existed.
+struct StandardProfile {
+    static constexpr uint32_t ID = 0;
+    static constexpr const char* NAME = "standard";
+    static constexpr int SAMPLE_RATE     = 11025;
+    static constexpr int WINDOW_SIZE     = pow2_floor(SAMPLE_RATE / 43);
+    static constexpr int HOP_SIZE        = WINDOW_SIZE / 2;
+    static constexpr int MIN_FREQ_HZ     = 430;
+    static constexpr int PEAKS_PER_FRAME = 5;
+    static constexpr int FAN_MIN_DT      = 1;
+    static constexpr int FAN_MAX_DT      = 45;
+    static constexpr int FAN_MAX_TARGETS = 5;
+    static constexpr int BIN_BITS        = 10;
+    static constexpr int DT_BITS         = 12;
+};
+
+// Cheap: 8 kHz, 16 ms windows without overlap (~62 Hz bins) and a sparse
+// constellation, about a quarter of the standard profile's hashes per second.
+// For catalogs queried with short, noisy microphone clips.
+struct CompactProfile {
+    static constexpr uint32_t ID = 1;
+    static constexpr const char* NAME = "compact";
+    static constexpr int SAMPLE_RATE     = 8000;
+    static constexpr int WINDOW_SIZE     = 128;
+    static constexpr int HOP_SIZE        = WINDOW_SIZE;
+    static constexpr int MIN_FREQ_HZ     = 300;
+    static constexpr int PEAKS_PER_FRAME = 3;
+    static constexpr int FAN_MIN_DT      = 1;
+    static constexpr int FAN_MAX_DT      = 32;
+    static constexpr int FAN_MAX_TARGETS = 3;
+    static constexpr int BIN_BITS        = 10;
+    static constexpr int DT_BITS         = 12;
+};
+
+// Dense: ~46 ms windows (~21 Hz bins) with 75% overlap and more peaks and
+// targets, for clean studio audio where precision is worth ~2.5x the hashes.
+struct DenseProfile {
+    static constexpr uint32_t ID = 2;
+    static constexpr const char* NAME = "dense";
+    static constexpr int SAMPLE_RATE     = 11025;
+    static constexpr int WINDOW_SIZE     = 512;
+    static constexpr int HOP_SIZE        = WINDOW_SIZE / 4;
+    static constexpr int MIN_FREQ_HZ     = 430;
+    static constexpr int PEAKS_PER_FRAME = 8;
+    static constexpr int FAN_MIN_DT      = 1;
+    static constexpr int FAN_MAX_DT      = 45;
+    static constexpr int FAN_MAX_TARGETS = 8;
+    static constexpr int BIN_BITS        = 10;
+    static constexpr int DT_BITS         = 12;
+};
+
+// A profile's parameters at run time, for code that is not specialized.
+struct FingerprintProfile {
+    uint32_t id;
+    const char* name;
+    int sampleRate;
+    int windowSize;
+    int hopSize;
+    int peaksPerFrame;
+    int fanMaxTargets;
+};
+
+// nullptr if there is no such profile.
+const FingerprintProfile* find_profile(uint32_t id);
+const FingerprintProfile* find_profile(const std::string& name);
+// The profile named by MUSICREC_PROFILE (standard when unset); exits if unknown.
+const FingerprintProfile& profile_from_env();
+// The profile new Fingerprinters use unless told otherwise: set once at
+// startup, before fingerprinting starts, to the catalog's profile.
+const FingerprintProfile& active_profile();
+void set_active_profile(const FingerprintProfile& profile);
+
+// Wall time spent in each stage, in seconds (see Fingerprinter::set_times).
+struct FingerprintTimes {
+    double resample = 0;
+    double stft = 0;      // window, FFT and power spectrum
+    double peaks = 0;
+    double hashing = 0;   // including the sink
+};
+
+// Runs resample -> spectrogram -> peaks -> hashes one frame at a time, in the
+// pipeline specialized for its profile. Samples may be pushed in chunks of
+// any size; only the current analysis window and the peaks of the last
+// FAN_MAX_DT frames are kept, so memory does not grow with the length of the
+// input. An anchor frame's hashes are emitted once every frame it can pair
+// with has been seen (or at finish()), in anchor order: the same sequence
+// the whole-track code produced.
+class Fingerprinter {
+public:
+    // Receives each hash with the frame index of its anchor peak. A lambda
+    // capturing more than two references is heap-allocated by std::function;
+    // pass such a sink as std::ref(lambda) where allocations matter.
+    using Sink = std::function<void(uint32_t hash, int32_t offset)>;
+
+    // `inputRate` is the rate of the samples passed to push().
+    Fingerprinter(Sink sink, int inputRate, const FingerprintProfile& profile = active_profile());
+    ~Fingerprinter();
+    Fingerprinter(const Fingerprinter&) = delete;
+    Fingerprinter& operator=(const Fingerprinter&) = delete;
+
+    // Samples stay float up to the windowed FFT input, which is double.
+    void push(const float* samples, size_t n);
+    // Emits the hashes still waiting for later frames. Call once at the end.
+    void finish();
+
+    int frames() const;
+    size_t peaks() const;
+    size_t hashes() const;
+    const FingerprintProfile& profile() const { return profile_; }
+
+    // Adds per-stage wall time to `*times` from now on (nullptr stops). Costs a
+    // few clock reads per frame; meant for benchmarks.
+    void set_times(FingerprintTimes* times);
+
+    class Impl;  // the pipeline for one profile (fingerprint.cpp)
+
+private:
+    const FingerprintProfile& profile_;
+    std::unique_ptr<Impl> impl_;
+};
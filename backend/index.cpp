@@ -0,0 +1,319 @@
+#include "index.h"
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+    inline void put_varint(string& out, uint32_t v) {
+        while (v >= 0x80) { out.push_back(static_cast<char>(v | 0x80)); v >>= 7; }
+        out.push_back(static_cast<char>(v));
+    }
+
+    inline const uint8_t* get_varint(const uint8_t* p, uint32_t& v) {
+        uint32_t b = *p++;
+        v = b & 0x7F;
+        if (b < 0x80) return p;
+        int shift = 7;
+        do {
+            b = *p++;
+            v |= (b & 0x7F) << shift;
+            shift += 7;
+        } while (b >= 0x80);
+        return p;
+    }
+
+    bool posting_less(const Posting& a, const Posting& b) {
+        return a.songId != b.songId ? a.songId < b.songId : a.offset < b.offset;
+    }
+
+    void sort_postings(vector<Posting>& postings) {
+        if (!is_sorted(postings.begin(), postings.end(), posting_less))
+            sort(postings.begin(), postings.end(), posting_less);
+    }
+}
+
+size_t MapIndex::lookup(uint32_t hash, vector<Posting>& out, size_t limit) const {
+    auto it = map_.find(hash);
+    if (it == map_.end()) return 0;
+    if (it->second.size() <= limit) out.insert(out.end(), it->second.begin(), it->second.end());
+    return it->second.size();
+}
+
+size_t MapIndex::memory_bytes() const {
+    // Node + bucket slot per hash, vector header in the node, postings capacity.
+    size_t bytes = map_.bucket_count() * sizeof(void*);
+    for (const auto& kv : map_) {
+        bytes += sizeof(void*) + sizeof(kv) + sizeof(size_t);
+        bytes += kv.second.capacity() * sizeof(Posting);
+    }
+    return bytes;
+}
+
+size_t FlatIndex::lookup(uint32_t hash, vector<Posting>& out, size_t limit) const {
+    if (numHashes_ == 0) return 0;
+    const FlatDirEntry* lo = dir_;
+    const FlatDirEntry* hi = dir_ + numHashes_;
+    if (buckets_) {
+        uint32_t b = hash >> (32 - BUCKET_BITS);
+        lo = dir_ + buckets_[b];
+        hi = dir_ + buckets_[b + 1];
+    }
+    const FlatDirEntry* it = lower_bound(lo, hi, hash,
+                                         [](const FlatDirEntry& e, uint32_t h){ return e.hash < h; });
+    if (it == hi || it->hash != hash) return 0;
+    if (it->count > limit) return it->count;
+    size_t at = out.size();
+    out.resize(at + it->count);
+    decode_postings(blob_ + it->byteOff, it->count, out.data() + at);
+    return it->count;
+}
+
+void FlatIndex::decode_at(size_t i, vector<Posting>& out) const {
+    size_t at = out.size();
+    out.resize(at + dir_[i].count);
+    decode_postings(blob_ + dir_[i].byteOff, dir_[i].count, out.data() + at);
+}
+
+size_t FlatIndex::seek(uint32_t hash, size_t from) const {
+    if (from >= numHashes_ || dir_[from].hash >= hash) return min(from, numHashes_);
+    size_t step = 1;
+    while (from + step < numHashes_ && dir_[from + step].hash < hash) step *= 2;
+    const FlatDirEntry* lo = dir_ + from + step / 2 + 1;
+    const FlatDirEntry* hi = dir_ + min(from + step, numHashes_);
+    return static_cast<size_t>(lower_bound(lo, hi, hash,
+                               [](const FlatDirEntry& e, uint32_t h){ return e.hash < h; }) - dir_);
+}
+
+size_t FlatIndex::memory_bytes() const {
+    return numHashes_ * sizeof(FlatDirEntry) + blobLen_ + (buckets_ ? NUM_BUCKETS * sizeof(uint32_t) : 0);
+}
+
+FlatSegment::FlatSegment(const PostingSource& next) {
+    uint32_t hash = 0;
+    vector<Posting> plist;
+    size_t total = 0;
+    while (next(hash, plist)) {
+        if (plist.empty()) continue;
+        dirStore_.push_back(FlatDirEntry{ hash, static_cast<uint32_t>(plist.size()), blobStore_.size() });
+        encode_postings(plist, blobStore_);
+        total += plist.size();
+    }
+    blobStore_.push_back('\0'); // slack for the decoder's two-byte peek
+    if (dirStore_.size() >= MIN_BUCKETED_HASHES) {
+        bucketStore_.resize(NUM_BUCKETS);
+        build_buckets(dirStore_.data(), dirStore_.size(), bucketStore_.data());
+    }
+    dir_ = dirStore_.data();
+    numHashes_ = dirStore_.size();
+    blob_ = reinterpret_cast<const uint8_t*>(blobStore_.data());
+    blobLen_ = blobStore_.size();
+    buckets_ = bucketStore_.empty() ? nullptr : bucketStore_.data();
+    numPostings_ = total;
+}
+
+FlatSegment* FlatSegment::from_entries(vector<pair<uint32_t, Posting>>& entries) {
+    sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        if (a.first != b.first) return a.first < b.first;
+        if (a.second.songId != b.second.songId) return a.second.songId < b.second.songId;
+        return a.second.offset < b.second.offset;
+    });
+    size_t i = 0;
+    return new FlatSegment([&](uint32_t& hash, vector<Posting>& out) {
+        out.clear();
+        if (i >= entries.size()) return false;
+        hash = entries[i].first;
+        for (; i < entries.size() && entries[i].first == hash; ++i) out.push_back(entries[i].second);
+        cap_postings_per_song(out, hash_policy().songCap);
+        return true;
+    });
+}
+
+FlatMerger::FlatMerger(vector<const FlatIndex*> parts)
+    : parts_(std::move(parts)), pos_(parts_.size(), 0) {}
+
+bool FlatMerger::next(uint32_t& hash, vector<Posting>& out) {
+    out.clear();
+    uint64_t lowest = UINT64_MAX;
+    for (size_t k = 0; k < parts_.size(); ++k)
+        if (pos_[k] < parts_[k]->num_hashes()) lowest = min<uint64_t>(lowest, parts_[k]->hash_at(pos_[k]));
+    if (lowest == UINT64_MAX) return false;
+    hash = static_cast<uint32_t>(lowest);
+    for (size_t k = 0; k < parts_.size(); ++k)
+        if (pos_[k] < parts_[k]->num_hashes() && parts_[k]->hash_at(pos_[k]) == hash)
+            parts_[k]->decode_at(pos_[k]++, out);
+    return true;
+}
+
+const HashPolicy& hash_policy() {
+    static const HashPolicy policy = [] {
+        auto env = [](const char* name, double def) {
+            const char* v = getenv(name);
+            return v ? atof(v) : def;
+        };
+        HashPolicy p;
+        p.songCap         = static_cast<size_t>(max(0.0, env("MUSICREC_HASH_SONG_CAP", 8)));
+        p.stopDf          = max(0.0, env("MUSICREC_STOP_DF", 0));
+        p.stopMinSongs    = static_cast<size_t>(max(0.0, env("MUSICREC_STOP_MIN_SONGS", 50)));
+        p.maxListPostings = static_cast<size_t>(max(1.0, env("MUSICREC_MAX_LIST_POSTINGS", 1 << 20)));
+        p.sampleListPostings = static_cast<size_t>(max(1.0, env("MUSICREC_SAMPLE_LIST_POSTINGS", 4096)));
+        p.idf             = env("MUSICREC_IDF", 1) != 0;
+        return p;
+    }();
+    return policy;
+}
+
+void HashStats::add(size_t df, size_t n) {
+    ++hashes;
+    postings += n;
+    maxDf = max(maxDf, df);
+    int b = 0;
+    while (b + 1 < DF_BUCKETS && (size_t(2) << b) <= df) ++b;
+    ++dfHist[b];
+}
+
+string HashStats::summary() const {
+    std::ostringstream oss;
+    oss << hashes << " hashes, df";
+    for (int b = 0; b < DF_BUCKETS; ++b) {
+        size_t lo = size_t(1) << b, hi = (size_t(2) << b) - 1;
+        oss << " " << lo;
+        if (b + 1 == DF_BUCKETS) oss << "+";
+        else if (hi > lo) oss << "-" << hi;
+        oss << ":" << dfHist[b];
+    }
+    oss << ", max df " << maxDf << "; dropped " << stopHashes << " stop hashes ("
+        << stopPostings << " postings), " << cappedPostings << " postings over the per-song cap";
+    return oss.str();
+}
+
+size_t sample_postings(vector<Posting>& postings, size_t from, size_t keep) {
+    const size_t n = postings.size() - from;
+    if (n <= keep) return 0;
+    for (size_t k = 0; k < keep; ++k) postings[from + k] = postings[from + k * n / keep];
+    postings.resize(from + keep);
+    return n - keep;
+}
+
+size_t cap_postings_per_song(vector<Posting>& postings, size_t cap) {
+    if (cap == 0 || postings.size() <= cap) return 0;
+    sort_postings(postings);
+    size_t kept = 0, i = 0;
+    while (i < postings.size()) {
+        size_t j = i;
+        while (j < postings.size() && postings[j].songId == postings[i].songId) ++j;
+        size_t n = j - i;
+        if (n <= cap) {
+            for (size_t k = i; k < j; ++k) postings[kept++] = postings[k];
+        } else {
+            for (size_t k = 0; k < cap; ++k) postings[kept++] = postings[i + k * n / cap];
+        }
+        i = j;
+    }
+    size_t removed = postings.size() - kept;
+    postings.resize(kept);
+    return removed;
+}
+
+void Tombstones::kill(int32_t songId) {
+    if (dead(songId)) return;
+    const size_t i = static_cast<size_t>(songId);
+    if ((i >> 6) >= bits_.size()) bits_.resize((i >> 6) + 1, 0);
+    bits_[i >> 6] |= uint64_t(1) << (i & 63);
+    ++count_;
+}
+
+void Tombstones::forget(const Tombstones& purged) {
+    count_ = 0;
+    for (size_t w = 0; w < bits_.size(); ++w) {
+        if (w < purged.bits_.size()) bits_[w] &= ~purged.bits_[w];
+        count_ += static_cast<size_t>(__builtin_popcountll(bits_[w]));
+    }
+}
+
+size_t Tombstones::purge(vector<Posting>& postings, size_t from) const {
+    if (count_ == 0) return 0;
+    auto end = remove_if(postings.begin() + static_cast<ptrdiff_t>(from), postings.end(),
+                         [this](const Posting& p){ return dead(p.songId); });
+    size_t n = static_cast<size_t>(postings.end() - end);
+    postings.erase(end, postings.end());
+    return n;
+}
+
+PostingSource Tombstones::purged(PostingSource next, size_t* purged) const {
+    if (count_ == 0) return next;
+    return [next, dead = *this, purged](uint32_t& hash, vector<Posting>& out) {
+        while (next(hash, out)) {
+            size_t n = dead.purge(out);
+            if (purged) *purged += n;
+            if (!out.empty()) return true;
+        }
+        return false;
+    };
+}
+
+size_t distinct_songs(const Posting* postings, size_t n) {
+    size_t songs = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (i == 0 || postings[i].songId != postings[i-1].songId) ++songs;
+    return songs;
+}
+
+PostingSource apply_hash_policy(PostingSource next, size_t numSongs, HashStats* stats) {
+    const HashPolicy& policy = hash_policy();
+    size_t stopAbove = NO_LIMIT;
+    if (numSongs > 0 && policy.stopDf > 0)
+        stopAbove = max(policy.stopMinSongs, static_cast<size_t>(policy.stopDf * numSongs));
+    return [next, stopAbove, stats, cap = policy.songCap](uint32_t& hash, vector<Posting>& out) {
+        while (next(hash, out)) {
+            if (out.empty()) continue;
+            size_t capped = cap_postings_per_song(out, cap);
+            sort_postings(out);
+            size_t df = distinct_songs(out);
+            if (stats) stats->cappedPostings += capped;
+            if (df > stopAbove) {
+                if (stats) { ++stats->stopHashes; stats->stopPostings += out.size(); }
+                continue;
+            }
+            if (stats) stats->add(df, out.size());
+            return true;
+        }
+        return false;
+    };
+}
+
+void encode_postings(vector<Posting>& postings, string& out) {
+    sort_postings(postings);
+    int32_t prevSong = 0, prevOffset = 0;
+    for (const auto& p : postings) {
+        uint32_t songGap = static_cast<uint32_t>(p.songId - prevSong);
+        put_varint(out, songGap);
+        put_varint(out, static_cast<uint32_t>(songGap ? p.offset : p.offset - prevOffset));
+        prevSong = p.songId;
+        prevOffset = p.offset;
+    }
+}
+
+const uint8_t* decode_postings(const uint8_t* p, uint32_t count, Posting* out) {
+    int32_t song = 0, offset = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t songGap, v;
+        // Most gaps fit one byte; take the fast path before the general decoder.
+        if (p[0] < 0x80 && p[1] < 0x80) { songGap = p[0]; v = p[1]; p += 2; }
+        else { p = get_varint(p, songGap); p = get_varint(p, v); }
+        song += static_cast<int32_t>(songGap);
+        offset = songGap ? static_cast<int32_t>(v) : offset + static_cast<int32_t>(v);
+        out[i] = Posting{ song, offset };
+    }
+    return p;
+}
+
+void build_buckets(const FlatDirEntry* dir, size_t numHashes, uint32_t* buckets) {
+    size_t i = 0;
+    for (size_t b = 0; b + 1 < FlatIndex::NUM_BUCKETS; ++b) {
+        while (i < numHashes && (dir[i].hash >> (32 - FlatIndex::BUCKET_BITS)) < b) ++i;
+        buckets[b] = static_cast<uint32_t>(i);
+    }
+    buckets[FlatIndex::NUM_BUCKETS - 1] = static_cast<uint32_t>(numHashes);
+}
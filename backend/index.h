@@ -0,0 +1,198 @@
+#pragma once
+// Inverted fingerprint index: hash -> list of (songId, offset) postings.
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Posting {
+    int32_t songId;
+    int32_t offset;
+};
+
+static const size_t NO_LIMIT = std::numeric_limits<size_t>::max();
+
+class PostingIndex {
+public:
+    virtual ~PostingIndex() = default;
+    // Appends all postings for `hash` to `out`, unless there are more than
+    // `limit`; returns how many the index holds either way.
+    virtual size_t lookup(uint32_t hash, std::vector<Posting>& out, size_t limit = NO_LIMIT) const = 0;
+    virtual size_t num_hashes() const = 0;
+    virtual size_t num_postings() const = 0;
+    // Heap or mapped bytes held by the index structures.
+    virtual size_t memory_bytes() const = 0;
+};
+
+// Mutable hash map of posting vectors: the original in-memory layout, kept
+// so the flat index can be compared against it (MUSICREC_INDEX=map).
+class MapIndex : public PostingIndex {
+public:
+    void add(uint32_t hash, Posting p) { map_[hash].push_back(p); ++numPostings_; }
+    size_t lookup(uint32_t hash, std::vector<Posting>& out, size_t limit = NO_LIMIT) const override;
+    size_t num_hashes() const override { return map_.size(); }
+    size_t num_postings() const override { return numPostings_; }
+    size_t memory_bytes() const override;
+
+private:
+    std::unordered_map<uint32_t, std::vector<Posting>> map_;
+    size_t numPostings_ = 0;
+};
+
+struct FlatDirEntry {
+    uint32_t hash;
+    uint32_t count;     // postings under this hash
+    uint64_t byteOff;   // start of the encoded list in the blob
+};
+
+// CSR layout: a sorted hash directory pointing into one packed blob of
+// varint-coded postings. A 64K-entry bucket table on the top 16 hash bits
+// narrows each lookup to a short run of the directory (small indexes skip it
+// and search the whole directory). The view does not own its memory; it
+// normally points into a mapped index file or a FlatSegment.
+class FlatIndex : public PostingIndex {
+public:
+    static const uint32_t BUCKET_BITS = 16;
+    static const size_t   NUM_BUCKETS = (size_t(1) << BUCKET_BITS) + 1;
+    // Directories shorter than this are searched without a bucket table.
+    static const size_t   MIN_BUCKETED_HASHES = 1 << 14;
+
+    FlatIndex() = default;
+    FlatIndex(const FlatDirEntry* dir, size_t numHashes, const uint8_t* blob, size_t blobLen,
+              const uint32_t* buckets, size_t numPostings)
+        : dir_(dir), numHashes_(numHashes), blob_(blob), blobLen_(blobLen),
+          buckets_(buckets), numPostings_(numPostings) {}
+
+    size_t lookup(uint32_t hash, std::vector<Posting>& out, size_t limit = NO_LIMIT) const override;
+    size_t num_hashes() const override { return numHashes_; }
+    size_t num_postings() const override { return numPostings_; }
+    size_t memory_bytes() const override;
+
+    // Sequential access for merges: the i-th hash in order and its postings.
+    uint32_t hash_at(size_t i) const { return dir_[i].hash; }
+    uint32_t count_at(size_t i) const { return dir_[i].count; }
+    void decode_at(size_t i, std::vector<Posting>& out) const;
+    // Position of the first hash >= `hash`, searching forward from `from`
+    // (num_hashes() if none). Gallops, so walking the directory in hash
+    // order with ascending hashes touches it sequentially.
+    size_t seek(uint32_t hash, size_t from) const;
+
+protected:
+    const FlatDirEntry* dir_ = nullptr;
+    size_t numHashes_ = 0;
+    const uint8_t* blob_ = nullptr;
+    size_t blobLen_ = 0;
+    const uint32_t* buckets_ = nullptr;
+    size_t numPostings_ = 0;
+};
+
+// Pulls (hash, postings) groups in strictly increasing hash order; returns
+// false when exhausted. Used to stream merges into files and segments.
+using PostingSource = std::function<bool(uint32_t&, std::vector<Posting>&)>;
+
+// Deleted songs whose postings are still in the index, one bit per song id.
+// Voting skips their postings until a merge drops them. Immutable once
+// shared; a delete publishes a copy with one more bit.
+class Tombstones {
+public:
+    bool dead(int32_t songId) const {
+        const size_t i = static_cast<size_t>(songId);
+        return (i >> 6) < bits_.size() && (bits_[i >> 6] >> (i & 63)) & 1;
+    }
+    size_t count() const { return count_; }
+    void kill(int32_t songId);
+    // Clears the songs of `purged`, once their postings are gone.
+    void forget(const Tombstones& purged);
+    // Removes the postings of dead songs, keeping the others in order;
+    // returns how many went.
+    size_t purge(std::vector<Posting>& postings, size_t from = 0) const;
+    // `next` with the postings of dead songs removed (and hashes left
+    // without postings skipped). Counts what it drops in `*purged` if given.
+    PostingSource purged(PostingSource next, size_t* purged = nullptr) const;
+
+private:
+    std::vector<uint64_t> bits_;
+    size_t count_ = 0;
+};
+
+// Heap-owned FlatIndex. Immutable once built, so readers can share it freely.
+class FlatSegment : public FlatIndex {
+public:
+    explicit FlatSegment(const PostingSource& next);
+    // Builds from unordered (hash, posting) pairs; sorts `entries` in place.
+    static FlatSegment* from_entries(std::vector<std::pair<uint32_t, Posting>>& entries);
+
+private:
+    std::vector<FlatDirEntry> dirStore_;
+    std::string blobStore_;
+    std::vector<uint32_t> bucketStore_;
+};
+
+// K-way merge of several flat indexes by hash. Postings of a hash present in
+// several parts are concatenated in part order.
+class FlatMerger {
+public:
+    explicit FlatMerger(std::vector<const FlatIndex*> parts);
+    bool next(uint32_t& hash, std::vector<Posting>& out);
+
+private:
+    std::vector<const FlatIndex*> parts_;
+    std::vector<size_t> pos_;
+};
+
+// Limits on hashes that are common across the catalog (silence, sustained
+// tones), read once from the environment (see README):
+struct HashPolicy {
+    size_t songCap;          // postings kept per (hash, song), thinned evenly; 0 = all
+    double stopDf;           // hashes in more than this fraction of songs are
+    size_t stopMinSongs;     // ...dropped when index.bin is written, if also in more
+                             // than this many songs; stopDf 0 = keep all
+    size_t maxListPostings;  // lookups skip longer lists (older indexes, deltas)
+    size_t sampleListPostings; // longer lists are thinned to this many votes per query
+    bool idf;                // weight votes by inverse document frequency
+};
+const HashPolicy& hash_policy();
+
+// Document-frequency statistics of the hashes written to an index.
+struct HashStats {
+    static const int DF_BUCKETS = 8;   // df 1, 2-3, 4-7, ..., 128+
+    size_t hashes = 0;
+    size_t postings = 0;
+    size_t stopHashes = 0;             // dropped as too common
+    size_t stopPostings = 0;
+    size_t cappedPostings = 0;         // thinned by the per-song cap
+    size_t maxDf = 0;
+    size_t dfHist[DF_BUCKETS] = {};
+
+    void add(size_t df, size_t postings);
+    std::string summary() const;
+};
+
+// Sorts postings by (songId, offset) and thins each song's run to `cap`
+// evenly spaced postings (0 = no cap). Returns the postings removed.
+size_t cap_postings_per_song(std::vector<Posting>& postings, size_t cap);
+// Thins postings[from..] to `keep` evenly spaced postings, in order, if there
+// are more. Returns the postings removed.
+size_t sample_postings(std::vector<Posting>& postings, size_t from, size_t keep);
+// Distinct songs in postings sorted by songId.
+size_t distinct_songs(const Posting* postings, size_t n);
+inline size_t distinct_songs(const std::vector<Posting>& postings) {
+    return distinct_songs(postings.data(), postings.size());
+}
+// Wraps `next` with the hash policy for an index of `numSongs` songs: the
+// per-song cap, and stop-hash removal when numSongs > 0. Counts what it
+// passes and drops in `stats` if given.
+PostingSource apply_hash_policy(PostingSource next, size_t numSongs, HashStats* stats);
+
+// Postings of one hash sorted by (songId, offset), then delta-coded as
+// varint(songId gap) followed by the offset: absolute for a new song, a gap
+// within the same song.
+void encode_postings(std::vector<Posting>& postings, std::string& out);
+// Decodes `count` postings starting at `p`; returns the byte just past them.
+const uint8_t* decode_postings(const uint8_t* p, uint32_t count, Posting* out);
+
+// Fills the bucket table for a sorted directory.
+void build_buckets(const FlatDirEntry* dir, size_t numHashes, uint32_t* buckets);
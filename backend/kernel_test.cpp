@@ -0,0 +1,135 @@
+// Equivalence test for the vectorized kernels (kernels.h): every instruction
+// set this build and CPU can run must give bit for bit what the scalar code
+// gives, or fingerprints made on different machines would stop matching.
+// Also checks the power/top-k peak choice against the dB + nth_element
+// selection it replaced. Exits non-zero if anything differs.
+//
+//   ./kernel_test [frames]
+#include "kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    // Lengths around every vector width, so the scalar tails are hit too.
+    const int SIZES[] = { 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 33, 64, 127, 128, 129, 255, 256, 257, 1000 };
+
+    const char* const DOWNMIX[] = { "", "downmix 1ch", "downmix 2ch", "", "", "", "downmix 6ch" };
+
+    int failures = 0;
+
+    void fail(const char* what, const char* isa, int n, int frame) {
+        if (++failures <= 20) fprintf(stderr, "MISMATCH %s [%s] n=%d frame=%d\n", what, isa, n, frame);
+    }
+
+    // A spectrum frame. With `ties`, values come from a few levels so equal
+    // powers are common; otherwise from a wide log-uniform range.
+    void random_frame(mt19937& rng, int n, bool ties, vector<double>& re_im) {
+        re_im.resize(2 * static_cast<size_t>(n));
+        uniform_int_distribution<int> level(0, 3);
+        uniform_real_distribution<double> mag(-6, 4), sign(-1, 1);
+        for (auto& v : re_im) v = ties ? level(rng) : copysign(pow(10.0, mag(rng)), sign(rng));
+    }
+
+    // The previous peak choice: 20*log10(|X|) in float, nth_element on it.
+    // Returns the k strongest bins, ascending, or an empty vector when the
+    // k-th and the next are tied (nth_element then picks either).
+    vector<int> old_selection(const vector<double>& re_im, int n, int k) {
+        vector<pair<float,int>> mags;
+        for (int f = 0; f < n; ++f) {
+            double re = re_im[2*f], im = re_im[2*f + 1];
+            mags.emplace_back(static_cast<float>(20.0 * log10(sqrt(re*re + im*im) + 1e-9)), f);
+        }
+        auto byDb = [](const pair<float,int>& a, const pair<float,int>& b){ return a.first > b.first; };
+        if (static_cast<int>(mags.size()) > k) {
+            nth_element(mags.begin(), mags.begin() + k, mags.end(), byDb);
+            float kth = mags[0].first;
+            for (int i = 1; i < k; ++i) kth = min(kth, mags[i].first);
+            for (size_t i = k; i < mags.size(); ++i) if (mags[i].first == kth) return {};
+            mags.resize(k);
+        }
+        vector<int> bins;
+        for (const auto& m : mags) bins.push_back(m.second);
+        sort(bins.begin(), bins.end());
+        return bins;
+    }
+
+    void check_power_topk(const vector<KernelSet>& sets, mt19937& rng, int frames) {
+        vector<double> re_im;
+        vector<float> want, got;
+        int wantIdx[TOP_K_MAX], gotIdx[TOP_K_MAX];
+        size_t oldCompared = 0;
+        for (int frame = 0; frame < frames; ++frame) {
+            const int n = SIZES[frame % (sizeof(SIZES) / sizeof(SIZES[0]))];
+            const bool ties = frame % 4 == 0;
+            random_frame(rng, n, ties, re_im);
+            const fftw_complex* in = reinterpret_cast<const fftw_complex*>(re_im.data());
+            want.assign(n, 0); got.assign(n, 0);
+            sets[0].power(in, want.data(), n);
+            for (int k = 1; k <= TOP_K_MAX + 1; k += 2) {
+                const int wantN = sets[0].topk(want.data(), n, k, wantIdx);
+                for (size_t s = 1; s < sets.size(); ++s) {
+                    const int gotN = sets[s].topk(want.data(), n, k, gotIdx);
+                    if (gotN != wantN || !equal(wantIdx, wantIdx + wantN, gotIdx)) fail("top_k", sets[s].isa, n, frame);
+                }
+                if (ties || k > TOP_K_MAX) continue;
+                vector<int> old = old_selection(re_im, n, k);
+                if (old.empty()) continue;
+                vector<int> now(wantIdx, wantIdx + wantN);
+                sort(now.begin(), now.end());
+                if (now != old) fail("top_k vs dB/nth_element", "scalar", n, frame);
+                ++oldCompared;
+            }
+            for (size_t s = 1; s < sets.size(); ++s) {
+                sets[s].power(in, got.data(), n);
+                if (memcmp(want.data(), got.data(), n * sizeof(float)) != 0) fail("power_spectrum", sets[s].isa, n, frame);
+            }
+        }
+        printf("power_spectrum, top_k: %d frames, %zu selections checked against dB/nth_element\n", frames, oldCompared);
+    }
+
+    void check_downmix(const vector<KernelSet>& sets, mt19937& rng, int frames) {
+        uniform_real_distribution<float> sample(-1, 1);
+        vector<float> in, want, got;
+        for (int channels : { 1, 2, 6 }) {
+            for (int frame = 0; frame < frames; ++frame) {
+                const int n = SIZES[frame % (sizeof(SIZES) / sizeof(SIZES[0]))];
+                in.resize(static_cast<size_t>(n) * channels);
+                for (auto& v : in) v = sample(rng);
+                want = in;
+                sets[0].downmix(want.data(), n, channels);
+                for (size_t s = 1; s < sets.size(); ++s) {
+                    got = in;
+                    sets[s].downmix(got.data(), n, channels);
+                    if (memcmp(want.data(), got.data(), n * sizeof(float)) != 0) fail(DOWNMIX[channels], sets[s].isa, n, frame);
+                }
+                if (channels == 1 && want != in) fail("downmix 1ch (must be untouched)", sets[0].isa, n, frame);
+            }
+        }
+        printf("downmix: %d frames each at 1, 2 and 6 channels\n", frames);
+    }
+}
+
+int main(int argc, char** argv) {
+    const int frames = argc > 1 ? max(1, atoi(argv[1])) : 20000;
+    const vector<KernelSet> sets = kernel_sets();
+    printf("kernel sets:");
+    for (const auto& s : sets) printf(" %s", s.isa);
+    printf("\n");
+    mt19937 rng(7);
+    check_power_topk(sets, rng, frames);
+    check_downmix(sets, rng, frames / 10);
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("all kernels agree\n");
+    return 0;
+}
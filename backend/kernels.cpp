@@ -0,0 +1,270 @@
+#include "kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON 1
+#endif
+
+using namespace std;
+
+namespace {
+    inline float power_at(const fftw_complex* in, int i) {
+        double re = in[i][0], im = in[i][1];
+        return static_cast<float>(re*re + im*im);
+    }
+
+    // Running top-k, kept sorted by value (descending) then index. Candidates
+    // arrive in index order and must beat the current k-th value strictly, so
+    // ties resolve to the lower index no matter how the input was scanned.
+    struct TopK {
+        float val[TOP_K_MAX];
+        int idx[TOP_K_MAX];
+        int k;
+        int size = 0;
+        float thr = -INFINITY;   // a candidate must exceed this to get in
+
+        explicit TopK(int k) : k(min(k, TOP_K_MAX)) {}
+
+        void push(float v, int i) {
+            int j = size < k ? size++ : k - 1;
+            while (j > 0 && val[j-1] < v) { val[j] = val[j-1]; idx[j] = idx[j-1]; --j; }
+            val[j] = v; idx[j] = i;
+            if (size == k) thr = val[k-1];
+        }
+
+        int emit(int* out) const {
+            copy(idx, idx + size, out);
+            return size;
+        }
+    };
+
+    void power_spectrum_scalar(const fftw_complex* in, float* out, int n) {
+        for (int i = 0; i < n; ++i) out[i] = power_at(in, i);
+    }
+
+    int top_k_scalar(const float* v, int n, int k, int* idx) {
+        TopK t(k);
+        if (t.k <= 0) return 0;
+        for (int i = 0; i < n; ++i) if (v[i] > t.thr) t.push(v[i], i);
+        return t.emit(idx);
+    }
+
+    // Frame i is read before buf[i] is written, and never after buf[i + 1]
+    // is, so the output can overwrite the input as it goes.
+    void downmix_scalar(float* buf, size_t frames, int channels) {
+        if (channels == 1) return;
+        const float* in = buf;
+        for (size_t i = 0; i < frames; ++i, in += channels) {
+            float s = 0.0f;
+            for (int c = 0; c < channels; ++c) s += in[c];
+            buf[i] = s / channels;
+        }
+    }
+
+#ifdef KERNELS_X86
+    // Squares are summed after a shuffle rather than fused, so the rounding
+    // matches the scalar loop bit for bit.
+    __attribute__((target("avx2")))
+    void power_spectrum_avx2(const fftw_complex* in, float* out, int n) {
+        const double* p = &in[0][0];
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256d a = _mm256_loadu_pd(p + 2*i);       // r0 i0 r1 i1
+            __m256d b = _mm256_loadu_pd(p + 2*i + 4);   // r2 i2 r3 i3
+            a = _mm256_mul_pd(a, a);
+            b = _mm256_mul_pd(b, b);
+            __m256d s = _mm256_hadd_pd(a, b);           // p0 p2 p1 p3
+            s = _mm256_permute4x64_pd(s, _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_ps(out + i, _mm256_cvtpd_ps(s));
+        }
+        for (; i < n; ++i) out[i] = power_at(in, i);
+    }
+
+    __attribute__((target("avx2")))
+    int top_k_avx2(const float* v, int n, int k, int* idx) {
+        TopK t(k);
+        if (t.k <= 0) return 0;
+        int i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 x = _mm256_loadu_ps(v + i);
+            unsigned mask = static_cast<unsigned>(
+                _mm256_movemask_ps(_mm256_cmp_ps(x, _mm256_set1_ps(t.thr), _CMP_GT_OQ)));
+            while (mask) {
+                int j = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (v[j] > t.thr) t.push(v[j], j);
+            }
+        }
+        for (; i < n; ++i) if (v[i] > t.thr) t.push(v[i], i);
+        return t.emit(idx);
+    }
+
+    // Each block of 8 frames is loaded before its mono samples are stored;
+    // the stores land at or below the next block's loads.
+    __attribute__((target("avx2")))
+    void downmix_avx2(float* buf, size_t frames, int channels) {
+        if (channels != 2) { downmix_scalar(buf, frames, channels); return; }
+        const __m256 half = _mm256_set1_ps(0.5f);
+        size_t i = 0;
+        for (; i + 8 <= frames; i += 8) {
+            __m256 a = _mm256_loadu_ps(buf + 2*i);      // l0 r0 .. l3 r3
+            __m256 b = _mm256_loadu_ps(buf + 2*i + 8);  // l4 r4 .. l7 r7
+            __m256 s = _mm256_hadd_ps(a, b);            // m0 m1 m4 m5 | m2 m3 m6 m7
+            s = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(s), _MM_SHUFFLE(3, 1, 2, 0)));
+            _mm256_storeu_ps(buf + i, _mm256_mul_ps(s, half));
+        }
+        for (; i < frames; ++i) buf[i] = (buf[2*i] + buf[2*i + 1]) / 2;
+    }
+
+    __attribute__((target("avx512f")))
+    void power_spectrum_avx512(const fftw_complex* in, float* out, int n) {
+        const double* p = &in[0][0];
+        const __m512i even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+        const __m512i odd  = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+        int i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m512d a = _mm512_loadu_pd(p + 2*i);
+            __m512d b = _mm512_loadu_pd(p + 2*i + 8);
+            a = _mm512_mul_pd(a, a);
+            b = _mm512_mul_pd(b, b);
+            __m512d s = _mm512_add_pd(_mm512_permutex2var_pd(a, even, b),
+                                      _mm512_permutex2var_pd(a, odd, b));
+            _mm256_storeu_ps(out + i, _mm512_maskz_cvtpd_ps(0xFF, s));
+        }
+        for (; i < n; ++i) out[i] = power_at(in, i);
+    }
+
+    __attribute__((target("avx512f")))
+    int top_k_avx512(const float* v, int n, int k, int* idx) {
+        TopK t(k);
+        if (t.k <= 0) return 0;
+        int i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512 x = _mm512_loadu_ps(v + i);
+            unsigned mask = _mm512_cmp_ps_mask(x, _mm512_set1_ps(t.thr), _CMP_GT_OQ);
+            while (mask) {
+                int j = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (v[j] > t.thr) t.push(v[j], j);
+            }
+        }
+        for (; i < n; ++i) if (v[i] > t.thr) t.push(v[i], i);
+        return t.emit(idx);
+    }
+
+    __attribute__((target("avx512f")))
+    void downmix_avx512(float* buf, size_t frames, int channels) {
+        if (channels != 2) { downmix_scalar(buf, frames, channels); return; }
+        const __m512i left  = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+        const __m512i right = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+        const __m512 half = _mm512_set1_ps(0.5f);
+        size_t i = 0;
+        for (; i + 16 <= frames; i += 16) {
+            __m512 a = _mm512_loadu_ps(buf + 2*i);
+            __m512 b = _mm512_loadu_ps(buf + 2*i + 16);
+            __m512 s = _mm512_add_ps(_mm512_permutex2var_ps(a, left, b), _mm512_permutex2var_ps(a, right, b));
+            _mm512_storeu_ps(buf + i, _mm512_mul_ps(s, half));
+        }
+        for (; i < frames; ++i) buf[i] = (buf[2*i] + buf[2*i + 1]) / 2;
+    }
+#endif
+
+#ifdef KERNELS_NEON
+    void power_spectrum_neon(const fftw_complex* in, float* out, int n) {
+        const double* p = &in[0][0];
+        int i = 0;
+        for (; i + 2 <= n; i += 2) {
+            float64x2x2_t c = vld2q_f64(p + 2*i);       // {r0 r1}, {i0 i1}
+            float64x2_t s = vaddq_f64(vmulq_f64(c.val[0], c.val[0]),
+                                      vmulq_f64(c.val[1], c.val[1]));
+            vst1_f32(out + i, vcvt_f32_f64(s));
+        }
+        for (; i < n; ++i) out[i] = power_at(in, i);
+    }
+
+    int top_k_neon(const float* v, int n, int k, int* idx) {
+        TopK t(k);
+        if (t.k <= 0) return 0;
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            uint32x4_t m = vcgtq_f32(vld1q_f32(v + i), vdupq_n_f32(t.thr));
+            if (!vmaxvq_u32(m)) continue;
+            for (int j = i; j < i + 4; ++j) if (v[j] > t.thr) t.push(v[j], j);
+        }
+        for (; i < n; ++i) if (v[i] > t.thr) t.push(v[i], i);
+        return t.emit(idx);
+    }
+
+    void downmix_neon(float* buf, size_t frames, int channels) {
+        if (channels != 2) { downmix_scalar(buf, frames, channels); return; }
+        size_t i = 0;
+        for (; i + 4 <= frames; i += 4) {
+            float32x4x2_t lr = vld2q_f32(buf + 2*i);
+            vst1q_f32(buf + i, vmulq_n_f32(vaddq_f32(lr.val[0], lr.val[1]), 0.5f));
+        }
+        for (; i < frames; ++i) buf[i] = (buf[2*i] + buf[2*i + 1]) / 2;
+    }
+#endif
+
+    const KernelSet SCALAR{ "scalar", power_spectrum_scalar, top_k_scalar, downmix_scalar };
+#if defined(KERNELS_X86)
+    const KernelSet AVX512{ "avx512", power_spectrum_avx512, top_k_avx512, downmix_avx512 };
+    const KernelSet AVX2{ "avx2", power_spectrum_avx2, top_k_avx2, downmix_avx2 };
+#elif defined(KERNELS_NEON)
+    const KernelSet NEON{ "neon", power_spectrum_neon, top_k_neon, downmix_neon };
+#endif
+
+    KernelSet choose_kernels() {
+        const char* env = getenv("MUSICREC_SIMD");
+        string want = env ? env : "";
+        if (want == "scalar") return SCALAR;
+#if defined(KERNELS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && want != "avx2") return AVX512;
+        if (__builtin_cpu_supports("avx2")) return AVX2;
+#elif defined(KERNELS_NEON)
+        return NEON;
+#endif
+        return SCALAR;
+    }
+
+    const KernelSet& kernels() {
+        static const KernelSet K = choose_kernels();
+        return K;
+    }
+}
+
+vector<KernelSet> kernel_sets() {
+    vector<KernelSet> sets{ SCALAR };
+#if defined(KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) sets.push_back(AVX2);
+    if (__builtin_cpu_supports("avx512f")) sets.push_back(AVX512);
+#elif defined(KERNELS_NEON)
+    sets.push_back(NEON);
+#endif
+    return sets;
+}
+
+void power_spectrum(const fftw_complex* in, float* out, int n) {
+    kernels().power(in, out, n);
+}
+
+int top_k(const float* v, int n, int k, int* idx) {
+    return kernels().topk(v, n, k, idx);
+}
+
+void downmix(float* buf, size_t frames, int channels) {
+    kernels().downmix(buf, frames, channels);
+}
+
+const char* kernel_isa() {
+    return kernels().isa;
+}
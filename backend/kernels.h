@@ -0,0 +1,36 @@
+#pragma once
+// Vectorized inner loops of the fingerprinting pipeline. The instruction set
+// (AVX-512, AVX2, NEON or plain scalar code) is picked once at runtime;
+// MUSICREC_SIMD=scalar|avx2 forces a narrower one for A/B comparisons. Every
+// variant returns exactly what the scalar code does (`make check` runs
+// kernel_test to verify it).
+#include <cstddef>
+#include <vector>
+#include <fftw3.h>
+
+// out[i] = re^2 + im^2 of in[i], rounded to float. Peaks are ranked on power
+// rather than dB: the order is the same and no log is needed.
+void power_spectrum(const fftw_complex* in, float* out, int n);
+
+// Writes the indices of the k largest values of v[0..n) to idx, largest
+// first; equal values keep the lower index first. k is capped at
+// TOP_K_MAX. Returns the number of indices written, min(k, n).
+static const int TOP_K_MAX = 16;
+int top_k(const float* v, int n, int k, int* idx);
+
+// Averages each frame of `frames` interleaved frames of `channels` samples,
+// in place: buf[i] becomes the mean of frame i. Stereo is vectorized.
+void downmix(float* buf, size_t frames, int channels);
+
+// Name of the kernel set in use, for logs.
+const char* kernel_isa();
+
+// One implementation of each kernel. kernel_sets() lists those this build
+// and CPU can run, scalar first, for kernel_test to compare.
+struct KernelSet {
+    const char* isa;
+    void (*power)(const fftw_complex*, float*, int);
+    int (*topk)(const float*, int, int, int*);
+    void (*downmix)(float*, size_t, int);
+};
+std::vector<KernelSet> kernel_sets();
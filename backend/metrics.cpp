@@ -0,0 +1,174 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+namespace metrics {
+
+std::atomic<bool> ENABLED{ [] {
+    const char* v = getenv("MUSICREC_METRICS");
+    return v && string(v) == "1";
+}() };
+
+namespace {
+    static const size_t MAX_BUCKETS = 24;
+
+    struct Entry {
+        string name;
+        string labels;
+        string help;
+        const char* type;
+        // Appends the sample lines for this series.
+        function<void(const Entry&, ostringstream&)> write;
+    };
+
+    // Function-local, so metrics defined at namespace scope in any file can
+    // register during static initialisation.
+    std::mutex& registry_mtx() { static std::mutex m; return m; }
+    vector<Entry>& registry() { static vector<Entry> r; return r; }
+
+    void add(Entry e) {
+        std::lock_guard<std::mutex> lock(registry_mtx());
+        registry().push_back(std::move(e));
+    }
+
+    string series(const string& name, const string& labels, const string& extra = "") {
+        string l = labels;
+        if (!extra.empty()) l += (l.empty() ? "" : ",") + extra;
+        return l.empty() ? name : name + "{" + l + "}";
+    }
+
+    void write_value(ostringstream& out, double v) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.10g", v);
+        out << buf;
+    }
+
+    double resident_bytes() {
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (!f) return 0;
+        long size = 0, resident = 0;
+        int n = fscanf(f, "%ld %ld", &size, &resident);
+        fclose(f);
+        return n == 2 ? static_cast<double>(resident) * sysconf(_SC_PAGESIZE) : 0;
+    }
+
+    const bool PROCESS_GAUGES = [] {
+        gauge("process_resident_memory_bytes", "", "Resident set size.", resident_bytes);
+        return true;
+    }();
+}
+
+const vector<double>& latency_buckets() {
+    static const vector<double> b = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+        0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+    return b;
+}
+
+const vector<double>& size_buckets() {
+    static const vector<double> b = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+    return b;
+}
+
+int stripe() {
+    static std::atomic<int> next{0};
+    thread_local int slot = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+    return slot;
+}
+
+Counter::Counter(const char* name, const char* labels, const char* help) {
+    add(Entry{ name, labels, help, "counter", [this](const Entry& e, ostringstream& out) {
+        out << series(e.name, e.labels) << " " << value() << "\n";
+    }});
+}
+
+uint64_t Counter::value() const {
+    uint64_t v = 0;
+    for (const auto& c : cells_) v += c.v.load(std::memory_order_relaxed);
+    return v;
+}
+
+struct alignas(64) Histogram::Stripe {
+    std::atomic<double> sum{0};
+    std::atomic<uint64_t> counts[MAX_BUCKETS + 1] = {};
+};
+
+Histogram::Histogram(const char* name, const char* labels, const char* help, const vector<double>& bounds)
+    : bounds_(bounds.begin(), bounds.begin() + min(bounds.size(), MAX_BUCKETS)),
+      stripes_(new Stripe[STRIPES]) {
+    add(Entry{ name, labels, help, "histogram", [this](const Entry& e, ostringstream& out) {
+        vector<uint64_t> c = counts();
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < c.size(); ++i) {
+            cumulative += c[i];
+            string le = "+Inf";
+            if (i < bounds_.size()) { ostringstream b; write_value(b, bounds_[i]); le = b.str(); }
+            out << series(e.name + "_bucket", e.labels, "le=\"" + le + "\"") << " " << cumulative << "\n";
+        }
+        out << series(e.name + "_sum", e.labels) << " ";
+        write_value(out, sum());
+        out << "\n" << series(e.name + "_count", e.labels) << " " << cumulative << "\n";
+    }});
+}
+
+Histogram::~Histogram() = default;
+
+void Histogram::record(double v) {
+    size_t b = static_cast<size_t>(lower_bound(bounds_.begin(), bounds_.end(), v) - bounds_.begin());
+    Stripe& s = stripes_[stripe()];
+    s.counts[b].fetch_add(1, std::memory_order_relaxed);
+    double cur = s.sum.load(std::memory_order_relaxed);
+    while (!s.sum.compare_exchange_weak(cur, cur + v, std::memory_order_relaxed)) {}
+}
+
+vector<uint64_t> Histogram::counts() const {
+    vector<uint64_t> c(bounds_.size() + 1, 0);
+    for (int s = 0; s < STRIPES; ++s)
+        for (size_t i = 0; i < c.size(); ++i) c[i] += stripes_[s].counts[i].load(std::memory_order_relaxed);
+    return c;
+}
+
+double Histogram::sum() const {
+    double v = 0;
+    for (int s = 0; s < STRIPES; ++s) v += stripes_[s].sum.load(std::memory_order_relaxed);
+    return v;
+}
+
+void lock(std::unique_lock<std::mutex>& lock, Histogram& wait) {
+    if (lock.try_lock()) return;
+    Clock::time_point t0 = start();
+    lock.lock();
+    wait.observe_since(t0);
+}
+
+void gauge(const char* name, const char* labels, const char* help, function<double()> value) {
+    add(Entry{ name, labels, help, "gauge", [value](const Entry& e, ostringstream& out) {
+        out << series(e.name, e.labels) << " ";
+        write_value(out, value());
+        out << "\n";
+    }});
+}
+
+string render() {
+    ENABLED.store(true, std::memory_order_relaxed);
+    // Series of one metric must be adjacent, under a single HELP/TYPE.
+    std::lock_guard<std::mutex> lock(registry_mtx());
+    map<string, vector<const Entry*>> byName;
+    for (const auto& e : registry()) byName[e.name].push_back(&e);
+    ostringstream out;
+    for (const auto& kv : byName) {
+        out << "# HELP " << kv.first << " " << kv.second[0]->help << "\n"
+            << "# TYPE " << kv.first << " " << kv.second[0]->type << "\n";
+        for (const Entry* e : kv.second) e->write(*e, out);
+    }
+    return out.str();
+}
+
+} // namespace metrics
@@ -0,0 +1,86 @@
+#pragma once
+// Process metrics (counters, latency histograms, scrape-time gauges) in the
+// Prometheus text format.
+//
+// Recording is off until the first scrape, or from startup with
+// MUSICREC_METRICS=1, so a server nobody scrapes pays one relaxed load per
+// sample. Updates go to one of STRIPES cache-line-sized slots chosen per
+// thread, so hot threads rarely share a line; a scrape sums the slots.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace metrics {
+
+using Clock = std::chrono::steady_clock;
+
+extern std::atomic<bool> ENABLED;
+inline bool enabled() { return ENABLED.load(std::memory_order_relaxed); }
+
+static const int STRIPES = 16;
+// The calling thread's slot.
+int stripe();
+
+class Counter {
+public:
+    // `labels` is the inside of the braces, e.g. `endpoint="ping"`, or "".
+    Counter(const char* name, const char* labels, const char* help);
+    void inc(uint64_t n = 1) {
+        if (enabled()) cells_[stripe()].v.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Cell { std::atomic<uint64_t> v{0}; };
+    Cell cells_[STRIPES];
+};
+
+// Bucket upper bounds: request and stage latencies in seconds, and sizes
+// such as postings scanned per query.
+const std::vector<double>& latency_buckets();
+const std::vector<double>& size_buckets();
+
+class Histogram {
+public:
+    Histogram(const char* name, const char* labels, const char* help,
+              const std::vector<double>& bounds = latency_buckets());
+    ~Histogram();
+    void observe(double v) { if (enabled()) record(v); }
+    // Records the seconds since `t0` (from start()); skipped if `t0` was
+    // taken while recording was off.
+    void observe_since(Clock::time_point t0) {
+        if (t0 != Clock::time_point())
+            observe(std::chrono::duration<double>(Clock::now() - t0).count());
+    }
+
+    struct Stripe;
+    std::vector<uint64_t> counts() const;   // per bucket, +Inf last; not cumulative
+    double sum() const;
+    const std::vector<double>& bounds() const { return bounds_; }
+
+private:
+    void record(double v);
+
+    std::vector<double> bounds_;
+    std::unique_ptr<Stripe[]> stripes_;
+};
+
+// Clock::now() while recording, else a zero time point that observe_since ignores.
+inline Clock::time_point start() { return enabled() ? Clock::now() : Clock::time_point(); }
+
+// Locks `lock`, recording the wait in `wait` only if it had to block.
+void lock(std::unique_lock<std::mutex>& lock, Histogram& wait);
+
+// Registers a value computed at scrape time.
+void gauge(const char* name, const char* labels, const char* help, std::function<double()> value);
+
+// Every registered metric in the Prometheus text exposition format. Turns
+// recording on.
+std::string render();
+
+} // namespace metrics
@@ -0,0 +1,103 @@
+// Micro-benchmark for query scoring: the flat VoteScorer against the nested
+// unordered_map voting it replaced, on synthetic vote streams of growing size
+// (a query that hits popular hashes produces hundreds of thousands of votes).
+//
+//   ./microbench [repetitions]
+#include "scoring.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    struct Vote {
+        int32_t songId;
+        int32_t songOffset;
+        int32_t queryOffset;
+    };
+
+    // One true match at a fixed alignment buried in uniformly random noise.
+    void make_votes(size_t n, int numSongs, mt19937& rng, vector<Vote>& out) {
+        out.clear();
+        uniform_int_distribution<int> song(0, numSongs - 1), songOff(0, 20000), qOff(0, 700);
+        for (size_t i = 0; i < n; ++i) {
+            int32_t q = qOff(rng);
+            if (i % 32 == 0) out.push_back(Vote{ 42, q + 1234, q });
+            else out.push_back(Vote{ song(rng), songOff(rng), q });
+        }
+    }
+
+    // The previous scoring: nested hash maps, then a pass for each song's best delta.
+    SongScore score_nested_map(const vector<Vote>& votes) {
+        unordered_map<int, unordered_map<int,int>> counts;
+        int bestSong = -1, bestCount = 0, bestOffset = 0;
+        for (const auto& v : votes) {
+            int delta = v.songOffset - v.queryOffset;
+            int c = ++counts[v.songId][delta];
+            if (c > bestCount) { bestCount = c; bestSong = v.songId; bestOffset = delta; }
+        }
+        vector<pair<int,int>> perSong;
+        for (auto& kv : counts) {
+            int top = 0;
+            for (auto& dv : kv.second) top = max(top, dv.second);
+            perSong.emplace_back(top, kv.first);
+        }
+        sort(perSong.begin(), perSong.end(), greater<>());
+        return SongScore{ bestSong, bestCount, bestOffset };
+    }
+
+    SongScore score_flat(const vector<Vote>& votes, VoteScorer& scorer, vector<SongScore>& top) {
+        scorer.clear();
+        for (const auto& v : votes) scorer.add(v.songId, v.songOffset, v.queryOffset);
+        scorer.rank(5, top);
+        return top.empty() ? SongScore{ -1, 0, 0 } : top[0];
+    }
+
+    double percentile(vector<double> v, double p) {
+        sort(v.begin(), v.end());
+        return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+    }
+
+    template <typename Fn>
+    vector<double> time_runs(int reps, Fn fn) {
+        vector<double> us;
+        for (int r = 0; r < reps; ++r) {
+            auto t0 = chrono::steady_clock::now();
+            fn();
+            us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+        }
+        return us;
+    }
+}
+
+int main(int argc, char** argv) {
+    int reps = argc > 1 ? max(1, atoi(argv[1])) : 20;
+    const int numSongs = 10000;
+    mt19937 rng(12345);
+    vector<Vote> votes;
+    VoteScorer scorer;
+    vector<SongScore> top;
+
+    printf("%10s  %-10s %12s %12s %10s\n", "votes", "scorer", "p50 us", "p99 us", "ns/vote");
+    for (size_t n : { size_t(1000), size_t(10000), size_t(100000), size_t(1000000) }) {
+        make_votes(n, numSongs, rng, votes);
+        SongScore a = score_nested_map(votes), b = score_flat(votes, scorer, top);
+        if (a.songId != b.songId || a.count != b.count || a.delta != b.delta)
+            printf("MISMATCH at %zu votes: map (%d,%d,%d) flat (%d,%d,%d)\n",
+                   n, a.songId, a.count, a.delta, b.songId, b.count, b.delta);
+
+        auto mapUs = time_runs(reps, [&]{ score_nested_map(votes); });
+        auto flatUs = time_runs(reps, [&]{ score_flat(votes, scorer, top); });
+        for (auto& row : { make_pair("nested_map", &mapUs), make_pair("flat", &flatUs) }) {
+            double p50 = percentile(*row.second, 0.5);
+            printf("%10zu  %-10s %12.1f %12.1f %10.1f\n", n, row.first, p50,
+                   percentile(*row.second, 0.99), p50 * 1000.0 / n);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "rcu.h"
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Each reading thread owns one cache-line sized slot that holds the global
+// epoch it observed on entry (0 while idle). An object retired at epoch r may
+// be freed once no slot holds an epoch <= r.
+namespace {
+    static const int MAX_READERS = 512;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};
+        atomic<bool> owned{false};
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        function<void()> reclaim;
+    };
+
+    Slot SLOTS[MAX_READERS];
+    atomic<uint64_t> GLOBAL_EPOCH{1};
+    mutex RETIRE_MTX;
+    // Never destroyed: the compactor thread may still retire during exit.
+    vector<Retired>& RETIRED = *new vector<Retired>();
+
+    struct ThreadSlot {
+        Slot* slot = nullptr;
+        int depth = 0;
+
+        Slot* get() {
+            while (!slot) {
+                for (auto& s : SLOTS) {
+                    bool expected = false;
+                    if (!s.owned.load(memory_order_relaxed) &&
+                        s.owned.compare_exchange_strong(expected, true)) { slot = &s; break; }
+                }
+                if (!slot) this_thread::yield(); // more live readers than slots
+            }
+            return slot;
+        }
+
+        ~ThreadSlot() {
+            if (slot) {
+                slot->epoch.store(0);
+                slot->owned.store(false);
+            }
+        }
+    };
+
+    thread_local ThreadSlot TLS_SLOT;
+
+    uint64_t min_active_epoch() {
+        uint64_t m = UINT64_MAX;
+        for (const auto& s : SLOTS) {
+            uint64_t e = s.epoch.load();
+            if (e != 0 && e < m) m = e;
+        }
+        return m;
+    }
+}
+
+namespace rcu {
+
+ReadGuard::ReadGuard() {
+    if (TLS_SLOT.depth++ == 0) TLS_SLOT.get()->epoch.store(GLOBAL_EPOCH.load());
+}
+
+ReadGuard::~ReadGuard() {
+    if (--TLS_SLOT.depth == 0) TLS_SLOT.slot->epoch.store(0, memory_order_release);
+}
+
+void retire(function<void()> reclaim) {
+    {
+        lock_guard<mutex> lock(RETIRE_MTX);
+        RETIRED.push_back(Retired{ GLOBAL_EPOCH.fetch_add(1), std::move(reclaim) });
+    }
+    collect();
+}
+
+void collect() {
+    vector<function<void()>> ready;
+    {
+        lock_guard<mutex> lock(RETIRE_MTX);
+        uint64_t safe = min_active_epoch();
+        size_t keep = 0;
+        for (auto& r : RETIRED) {
+            if (r.epoch < safe) ready.push_back(std::move(r.reclaim));
+            else RETIRED[keep++] = std::move(r);
+        }
+        RETIRED.resize(keep);
+    }
+    for (auto& fn : ready) fn();
+}
+
+size_t pending() {
+    lock_guard<mutex> lock(RETIRE_MTX);
+    return RETIRED.size();
+}
+
+} // namespace rcu
@@ -0,0 +1,49 @@
+#pragma once
+// Epoch-based reclamation for read-mostly shared state.
+//
+// Readers enter a ReadGuard and may then dereference any RcuPtr without
+// locking. Writers publish a replacement with RcuPtr::publish; the previous
+// object is retired and deleted once every reader that could still see it
+// has left its guard.
+#include <atomic>
+#include <functional>
+
+namespace rcu {
+
+// Marks the calling thread as reading; guards nest.
+class ReadGuard {
+public:
+    ReadGuard();
+    ~ReadGuard();
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+};
+
+// Schedules `reclaim` to run once all current readers are gone.
+void retire(std::function<void()> reclaim);
+// Runs whatever retired callbacks are already safe; called by retire() too.
+void collect();
+// Retired callbacks still waiting for readers.
+size_t pending();
+
+} // namespace rcu
+
+template <class T>
+class RcuPtr {
+public:
+    RcuPtr() = default;
+    RcuPtr(const RcuPtr&) = delete;
+    RcuPtr& operator=(const RcuPtr&) = delete;
+
+    // Caller must hold a rcu::ReadGuard for as long as it uses the result.
+    const T* load() const { return p_.load(std::memory_order_seq_cst); }
+
+    // Installs `next` (taking ownership) and retires the previous object.
+    void publish(const T* next) {
+        const T* old = p_.exchange(next, std::memory_order_seq_cst);
+        if (old) rcu::retire([old]{ delete old; });
+    }
+
+private:
+    std::atomic<const T*> p_{nullptr};
+};
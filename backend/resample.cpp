@@ -0,0 +1,139 @@
+#include "resample.h"
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <numeric>
+#include <utility>
+
+using namespace std;
+
+namespace {
+    // Sinc zero crossings on each side of the filter centre, and the Kaiser
+    // window shape: about 80 dB of stopband at a modest tap count.
+    static const int    ZERO_CROSSINGS = 12;
+    static const double KAISER_BETA    = 8.0;
+    // Passband edge as a fraction of the lower Nyquist frequency.
+    static const double CUTOFF         = 0.9;
+
+    double bessel_i0(double x) {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 50; ++k) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+            if (term < sum * 1e-12) break;
+        }
+        return sum;
+    }
+}
+
+// Taps stored phase-major: coeffs[p * taps + j] multiplies input i - j for
+// an output at upsampled position i * L + p.
+struct Resampler::Filter {
+    vector<double> coeffs;
+};
+
+namespace {
+    // Input rates whose filters are cached for the life of the process.
+    const int COMMON_RATES[] = { 8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000, 88200, 96000, 176400, 192000 };
+
+    std::mutex FILTERS_MTX;
+    map<pair<int,int>, shared_ptr<const Resampler::Filter>> FILTERS;
+
+    // The ratio L/M closest to outRate/inRate with L <= MAX_PHASES; the
+    // exact reduced ratio when it fits.
+    pair<int,int> phase_ratio(int inRate, int outRate) {
+        const int g = gcd(inRate, outRate);
+        if (outRate / g <= Resampler::MAX_PHASES) return { outRate / g, inRate / g };
+        const double want = static_cast<double>(inRate) / outRate;   // M per L
+        int bestL = 1, bestM = max(1, static_cast<int>(lround(want)));
+        double bestErr = fabs(static_cast<double>(bestM) / bestL - want);
+        for (int L = 2; L <= Resampler::MAX_PHASES; ++L) {
+            int M = max(1, static_cast<int>(lround(want * L)));
+            double err = fabs(static_cast<double>(M) / L - want);
+            if (err < bestErr) { bestErr = err; bestL = L; bestM = M; }
+        }
+        const int r = gcd(bestL, bestM);
+        return { bestL / r, bestM / r };
+    }
+
+    shared_ptr<const Resampler::Filter> build_filter(int L, int M, int taps) {
+        // Prototype low-pass at the upsampled rate, cut off below the lower
+        // of the two Nyquist frequencies, with gain L to undo zero stuffing.
+        const int N = L * taps;
+        const double fc = CUTOFF * 0.5 / max(L, M);   // cycles per upsampled sample
+        const double centre = (N - 1) / 2.0;
+        const double i0beta = bessel_i0(KAISER_BETA);
+        auto filter = make_shared<Resampler::Filter>();
+        filter->coeffs.assign(static_cast<size_t>(N), 0.0);
+        for (int n = 0; n < N; ++n) {
+            double x = n - centre;
+            double sinc = x == 0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+            double r = x / (centre + 1.0);
+            double w = bessel_i0(KAISER_BETA * sqrt(max(0.0, 1.0 - r * r))) / i0beta;
+            int p = n % L, j = n / L;
+            filter->coeffs[static_cast<size_t>(p) * taps + j] = L * sinc * w;
+        }
+        return filter;
+    }
+
+    // Built outside the lock, so a new ratio does not hold up other streams;
+    // two threads racing on one ratio keep the first filter stored.
+    shared_ptr<const Resampler::Filter> make_filter(int inRate, int L, int M, int taps) {
+        if (find(begin(COMMON_RATES), end(COMMON_RATES), inRate) == end(COMMON_RATES))
+            return build_filter(L, M, taps);
+        {
+            std::lock_guard<std::mutex> lock(FILTERS_MTX);
+            auto it = FILTERS.find({L, M});
+            if (it != FILTERS.end()) return it->second;
+        }
+        auto filter = build_filter(L, M, taps);
+        std::lock_guard<std::mutex> lock(FILTERS_MTX);
+        return FILTERS.emplace(make_pair(L, M), std::move(filter)).first->second;
+    }
+}
+
+Resampler::Resampler(int inRate, int outRate) { reset(inRate, outRate); }
+
+void Resampler::reset(int inRate, int outRate) {
+    histStart_ = 0;
+    nextOut_ = 0;
+    hist_.clear();
+    int L = 1, M = 1;
+    if (inRate > 0 && outRate > 0 && inRate != outRate) tie(L, M) = phase_ratio(inRate, outRate);
+    if (L == M) { L_ = M_ = 1; return; }
+    if (L != L_ || M != M_ || !filter_) {
+        L_ = L; M_ = M;
+        // Enough taps for ZERO_CROSSINGS lobes of the sinc on each side.
+        taps_ = (2 * ZERO_CROSSINGS * max(L_, M_) + L_ - 1) / L_;
+        filter_ = make_filter(inRate, L_, M_, taps_);
+    }
+    hist_.assign(static_cast<size_t>(taps_ - 1), 0.0f);
+}
+
+void Resampler::push(const float* in, size_t n, vector<float>& out) {
+    if (passthrough()) { out.insert(out.end(), in, in + n); return; }
+    hist_.insert(hist_.end(), in, in + n);
+    // hist_[k] holds input sample histStart_ + k - (taps_ - 1).
+    const uint64_t lead = static_cast<uint64_t>(taps_ - 1);
+    const uint64_t available = histStart_ + hist_.size() - lead;   // inputs seen so far
+    const double* h = filter_->coeffs.data();
+    while (true) {
+        uint64_t up = nextOut_ * static_cast<uint64_t>(M_);
+        uint64_t i = up / L_;
+        if (i >= available) break;
+        const double* taps = h + static_cast<size_t>(up % L_) * taps_;
+        const float* x = hist_.data() + (i - histStart_ + lead);    // input i
+        double acc = 0.0;
+        for (int j = 0; j < taps_; ++j) acc += taps[j] * x[-j];
+        out.push_back(static_cast<float>(acc));
+        ++nextOut_;
+    }
+    // Keep the inputs the next output still needs.
+    uint64_t nextIn = nextOut_ * static_cast<uint64_t>(M_) / L_;
+    uint64_t drop = min<uint64_t>(nextIn - histStart_, hist_.size() - lead);
+    hist_.erase(hist_.begin(), hist_.begin() + static_cast<ptrdiff_t>(drop));
+    histStart_ += drop;
+}
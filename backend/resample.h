@@ -0,0 +1,45 @@
+#pragma once
+// Streaming polyphase resampler (windowed-sinc, anti-aliased).
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Input rates audio is accepted at (decoded files and streaming sessions).
+// Anything else is refused before a Resampler is built for it.
+static const int MIN_INPUT_RATE = 8000;
+static const int MAX_INPUT_RATE = 192000;
+inline bool supported_input_rate(int rate) { return rate >= MIN_INPUT_RATE && rate <= MAX_INPUT_RATE; }
+
+// Converts `inRate` to `outRate` by the reduced ratio L/M: conceptually
+// upsample by L, low-pass below the lower Nyquist, keep every M-th sample;
+// only the taps that hit real input samples are evaluated. Input may arrive
+// in chunks of any size. L is at most MAX_PHASES: a ratio that needs more is
+// approximated by the nearest one that does not (off by under 0.1% in pitch
+// and tempo, worst for rates just off the output rate), which bounds a
+// filter to ~24 * max(L, M) taps: 2.4 MB at most. Filters of the common
+// audio rates are built once and shared; others belong to their resampler. Equal rates pass samples through untouched. Samples are float;
+// each output is accumulated in double.
+class Resampler {
+public:
+    Resampler(int inRate, int outRate);
+    // Starts a new stream, keeping the filter (if the ratio is unchanged) and
+    // the history buffer's capacity.
+    void reset(int inRate, int outRate);
+
+    bool passthrough() const { return L_ == M_; }
+    // Appends the output produced by `n` more input samples to `out`.
+    void push(const float* in, size_t n, std::vector<float>& out);
+
+    struct Filter;
+    static const int MAX_PHASES = 512;
+
+private:
+    int L_ = 1, M_ = 1;
+    int taps_ = 0;                            // taps per phase
+    std::shared_ptr<const Filter> filter_;
+    // Inputs still needed: the taps_-1 before histStart_, then from histStart_ on.
+    std::vector<float> hist_;
+    uint64_t histStart_ = 0;                  // input index of hist_[taps_-1]
+    uint64_t nextOut_ = 0;                    // index of the next output sample
+};
@@ -0,0 +1,95 @@
+#include "scoring.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+    // Below this many keys a comparison sort beats the radix histograms.
+    static const size_t RADIX_MIN_KEYS = 512;
+}
+
+uint8_t idf_weight(size_t df, size_t numSongs) {
+    if (numSongs <= 1 || df <= 1) return UNIT_WEIGHT;
+    if (df >= numSongs) return 1;
+    double idf = log(static_cast<double>(numSongs) / df) / log(static_cast<double>(numSongs));
+    return static_cast<uint8_t>(1 + lrint(idf * (UNIT_WEIGHT - 1)));
+}
+
+// Rebases every key's delta by -minDelta_ (`sign` -1), or back (+1). The
+// weight byte is untouched: the shift is a multiple of 256.
+static void rebase(vector<uint64_t>& keys, int32_t minDelta, int sign) {
+    const uint32_t shift = static_cast<uint32_t>(minDelta) << 8;
+    for (auto& k : keys) {
+        uint32_t low = static_cast<uint32_t>(k);
+        low = sign < 0 ? low - shift : low + shift;
+        k = (k & 0xFFFFFFFF00000000ull) | low;
+    }
+}
+
+// LSD radix sort on bytes. Deltas are rebased to start at 0 first, so their
+// high bytes are usually constant and those passes are skipped, as are the
+// unused high bytes of the song id. The weight byte is never sorted on: runs
+// only need (song, delta) grouped.
+void VoteScorer::sort_keys() {
+    const size_t n = keys_.size();
+    rebase(keys_, minDelta_, -1);
+    if (n < RADIX_MIN_KEYS) { sort(keys_.begin(), keys_.end()); return; }
+
+    static thread_local size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (uint64_t k : keys_)
+        for (int d = 1; d < 8; ++d) ++counts[d][(k >> (8 * d)) & 0xFF];
+
+    tmp_.resize(n);
+    uint64_t* src = keys_.data();
+    uint64_t* dst = tmp_.data();
+    for (int d = 1; d < 8; ++d) {
+        size_t* c = counts[d];
+        if (c[(src[0] >> (8 * d)) & 0xFF] == n) continue; // every key has this byte
+        size_t sum = 0;
+        for (int b = 0; b < 256; ++b) { size_t x = c[b]; c[b] = sum; sum += x; }
+        for (size_t i = 0; i < n; ++i) dst[c[(src[i] >> (8 * d)) & 0xFF]++] = src[i];
+        swap(src, dst);
+    }
+    if (src != keys_.data()) keys_.swap(tmp_);
+}
+
+void VoteScorer::rank(size_t n, vector<SongScore>& out) {
+    out.clear();
+    if (keys_.empty() || n == 0) return;
+    sort_keys();
+
+    // One pass over the sorted keys: each (song, delta) run is a weighted
+    // vote count, and a song's best run is offered to the top-n list when the
+    // song ends. Counts stay in weight units until the end.
+    auto offer = [&](const SongScore& s) {
+        if (out.size() == n && s.count <= out.back().count) return;
+        if (out.size() < n) out.push_back(s);
+        else out.back() = s;
+        // Strict > keeps earlier (lower) song ids ahead on ties.
+        for (size_t i = out.size() - 1; i > 0 && out[i].count > out[i-1].count; --i)
+            swap(out[i], out[i-1]);
+    };
+    SongScore best{ -1, 0, 0 };
+    size_t i = 0;
+    while (i < keys_.size()) {
+        uint64_t run = keys_[i] >> 8;
+        int weight = 0;
+        size_t j = i;
+        for (; j < keys_.size() && (keys_[j] >> 8) == run; ++j) weight += static_cast<int>(keys_[j] & 0xFF);
+        int song = static_cast<int>(run >> 24);
+        if (song != best.songId) {
+            if (best.songId >= 0) offer(best);
+            best = SongScore{ song, 0, 0 };
+        }
+        if (weight > best.count)
+            best = SongScore{ song, weight, static_cast<int32_t>((run & 0xFFFFFF) + static_cast<uint32_t>(minDelta_)) };
+        i = j;
+    }
+    offer(best);
+    for (auto& s : out) s.count = (s.count + UNIT_WEIGHT / 2) / UNIT_WEIGHT;
+    // Undo the rebase so later votes share the keys' delta origin.
+    rebase(keys_, minDelta_, +1);
+}
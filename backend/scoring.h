@@ -0,0 +1,50 @@
+#pragma once
+// Offset-histogram voting: a matching song lines its postings up with the
+// query at one constant offset, so each song is scored by its most voted
+// (song offset - query offset).
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SongScore {
+    int songId;
+    int count;    // votes at the best offset (weighted, in whole votes)
+    int delta;    // best song offset - query offset, in frames
+};
+
+// A full vote; idf_weight() scales votes for common hashes down from it.
+static const uint8_t UNIT_WEIGHT = 16;
+
+// Vote weight of a hash found in `df` of `numSongs` songs: UNIT_WEIGHT for
+// a hash unique to one song, falling with log(df) to 1 for one in every song.
+uint8_t idf_weight(size_t df, size_t numSongs);
+
+// Votes go into a flat buffer of packed (songId, delta, weight) keys;
+// ranking radix-sorts it and reads each (song, delta) run once, so a query
+// costs O(hits) no matter how the hits spread over songs. A run scores the
+// sum of its weights. Deltas must span less than 2^24 frames (~54 hours).
+// Reuse one scorer per thread to keep its buffers.
+class VoteScorer {
+public:
+    void clear() { keys_.clear(); minDelta_ = INT32_MAX; }
+    void add(int32_t songId, int32_t songOffset, int32_t queryOffset, uint8_t weight = UNIT_WEIGHT) {
+        int32_t delta = songOffset - queryOffset;
+        if (delta < minDelta_) minDelta_ = delta;
+        keys_.push_back((static_cast<uint64_t>(static_cast<uint32_t>(songId)) << 32)
+                        | (static_cast<uint32_t>(delta) << 8) | weight);
+    }
+    size_t votes() const { return keys_.size(); }
+
+    // The `n` best songs, highest count first; ties go to the lower songId,
+    // and within a song to the smaller delta. The votes are kept (reordered),
+    // so a streaming query can add more and rank again; clear() before
+    // scoring the next query.
+    void rank(size_t n, std::vector<SongScore>& out);
+
+private:
+    void sort_keys();
+
+    std::vector<uint64_t> keys_;
+    std::vector<uint64_t> tmp_;
+    int32_t minDelta_ = INT32_MAX;
+};
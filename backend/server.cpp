@@ -1,18 +1,33 @@
 // server.cpp
-// Music recognition backend - single-threaded HTTP server with per-connection timeouts & upload limits.
+// Music recognition backend - epoll-driven HTTP/1.1 server. One event-loop thread
+// owns every socket (non-blocking, keep-alive) and hands complete requests to
+// fixed-size worker pools: CPU-heavy uploads and latency-sensitive recognitions
+// get separate bounded queues, and a full queue answers 503 with Retry-After.
 // Depends on engine.h providing: engine_init(const char* data_dir),
-// get_song_list(), add_song_to_db(path, name), identify_from_file(path)
+// get_song_list(), catalog_version(), add_song_from_buffer(data, size, name), identify_from_buffer(data, size),
+// delete_song(id), replace_song_from_buffer(id, data, size, name, url)
+// With MUSICREC_SHARDS set it is instead a front end for shard servers (shards.h).
 
 #include "engine.h"
+#include "fingerprint.h"
+#include "metrics.h"
+#include "resample.h"
+#include "shards.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <strings.h>
+#include <charconv>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <sstream>
 #include <filesystem>
@@ -22,48 +37,137 @@
 #include <memory>
 #include <cerrno>
 #include <csignal>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-static const int PORT = 5001;
-static const int BACKLOG = 16;
+static const int BACKLOG = 128;
 static const size_t MAX_HEADER = 64 * 1024;
 static const size_t MAX_BODY = 200 * 1024 * 1024; // 200 MB upload cap
-static const int RECV_TIMEOUT_SEC = 200;           // per-connection timeout in seconds
+static const int RECV_TIMEOUT_SEC = 200;           // max time to receive (or send) one request
+static const int KEEPALIVE_IDLE_SEC = 15;          // idle keep-alive connections are closed after this
+static const int RETRY_AFTER_SEC = 2;              // hint sent with 503 when a queue is full
+
+// Tunables, overridable through the environment (see README).
+struct ServerConfig {
+    int port;
+    string dataDir;
+    bool frontEnd;          // MUSICREC_SHARDS is set
+    int recognizeWorkers;
+    int uploadWorkers;
+    size_t recognizeQueue;
+    size_t uploadQueue;
+    size_t maxConnections;
+};
+
+static int env_int(const char* name, int def) {
+    const char* v = getenv(name);
+    if (!v || !*v) return def;
+    int n = atoi(v);
+    return n > 0 ? n : def;
+}
 
-// Helper to send HTTP responses (includes CORS headers)
-static void send_response(int client, const string& status, const string& body, const string& contentType="application/json") {
-    std::ostringstream oss;
-    oss << "HTTP/1.1 " << status << "\r\n"
-        << "Content-Type: " << contentType << "\r\n"
-        << "Content-Length: " << body.size() << "\r\n"
-        << "Access-Control-Allow-Origin: *\r\n"
-        << "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-        << "Access-Control-Allow-Headers: *\r\n"
-        << "\r\n"
-        << body;
-    auto s = oss.str();
-    // best-effort send (ignore return)
-    send(client, s.data(), s.size(), 0);
-}
-
-static void send_204(int client) {
-    std::string headers = "HTTP/1.1 204 No Content\r\n"
-                          "Access-Control-Allow-Origin: *\r\n"
-                          "Access-Control-Allow-Methods: GET, POST, OPTIONS\r\n"
-                          "Access-Control-Allow-Headers: *\r\n"
-                          "Content-Length: 0\r\n\r\n";
-    send(client, headers.data(), headers.size(), 0);
+static ServerConfig load_config() {
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+    if (cores <= 0) cores = 2;
+    ServerConfig c;
+    c.port             = env_int("MUSICREC_PORT", 5001);
+    const char* dir    = getenv("MUSICREC_DATA_DIR");
+    c.dataDir          = dir && *dir ? dir : "./data";
+    c.frontEnd         = false;
+    c.recognizeWorkers = env_int("MUSICREC_RECOGNIZE_WORKERS", cores);
+    c.uploadWorkers    = env_int("MUSICREC_UPLOAD_WORKERS", std::max(1, cores / 4));
+    c.recognizeQueue   = static_cast<size_t>(env_int("MUSICREC_RECOGNIZE_QUEUE", 64));
+    c.uploadQueue      = static_cast<size_t>(env_int("MUSICREC_UPLOAD_QUEUE", 8));
+    c.maxConnections   = static_cast<size_t>(env_int("MUSICREC_MAX_CONNECTIONS", 1024));
+    return c;
+}
+
+// A request parsed in place: the fields view `raw`, the request's bytes as
+// received (taken over from the connection buffer, not copied). `raw` is
+// held by pointer so the views survive moving the request to a worker.
+struct Request {
+    std::unique_ptr<const string> raw;
+    string_view method;
+    string_view target;
+    string_view body;
+};
+
+struct Response {
+    string status;
+    string body;
+    string contentType = "application/json";
+    string extraHeaders; // complete "Name: value\r\n" lines
+    // A pre-serialized body shared between responses (the song list): bytes
+    // [sharedPos, sharedPos + sharedLen) of `shared` follow `body`, then `tail`.
+    shared_ptr<const string> shared;
+    size_t sharedPos = 0;
+    size_t sharedLen = 0;
+    string tail;
+
+    size_t content_length() const { return body.size() + sharedLen + tail.size(); }
+};
+
+// The status line and headers of a response (includes CORS headers).
+static string format_head(const Response& r, bool keepAlive) {
+    string h;
+    h.reserve(256 + r.extraHeaders.size());
+    h += "HTTP/1.1 "; h += r.status; h += "\r\n";
+    if (r.content_length() || r.status.compare(0, 3, "204") != 0) {
+        h += "Content-Type: "; h += r.contentType; h += "\r\n";
+    }
+    h += "Content-Length: "; h += to_string(r.content_length()); h += "\r\n";
+    h += "Access-Control-Allow-Origin: *\r\n"
+         "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS\r\n"
+         "Access-Control-Allow-Headers: *\r\n";
+    h += keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    h += r.extraHeaders;
+    h += "\r\n";
+    return h;
+}
+
+// Fills `iov` with what is left to send of `head` and then `r`'s body parts
+// after the first `skip` bytes; returns the number of entries used.
+static int response_iov(const string& head, const Response& r, size_t skip, iovec iov[4]) {
+    const string_view parts[4] = {
+        head, r.body,
+        r.shared ? string_view(*r.shared).substr(r.sharedPos, r.sharedLen) : string_view(),
+        r.tail,
+    };
+    int n = 0;
+    for (const auto& p : parts) {
+        if (skip >= p.size()) { skip -= p.size(); continue; }
+        iov[n].iov_base = const_cast<char*>(p.data() + skip);
+        iov[n].iov_len = p.size() - skip;
+        skip = 0;
+        ++n;
+    }
+    return n;
+}
+
+static Response json_response(const string& status, const string& body) {
+    Response r; r.status = status; r.body = body;
+    return r;
+}
+
+static Response busy_response() {
+    Response r = json_response("503 Service Unavailable", R"({"error":"busy"})");
+    r.extraHeaders = "Retry-After: " + to_string(RETRY_AFTER_SEC) + "\r\n";
+    return r;
 }
 
 // URL-decode utility
-static string url_decode(const string& s) {
+static string url_decode(string_view s) {
     string out; out.reserve(s.size());
     for (size_t i=0;i<s.size();++i) {
-        if (s[i]=='%' && i+2<s.size()) {
-            int v = 0;
-            std::istringstream iss(s.substr(i+1,2));
-            iss >> std::hex >> v;
+        unsigned v = 0;
+        if (s[i]=='%' && i+2<s.size() && std::from_chars(s.data()+i+1, s.data()+i+3, v, 16).ptr == s.data()+i+3) {
             out.push_back(static_cast<char>(v));
             i += 2;
         } else if (s[i]=='+') out.push_back(' ');
@@ -72,17 +176,19 @@ static string url_decode(const string& s) {
     return out;
 }
 
-static string get_query_param(const string& target, const string& key) {
+static string get_query_param(string_view target, string_view key) {
     auto pos = target.find('?');
-    if (pos==string::npos) return "";
-    string qs = target.substr(pos+1);
-    string k = key + "=";
-    size_t p = qs.find(k);
-    if (p==string::npos) return "";
-    size_t s = p + k.size();
-    size_t e = qs.find('&', s);
-    string val = (e==string::npos) ? qs.substr(s) : qs.substr(s, e-s);
-    return url_decode(val);
+    if (pos==string_view::npos) return "";
+    string_view qs = target.substr(pos+1);
+    for (size_t p = 0; p < qs.size(); ) {
+        size_t e = qs.find('&', p);
+        if (e==string_view::npos) e = qs.size();
+        string_view kv = qs.substr(p, e-p);
+        if (kv.size() > key.size() && kv[key.size()]=='=' && kv.compare(0, key.size(), key)==0)
+            return url_decode(kv.substr(key.size()+1));
+        p = e + 1;
+    }
+    return "";
 }
 
 static string now_ts() {
@@ -92,98 +198,797 @@ static string now_ts() {
     return string(buf);
 }
 
-// read HTTP request: headers and body (honors Content-Length and enforces MAX_BODY & timeouts)
-static bool read_request(int client, string& method, string& target, string& headers, string& body) {
-    string data; data.reserve(MAX_HEADER);
-    char buf[4096];
-    size_t total=0;
+// Timestamp plus a process-wide sequence number, so concurrent requests never
+// share a file name.
+static string unique_ts() {
+    static std::atomic<unsigned> seq{0};
+    return now_ts() + "_" + to_string(seq.fetch_add(1));
+}
+
+static string DATA_DIR = "./data";
+
+// ---- Handlers (run on the event loop or on a worker thread) ----
+
+// The song list serialized once per catalog version: the song objects,
+// comma-separated, with where each one starts (and size + 1 at the end), so
+// any page is a slice. Only the event loop thread uses it.
+struct SongListJson {
+    uint64_t version = UINT64_MAX;
+    shared_ptr<const string> json;
+    vector<size_t> starts;
+};
+
+static const SongListJson& song_list_json() {
+    static SongListJson cache;
+    uint64_t version = catalog_version(); // before the list, so a race only rebuilds again
+    if (cache.json && cache.version == version) return cache;
+    auto songs = get_song_list();
+    auto json = make_shared<string>();
+    cache.starts.clear();
+    std::ostringstream oss;
+    for (size_t i=0;i<songs.size();++i) {
+        if (i) oss << ",";
+        cache.starts.push_back(static_cast<size_t>(oss.tellp()));
+        oss << R"({"id":)" << songs[i].id
+            << R"(,"name":")" << songs[i].name
+            << R"(","fingerprints":)" << songs[i].numFingerprints
+            << R"(,"url":")" << songs[i].youtube_url << R"("})";
+    }
+    *json = oss.str();
+    cache.starts.push_back(json->size() + 1);
+    cache.json = std::move(json);
+    cache.version = version;
+    return cache;
+}
+
+// The offset and limit of GET /songs?offset=N&limit=M; limit SIZE_MAX if absent.
+static void song_page(string_view target, size_t& offset, size_t& limit) {
+    string o = get_query_param(target, "offset"), l = get_query_param(target, "limit");
+    offset = static_cast<size_t>(max(0LL, atoll(o.c_str())));
+    limit = l.empty() ? SIZE_MAX : static_cast<size_t>(max(0LL, atoll(l.c_str())));
+}
+
+// GET /songs?offset=N&limit=M (both optional) answers songs [N, N + M).
+static Response handle_songs(const Request& req) {
+    const SongListJson& list = song_list_json();
+    const size_t total = list.starts.size() - 1;
+    size_t offset, limit;
+    song_page(req.target, offset, limit);
+    offset = min(total, offset);
+    size_t end = offset + min(limit, total - offset);
+
+    Response r = json_response("200 OK", R"({"songs":[)");
+    if (end > offset) {
+        r.shared = list.json;
+        r.sharedPos = list.starts[offset];
+        r.sharedLen = list.starts[end] - 1 - list.starts[offset];
+    }
+    r.tail = R"(],"total":)" + to_string(total) + "}";
+    return r;
+}
+
+// Upload - add song (expects audio bytes in body; decoded in memory)
+static Response handle_upload(const Request& req) {
+    string name = get_query_param(req.target, "name");
+    if (name.empty()) return json_response("400 Bad Request", R"({"error":"A song label is required."})");
+    try {
+        int id = add_song_from_buffer(req.body.data(), req.body.size(), name);
+        if (id < 0) return json_response("400 Bad Request", R"({"error":"Fingerprinting failed. Check WAV format."})");
+        std::ostringstream oss;
+        oss << R"({"id":)" << id << R"(,"name":")" << name << R"("})";
+        return json_response("200 OK", oss.str());
+    } catch (const std::exception &ex) {
+        std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
+        return json_response("500 Internal Server Error", err.str());
+    }
+}
+
+// The <id> in /songs/<id>, or -1.
+static int song_id_of(string_view target) {
+    static const string_view prefix = "/songs/";
+    if (target.compare(0, prefix.size(), prefix) != 0) return -1;
+    string_view digits = target.substr(prefix.size(), target.find('?') - prefix.size());
+    int id = -1;
+    auto res = std::from_chars(digits.data(), digits.data() + digits.size(), id);
+    return (!digits.empty() && res.ec == std::errc() && res.ptr == digits.data() + digits.size()) ? id : -1;
+}
+
+// DELETE /songs/<id> removes a song from the catalog.
+static Response handle_delete(const Request& req) {
+    int id = song_id_of(req.target);
+    if (id < 0 || !delete_song(id)) return json_response("404 Not Found", R"({"error":"no_song"})");
+    return json_response("200 OK", R"({"deleted":)" + to_string(id) + "}");
+}
+
+// PUT /songs/<id>?name=&url= (both optional) swaps a song's audio for the
+// body's; the new version gets a new id.
+static Response handle_replace(const Request& req) {
+    int id = song_id_of(req.target);
+    if (id < 0) return json_response("404 Not Found", R"({"error":"no_song"})");
+    try {
+        int fresh = replace_song_from_buffer(id, req.body.data(), req.body.size(),
+                                             get_query_param(req.target, "name"), get_query_param(req.target, "url"));
+        if (fresh == -2) return json_response("404 Not Found", R"({"error":"no_song"})");
+        if (fresh < 0) return json_response("400 Bad Request", R"({"error":"Fingerprinting failed. Check WAV format."})");
+        return json_response("200 OK", R"({"id":)" + to_string(fresh) + R"(,"replaced":)" + to_string(id) + "}");
+    } catch (const std::exception &ex) {
+        std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
+        return json_response("500 Internal Server Error", err.str());
+    }
+}
+
+// Opt-in audit log: keeps every Nth query body under <data dir>/queries
+// (MUSICREC_QUERY_AUDIT_EVERY=N; off by default).
+static void audit_query(string_view body) {
+    static const int every = env_int("MUSICREC_QUERY_AUDIT_EVERY", 0);
+    static std::atomic<unsigned> seen{0};
+    if (every <= 0 || seen.fetch_add(1) % static_cast<unsigned>(every) != 0) return;
+    std::error_code ec;
+    std::filesystem::create_directories(DATA_DIR + "/queries", ec);
+    string qpath = DATA_DIR + "/queries/query_" + unique_ts() + ".wav";
+    FILE* f = fopen(qpath.c_str(), "wb");
+    if (!f) return;
+    fwrite(body.data(), 1, body.size(), f);
+    fclose(f);
+}
+
+static Response handle_recognize(const Request& req) {
+    try {
+        auto res = identify_from_buffer(req.body.data(), req.body.size());
+        audit_query(req.body);
+        return json_response("200 OK", res);
+    } catch (const std::exception &ex) {
+        std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
+        return json_response("500 Internal Server Error", err.str());
+    }
+}
 
-    // Read headers (until \r\n\r\n)
+// Batch: the body is a sequence of clips, each a little-endian uint32 byte
+// length followed by that many bytes of audio file; the reply's "results"
+// hold one recognize reply per clip, in order.
+static Response handle_recognize_batch(const Request& req) {
+    vector<pair<const void*, size_t>> clips;
+    for (size_t pos = 0; pos < req.body.size(); ) {
+        uint32_t len = 0;
+        if (req.body.size() - pos < sizeof(len))
+            return json_response("400 Bad Request", R"({"error":"truncated clip length"})");
+        memcpy(&len, req.body.data() + pos, sizeof(len));
+        pos += sizeof(len);
+        if (req.body.size() - pos < len)
+            return json_response("400 Bad Request", R"({"error":"truncated clip"})");
+        clips.emplace_back(req.body.data() + pos, len);
+        pos += len;
+    }
+    if (clips.empty()) return json_response("400 Bad Request", R"({"error":"no clips"})");
+    try {
+        vector<string> results = identify_batch(clips);
+        string body = R"({"results":[)";
+        for (size_t i = 0; i < results.size(); ++i) body += (i ? "," : "") + results[i];
+        return json_response("200 OK", body + "]}");
+    } catch (const std::exception &ex) {
+        std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
+        return json_response("500 Internal Server Error", err.str());
+    }
+}
+
+// Monitor: the body is a long recording (any length up to MAX_BODY); the
+// reply lists the catalog songs found in it as timed segments.
+static Response handle_monitor(const Request& req) {
+    try {
+        return json_response("200 OK", monitor_from_buffer(req.body.data(), req.body.size()));
+    } catch (const std::exception &ex) {
+        std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
+        return json_response("500 Internal Server Error", err.str());
+    }
+}
+
+// ---- Sharding ----
+//
+// A shard answers POST /search?top=N with its best songs for a hash list, and
+// POST /search/df with how many of its songs hold each hash; a front end
+// scatters /recognize, /songs and /upload over its shards, and sends edits of
+// /songs/<id> to the shard owning the id.
+
+static Response handle_search(const Request& req) {
+    string status;
+    size_t top = static_cast<size_t>(max(1, atoi(get_query_param(req.target, "top").c_str())));
+    string body = shard_search(req.body, top, get_query_param(req.target, "weighted") == "1", status);
+    Response r = json_response(status, body);
+    if (status.compare(0, 3, "200") == 0) r.contentType = "text/tab-separated-values";
+    return r;
+}
+
+static Response handle_search_df(const Request& req) {
+    string status;
+    string body = shard_hash_songs(req.body, status);
+    Response r = json_response(status, body);
+    if (status.compare(0, 3, "200") == 0) r.contentType = "text/plain";
+    return r;
+}
+
+static Response handle_sharded_recognize(const Request& req) {
+    string status;
+    string body = sharded_recognize(req.body.data(), req.body.size(), status);
+    audit_query(req.body);
+    return json_response(status, body);
+}
+
+static Response handle_sharded_songs(const Request& req) {
+    size_t offset, limit;
+    song_page(req.target, offset, limit);
+    string status;
+    string body = sharded_songs(offset, limit, status);
+    return json_response(status, body);
+}
+
+static Response handle_sharded_upload(const Request& req) {
+    if (get_query_param(req.target, "name").empty())
+        return json_response("400 Bad Request", R"({"error":"A song label is required."})");
+    string status;
+    string body = sharded_upload(req.target, req.body, status);
+    return json_response(status, body);
+}
+
+static Response handle_sharded_edit(const Request& req) {
+    string status;
+    string body = sharded_edit(req.method, req.target, req.body, song_id_of(req.target), status);
+    return json_response(status, body);
+}
+
+// ---- Streaming recognition ----
+//
+// POST /session?rate=44100 opens a session; each POST /session/<id> carries
+// the next chunk of mono little-endian float32 samples and is answered with
+// the running verdict ("done":true once a match is certain); DELETE
+// /session/<id> ends it early with the best guess.
+
+static string session_id_str(uint64_t id) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(id));
+    return buf;
+}
+
+// The <id> in /session/<id>, or 0.
+static uint64_t session_id_of(string_view target) {
+    static const string_view prefix = "/session/";
+    if (target.compare(0, prefix.size(), prefix) != 0) return 0;
+    string hex(target.substr(prefix.size(), target.find('?') - prefix.size()));
+    char* end = nullptr;
+    unsigned long long id = strtoull(hex.c_str(), &end, 16);
+    return (!hex.empty() && *end == '\0') ? id : 0;
+}
+
+static Response handle_session_open(const Request& req) {
+    int rate = atoi(get_query_param(req.target, "rate").c_str());
+    if (!rate) return json_response("400 Bad Request", R"({"error":"rate_required"})");
+    if (!supported_input_rate(rate)) return json_response("400 Bad Request", R"({"error":"unsupported_rate"})");
+    uint64_t id = session_open(rate);
+    if (!id) return json_response("503 Service Unavailable", R"({"error":"too_many_sessions"})");
+    return json_response("200 OK", R"({"session":")" + session_id_str(id) + R"("})");
+}
+
+static Response handle_session_chunk(const Request& req) {
+    if (req.body.size() % sizeof(float) != 0)
+        return json_response("400 Bad Request", R"({"error":"expected float32 samples"})");
+    std::vector<float> samples(req.body.size() / sizeof(float));
+    memcpy(samples.data(), req.body.data(), req.body.size());
+    string res = session_feed(session_id_of(req.target), samples.data(), samples.size());
+    if (res.empty()) return json_response("404 Not Found", R"({"error":"no_session"})");
+    return json_response("200 OK", res);
+}
+
+static Response handle_session_close(const Request& req) {
+    string res = session_close(session_id_of(req.target));
+    if (res.empty()) return json_response("404 Not Found", R"({"error":"no_session"})");
+    return json_response("200 OK", res);
+}
+
+// ---- Metrics ----
+
+enum Endpoint { EP_PING, EP_SONGS, EP_UPLOAD, EP_REPLACE, EP_DELETE, EP_RECOGNIZE, EP_BATCH, EP_MONITOR, EP_SESSION, EP_SEARCH, EP_METRICS, EP_OTHER, NUM_ENDPOINTS };
+
+struct EndpointStats {
+    EndpointStats(const char* labels)
+        : requests("musicrec_requests_total", labels, "Requests answered, by endpoint."),
+          seconds("musicrec_request_seconds", labels, "Time from a complete request to its response, by endpoint.") {}
+    metrics::Counter requests;
+    metrics::Histogram seconds;
+};
+
+static EndpointStats ENDPOINT_STATS[NUM_ENDPOINTS] = {
+    R"(endpoint="ping")", R"(endpoint="songs")", R"(endpoint="upload")", R"(endpoint="replace")",
+    R"(endpoint="delete")", R"(endpoint="recognize")",
+    R"(endpoint="batch")", R"(endpoint="monitor")", R"(endpoint="session")", R"(endpoint="search")", R"(endpoint="metrics")", R"(endpoint="other")"
+};
+
+static std::atomic<size_t> OPEN_CONNECTIONS{0};
+
+// GET /ping: the fingerprint profile and rate queries must be made with, so
+// a front end can check its shards at startup.
+static string ping_json() {
+    const FingerprintProfile& p = active_profile();
+    return string(R"({"ok":true,"profile":")") + p.name + R"(","profile_id":)" + to_string(p.id)
+         + R"(,"rate":)" + to_string(p.sampleRate) + "}";
+}
+
+static Response handle_metrics(const Request&) {
+    Response r = json_response("200 OK", metrics::render());
+    r.contentType = "text/plain; version=0.0.4";
+    return r;
+}
+
+// ---- Worker pools ----
+
+using Handler = Response (*)(const Request&);
+
+struct Job {
+    uint64_t connId;
+    Request req;
+    Handler handler;
+    metrics::Clock::time_point queued;
+};
+
+struct Completion {
+    uint64_t connId;
+    Response resp;
+};
+
+// Bounded FIFO; try_push fails instead of growing past its capacity.
+// `labels` (e.g. `pool="upload"`) tag its wait, rejection and depth metrics.
+class JobQueue {
+public:
+    JobQueue(size_t cap, const char* labels)
+        : cap_(cap),
+          wait_("musicrec_queue_wait_seconds", labels, "Time a request waits for a worker."),
+          rejected_("musicrec_rejected_total", labels, "Requests answered 503 because the pool's queue was full.") {
+        metrics::gauge("musicrec_queue_depth", labels, "Requests waiting for a worker.", [this]{
+            std::lock_guard<std::mutex> lock(mtx_);
+            return static_cast<double>(q_.size());
+        });
+    }
+    bool try_push(Job&& job) {
+        job.queued = metrics::start();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (q_.size() >= cap_) { rejected_.inc(); return false; }
+            q_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+        return true;
+    }
+    Job pop() {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [this]{ return !q_.empty(); });
+        Job job = std::move(q_.front());
+        q_.pop_front();
+        wait_.observe_since(job.queued);
+        return job;
+    }
+private:
+    size_t cap_;
+    metrics::Histogram wait_;
+    metrics::Counter rejected_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<Job> q_;
+};
+
+// Workers hand finished responses back to the event loop through this list
+// and wake it with an eventfd.
+static std::mutex DONE_MTX;
+static vector<Completion> DONE;
+static int WAKE_FD = -1;
+
+static void worker_loop(JobQueue* queue) {
     while (true) {
-        ssize_t n = recv(client, buf, sizeof(buf), 0);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // timed out while reading headers
-                send_response(client, "408 Request Timeout", R"({"error":"timeout"})");
-                return false;
+        Job job = queue->pop();
+        Completion c{ job.connId, job.handler(job.req) };
+        {
+            std::lock_guard<std::mutex> lock(DONE_MTX);
+            DONE.push_back(std::move(c));
+        }
+        uint64_t one = 1;
+        ssize_t w = write(WAKE_FD, &one, sizeof(one));
+        (void)w;
+    }
+}
+
+// ---- Event loop ----
+
+static const uint64_t LISTEN_ID = 0;
+static const uint64_t WAKE_ID = 1;
+
+struct Conn {
+    int fd = -1;
+    string in;                 // received bytes; may hold pipelined requests
+    size_t headerLen = 0;      // > 0 once the current request's headers are parsed
+    size_t bodyLen = 0;
+    size_t methodLen = 0;      // request line fields, as offsets into `in`
+    size_t targetPos = 0, targetLen = 0;
+    bool keepAlive = true;
+    bool transferEncoded = false; // has a Transfer-Encoding (e.g. chunked): unsupported
+    bool busy = false;         // a worker owns the current request
+    string head;               // response being written: its head, then resp's body parts
+    Response resp;
+    size_t outPos = 0;         // bytes of it sent
+    size_t outLen = 0;         // its length; 0 when nothing is being written
+    bool closeAfterWrite = false;
+    uint32_t events = EPOLLIN; // current epoll interest
+    time_t requestStart = 0;
+    time_t lastActive = 0;
+    int endpoint = -1;         // of the request being answered, for metrics
+    metrics::Clock::time_point dispatched;
+};
+
+class EventLoop {
+public:
+    EventLoop(int listenFd, const ServerConfig& cfg)
+        : listenFd_(listenFd), cfg_(cfg),
+          recognizeQ_(cfg.recognizeQueue, R"(pool="recognize")"),
+          uploadQ_(cfg.uploadQueue, R"(pool="upload")") {
+        metrics::gauge("musicrec_connections", "", "Open client connections.",
+                       []{ return static_cast<double>(OPEN_CONNECTIONS.load()); });
+    }
+
+    int run() {
+        ep_ = epoll_create1(EPOLL_CLOEXEC);
+        WAKE_FD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ep_ < 0 || WAKE_FD < 0) { perror("epoll/eventfd"); return 1; }
+        add_fd(listenFd_, LISTEN_ID, EPOLLIN);
+        add_fd(WAKE_FD, WAKE_ID, EPOLLIN);
+
+        for (int i = 0; i < cfg_.recognizeWorkers; ++i) std::thread(worker_loop, &recognizeQ_).detach();
+        for (int i = 0; i < cfg_.uploadWorkers; ++i) std::thread(worker_loop, &uploadQ_).detach();
+
+        epoll_event events[256];
+        time_t lastSweep = time(nullptr);
+        while (true) {
+            int n = epoll_wait(ep_, events, 256, 1000);
+            if (n < 0 && errno != EINTR) { perror("epoll_wait"); return 1; }
+            for (int i = 0; i < n; ++i) {
+                uint64_t id = events[i].data.u64;
+                if (id == LISTEN_ID) { accept_all(); continue; }
+                if (id == WAKE_ID) { drain_completions(); continue; }
+                auto it = conns_.find(id);
+                if (it == conns_.end()) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    if (!on_readable(id, it->second)) continue;
+                }
+                if (events[i].events & EPOLLOUT) flush(id, it->second);
             }
-            return false;
+            time_t now = time(nullptr);
+            if (now != lastSweep) { sweep(now); lastSweep = now; }
         }
-        if (n == 0) return false;
-        data.append(buf, buf+n);
-        total += static_cast<size_t>(n);
-        auto pos = data.find("\r\n\r\n");
-        if (pos != string::npos) {
-            headers = data.substr(0, pos+4);
-            body = data.substr(pos+4);
-            break;
+    }
+
+private:
+    void add_fd(int fd, uint64_t id, uint32_t ev) {
+        epoll_event e{}; e.events = ev; e.data.u64 = id;
+        epoll_ctl(ep_, EPOLL_CTL_ADD, fd, &e);
+    }
+
+    // Reads only while the connection is idle or mid-request; a connection
+    // whose request sits with a worker or whose response is being written is
+    // left alone, which also bounds how much a pipelining client can buffer.
+    void update_interest(uint64_t id, Conn& c) {
+        uint32_t want = c.outPos < c.outLen ? uint32_t(EPOLLOUT) : (c.busy ? 0u : uint32_t(EPOLLIN));
+        if (c.events == want) return;
+        epoll_event e{}; e.events = want; e.data.u64 = id;
+        epoll_ctl(ep_, EPOLL_CTL_MOD, c.fd, &e);
+        c.events = want;
+    }
+
+    void close_conn(uint64_t id) {
+        auto it = conns_.find(id);
+        if (it == conns_.end()) return;
+        close(it->second.fd); // also removes it from the epoll set
+        conns_.erase(it);
+        --OPEN_CONNECTIONS;
+    }
+
+    void accept_all() {
+        while (true) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return; // EAGAIN or transient error
+            if (conns_.size() >= cfg_.maxConnections) {
+                Response r = busy_response();
+                string head = format_head(r, false);
+                iovec iov[4];
+                ssize_t w = writev(fd, iov, response_iov(head, r, 0, iov));
+                (void)w;
+                close(fd);
+                continue;
+            }
+            uint64_t id = nextId_++;
+            Conn& c = conns_[id];
+            ++OPEN_CONNECTIONS;
+            c.fd = fd;
+            c.lastActive = time(nullptr);
+            add_fd(fd, id, EPOLLIN);
         }
-        if (total > MAX_HEADER) {
-            send_response(client, "431 Request Header Fields Too Large", R"({"error":"headers_too_large"})");
+    }
+
+    // Returns false if the connection was closed.
+    bool on_readable(uint64_t id, Conn& c) {
+        char buf[16384];
+        while (true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                if (c.in.empty()) c.requestStart = time(nullptr);
+                c.in.append(buf, static_cast<size_t>(n));
+                c.lastActive = time(nullptr);
+                if (c.headerLen == 0 && c.in.size() > MAX_HEADER) break; // parse() rejects it
+                if (c.headerLen != 0 && c.in.size() >= c.headerLen + c.bodyLen) break;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0 && errno == EINTR) continue;
+            close_conn(id); // peer closed or hard error; a pending worker result is dropped
             return false;
         }
+        return parse(id, c);
+    }
+
+    void reject(uint64_t id, Conn& c, const string& status, const string& body) {
+        c.closeAfterWrite = true;
+        respond(id, c, json_response(status, body));
     }
 
-    // Parse request line
-    std::istringstream iss(headers);
-    string line; getline(iss, line);
-    // Remove trailing \r\n or \r
-    while (!line.empty() && (line.back()=='\r' || line.back()=='\n')) {
-        line.pop_back();
-    }
-    std::istringstream rl(line);
-    rl >> method >> target;
-
-    // Find Content-Length (if any)
-    size_t clen = 0;
-    string hline;
-    while (getline(iss, hline)) {
-        if (!hline.empty() && hline.back()=='\r') hline.pop_back();
-        auto p = hline.find(':');
-        if (p!=string::npos) {
-            string key = hline.substr(0,p);
-            string val = hline.substr(p+1);
-            auto l = val.find_first_not_of(" \t"); if (l!=string::npos) val=val.substr(l);
-            if (strcasecmp(key.c_str(), "Content-Length")==0) {
-                try { clen = static_cast<size_t>(stoll(val)); } catch(...) { clen = 0; }
+    // Parses and dispatches the next complete request in c.in, if any.
+    // Returns false if the connection was closed.
+    bool parse(uint64_t id, Conn& c) {
+        if (c.busy || c.outLen) return true;
+        if (c.headerLen == 0) {
+            auto pos = c.in.find("\r\n\r\n");
+            if (pos == string::npos) {
+                if (c.in.size() > MAX_HEADER) {
+                    reject(id, c, "431 Request Header Fields Too Large", R"({"error":"headers_too_large"})");
+                    return conns_.count(id) != 0;
+                }
+                return true;
             }
+            c.headerLen = pos + 4;
+            parse_headers(c);
+            // Without decoding the chunks the body's end is unknown, so the
+            // rest of the stream cannot be framed: answer and close.
+            if (c.transferEncoded) {
+                reject(id, c, "501 Not Implemented", R"({"error":"transfer_encoding_not_supported"})");
+                return conns_.count(id) != 0;
+            }
+            // Enforce maximum body size (before receiving more)
+            if (c.bodyLen > MAX_BODY) {
+                reject(id, c, "413 Request Entity Too Large", R"({"error":"payload_too_large"})");
+                return conns_.count(id) != 0;
+            }
+            // Grow the buffer once, so a large body is not copied as it arrives.
+            c.in.reserve(c.headerLen + c.bodyLen);
         }
+        const size_t end = c.headerLen + c.bodyLen;
+        if (c.in.size() < end) return true;
+
+        // The request keeps the buffer; only pipelined bytes after it are copied.
+        Request req;
+        auto raw = std::make_unique<string>(std::move(c.in));
+        c.in.assign(*raw, end, string::npos);
+        raw->resize(end);
+        string_view v(*raw);
+        req.method = v.substr(0, c.methodLen);
+        req.target = v.substr(c.targetPos, c.targetLen);
+        req.body = v.substr(c.headerLen, c.bodyLen);
+        req.raw = std::move(raw);
+        c.headerLen = 0;
+        c.bodyLen = 0;
+        if (!c.in.empty()) c.requestStart = time(nullptr);
+        dispatch(id, c, std::move(req));
+        return conns_.count(id) != 0;
     }
 
-    // Enforce maximum body size (before receiving more)
-    if (clen > MAX_BODY) {
-        send_response(client, "413 Request Entity Too Large", R"({"error":"payload_too_large"})");
-        return false;
+    static bool iequals(string_view a, string_view b) {
+        return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
     }
 
-    // Read remaining body (if any)
-    while (body.size() < clen) {
-        ssize_t n = recv(client, buf, sizeof(buf), 0);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                send_response(client, "408 Request Timeout", R"({"error":"timeout"})");
-                return false;
+    // Parses the request line and headers, c.in[0, c.headerLen), in place.
+    static void parse_headers(Conn& c) {
+        const string_view h(c.in.data(), c.headerLen);
+        size_t eol = h.find("\r\n");
+        const string_view line = h.substr(0, eol);
+        size_t sp1 = min(line.find(' '), line.size());
+        size_t sp2 = min(line.find(' ', sp1 + 1), line.size());
+        c.methodLen = sp1;
+        c.targetPos = min(sp1 + 1, line.size());
+        c.targetLen = sp2 - c.targetPos;
+        c.keepAlive = line.substr(min(sp2 + 1, line.size())) != "HTTP/1.0";
+        c.transferEncoded = false;
+
+        for (size_t pos = eol + 2; pos < h.size(); pos = eol + 2) {
+            eol = h.find("\r\n", pos);
+            const string_view hline = h.substr(pos, eol - pos);
+            auto p = hline.find(':');
+            if (p==string_view::npos) continue;
+            string_view key = hline.substr(0, p);
+            string_view val = hline.substr(p+1);
+            auto l = val.find_first_not_of(" \t");
+            val = l==string_view::npos ? string_view() : val.substr(l);
+            while (!val.empty() && (val.back()==' ' || val.back()=='\t')) val.remove_suffix(1);
+            if (iequals(key, "Content-Length")) {
+                unsigned long long n = 0;
+                c.bodyLen = std::from_chars(val.data(), val.data() + val.size(), n).ec == std::errc() ? n : 0;
+            } else if (iequals(key, "Transfer-Encoding")) {
+                c.transferEncoded = true;
+            } else if (iequals(key, "Connection")) {
+                if (iequals(val, "close")) c.keepAlive = false;
+                else if (iequals(val, "keep-alive")) c.keepAlive = true;
             }
-            return false;
         }
-        if (n == 0) return false;
-        body.append(buf, buf+n);
-        if (body.size() > MAX_BODY) {
-            send_response(client, "413 Request Entity Too Large", R"({"error":"payload_too_large"})");
-            return false;
+    }
+
+    void dispatch(uint64_t id, Conn& c, Request&& req) {
+        const string_view m = req.method;
+        const string_view t = req.target;
+        c.dispatched = metrics::start();
+        if (m=="OPTIONS") {
+            c.endpoint = EP_OTHER;
+            Response r; r.status = "204 No Content";
+            respond(id, c, std::move(r));
+        } else if (m=="GET" && t=="/ping") {
+            // Health check
+            c.endpoint = EP_PING;
+            respond(id, c, json_response("200 OK", ping_json()));
+        } else if (m=="GET" && t=="/metrics") {
+            c.endpoint = EP_METRICS;
+            respond(id, c, handle_metrics(req));
+        } else if (m=="GET" && (t=="/songs" || t.rfind("/songs?",0)==0)) {
+            c.endpoint = EP_SONGS;
+            // A front end waits on its shards, so it must not block the loop.
+            if (cfg_.frontEnd) enqueue(id, c, recognizeQ_, std::move(req), handle_sharded_songs);
+            else respond(id, c, handle_songs(req));
+        } else if (m=="POST" && t.rfind("/upload",0)==0) {
+            c.endpoint = EP_UPLOAD;
+            enqueue(id, c, uploadQ_, std::move(req), cfg_.frontEnd ? handle_sharded_upload : handle_upload);
+        } else if (m=="PUT" && t.rfind("/songs/",0)==0) {
+            c.endpoint = EP_REPLACE;
+            enqueue(id, c, uploadQ_, std::move(req), cfg_.frontEnd ? handle_sharded_edit : handle_replace);
+        } else if (m=="DELETE" && t.rfind("/songs/",0)==0) {
+            // Waits for the catalog's write lock, so it stays off the loop.
+            c.endpoint = EP_DELETE;
+            enqueue(id, c, uploadQ_, std::move(req), cfg_.frontEnd ? handle_sharded_edit : handle_delete);
+        } else if (m=="POST" && t.rfind("/recognize/batch",0)==0 && !cfg_.frontEnd) {
+            c.endpoint = EP_BATCH;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_recognize_batch);
+        } else if (m=="POST" && t.rfind("/recognize",0)==0 && t.rfind("/recognize/batch",0)!=0) {
+            c.endpoint = EP_RECOGNIZE;
+            enqueue(id, c, recognizeQ_, std::move(req), cfg_.frontEnd ? handle_sharded_recognize : handle_recognize);
+        } else if (cfg_.frontEnd) {
+            // Sessions, batches, /monitor and /search need a local index; the web UI falls back
+            // to uploading a recording when /session is missing.
+            c.endpoint = EP_OTHER;
+            respond(id, c, json_response("404 Not Found", R"({"error":"not_found"})"));
+        } else if (m=="POST" && t.rfind("/monitor",0)==0) {
+            // Runs in the recognize pool and borrows idle compute-pool threads.
+            c.endpoint = EP_MONITOR;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_monitor);
+        } else if (m=="POST" && t.rfind("/search/df",0)==0) {
+            c.endpoint = EP_SEARCH;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_search_df);
+        } else if (m=="POST" && t.rfind("/search",0)==0) {
+            c.endpoint = EP_SEARCH;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_search);
+        } else if (m=="POST" && (t=="/session" || t.rfind("/session?",0)==0)) {
+            c.endpoint = EP_SESSION;
+            respond(id, c, handle_session_open(req));
+        } else if (m=="POST" && t.rfind("/session/",0)==0) {
+            c.endpoint = EP_SESSION;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_session_chunk);
+        } else if (m=="DELETE" && t.rfind("/session/",0)==0) {
+            c.endpoint = EP_SESSION;
+            enqueue(id, c, recognizeQ_, std::move(req), handle_session_close);
+        } else {
+            c.endpoint = EP_OTHER;
+            respond(id, c, json_response("404 Not Found", R"({"error":"not_found"})"));
         }
     }
 
-    return true;
-}
+    void enqueue(uint64_t id, Conn& c, JobQueue& q, Request&& req, Handler h) {
+        if (!q.try_push(Job{ id, std::move(req), h, {} })) {
+            respond(id, c, busy_response());
+            return;
+        }
+        c.busy = true;
+        update_interest(id, c);
+    }
+
+    void drain_completions() {
+        uint64_t v;
+        while (read(WAKE_FD, &v, sizeof(v)) > 0) {}
+        vector<Completion> done;
+        {
+            std::lock_guard<std::mutex> lock(DONE_MTX);
+            done.swap(DONE);
+        }
+        for (auto& d : done) {
+            auto it = conns_.find(d.connId);
+            if (it == conns_.end()) continue; // client went away meanwhile
+            it->second.busy = false;
+            respond(d.connId, it->second, std::move(d.resp));
+        }
+    }
+
+    void respond(uint64_t id, Conn& c, Response&& r) {
+        if (c.endpoint >= 0) {
+            EndpointStats& stats = ENDPOINT_STATS[c.endpoint];
+            stats.requests.inc();
+            stats.seconds.observe_since(c.dispatched);
+            c.endpoint = -1;
+        }
+        c.head = format_head(r, c.keepAlive && !c.closeAfterWrite);
+        c.resp = std::move(r);
+        c.outPos = 0;
+        c.outLen = c.head.size() + c.resp.content_length();
+        c.lastActive = time(nullptr);
+        flush(id, c);
+    }
+
+    void flush(uint64_t id, Conn& c) {
+        while (c.outPos < c.outLen) {
+            iovec iov[4];
+            ssize_t n = writev(c.fd, iov, response_iov(c.head, c.resp, c.outPos, iov));
+            if (n > 0) { c.outPos += static_cast<size_t>(n); c.lastActive = time(nullptr); continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { update_interest(id, c); return; }
+            close_conn(id);
+            return;
+        }
+        if (!c.outLen) return;
+        c.head.clear();
+        c.resp = Response();
+        c.outPos = 0;
+        c.outLen = 0;
+        if (!c.keepAlive || c.closeAfterWrite) { close_conn(id); return; }
+        update_interest(id, c);
+        parse(id, c); // a pipelined request may already be buffered
+    }
+
+    // Closes stalled and idle connections.
+    void sweep(time_t now) {
+        vector<uint64_t> expired;
+        vector<uint64_t> timedOut;
+        for (auto& kv : conns_) {
+            const Conn& c = kv.second;
+            if (c.busy) continue;
+            if (c.outLen) {
+                if (now - c.lastActive > RECV_TIMEOUT_SEC) expired.push_back(kv.first);
+            } else if (!c.in.empty()) {
+                if (now - c.requestStart > RECV_TIMEOUT_SEC) timedOut.push_back(kv.first);
+            } else if (now - c.lastActive > KEEPALIVE_IDLE_SEC) {
+                expired.push_back(kv.first);
+            }
+        }
+        for (uint64_t id : expired) close_conn(id);
+        for (uint64_t id : timedOut) {
+            auto it = conns_.find(id);
+            if (it != conns_.end()) reject(id, it->second, "408 Request Timeout", R"({"error":"timeout"})");
+        }
+    }
+
+    int listenFd_;
+    ServerConfig cfg_;
+    int ep_ = -1;
+    uint64_t nextId_ = 2;
+    unordered_map<uint64_t, Conn> conns_;
+    JobQueue recognizeQ_;
+    JobQueue uploadQ_;
+};
 
 int main() {
     // Ignore SIGPIPE so that a broken socket send() doesn't kill the process
     std::signal(SIGPIPE, SIG_IGN);
 
-    engine_init("./data");
+    ServerConfig cfg = load_config();
+    DATA_DIR = cfg.dataDir;
+    cfg.frontEnd = shards_init(cfg.dataDir);
+    if (!cfg.frontEnd) engine_init(cfg.dataDir);
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd < 0) { perror("socket"); return 1; }
     int opt = 1;
     setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
@@ -191,7 +996,7 @@ int main() {
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = inet_addr("0.0.0.0");
-    addr.sin_port = htons(PORT);
+    addr.sin_port = htons(static_cast<uint16_t>(cfg.port));
 
     if (::bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind"); return 1;
@@ -199,115 +1004,12 @@ int main() {
     if (::listen(server_fd, BACKLOG) < 0) {
         perror("listen"); return 1;
     }
-    cerr << "Server listening on http://localhost:" << PORT << "\n";
-
-    while (true) {
-        int client = ::accept(server_fd, nullptr, nullptr);
-        if (client < 0) continue;
-
-        // set per-connection timeouts so slow/stalled clients don't hang the server
-        timeval tv{};
-        tv.tv_sec = RECV_TIMEOUT_SEC;
-        tv.tv_usec = 0;
-        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-        string method, target, headers, body;
-        if (!read_request(client, method, target, headers, body)) {
-            close(client); continue;
-        }
-
-        if (method=="OPTIONS") { send_204(client); close(client); continue; }
-
-        // Health check
-        if (method=="GET" && target=="/ping") {
-            send_response(client, "200 OK", R"({"ok":true})");
-            close(client);
-            continue;
-        }
-
-        // List songs
-        if (method=="GET" && target.rfind("/songs",0)==0) {
-            auto songs = get_song_list();
-            std::ostringstream oss; oss << R"({"songs":[)";
-            for (size_t i=0;i<songs.size();++i) {
-                if (i) oss << ",";
-                oss << R"({"id":)" << songs[i].id
-                    << R"(,"name":")" << songs[i].name
-                    << R"(","fingerprints":)" << songs[i].numFingerprints
-                    << R"(,"url":")" << songs[i].youtube_url << R"("})";
-            }
-            oss << "]}";
-            send_response(client, "200 OK", oss.str());
-            close(client);
-            continue;
-        }
-
-        // Upload - add song (expects audio bytes in body; uses add_song_to_db)
-        if (method=="POST" && target.rfind("/upload",0)==0) {
-            string name = get_query_param(target, "name");
-            if (name.empty()) {
-                send_response(client, "400 Bad Request", R"({"error":"A song label is required."})");
-                close(client); continue;
-            }
-            try {
-                std::filesystem::create_directories("./data/uploads");
-                string path = "./data/uploads/upload_" + now_ts() + ".wav";
-                FILE* f = fopen(path.c_str(), "wb");
-                if (!f) {
-                    send_response(client, "500 Internal Server Error", R"({"error":"Failed to write temporary file."})");
-                    close(client); continue;
-                }
-                fwrite(body.data(), 1, body.size(), f);
-                fclose(f);
-
-                int id = add_song_to_db(path, name);
-                std::filesystem::remove(path);
-
-                if (id < 0) {
-                    send_response(client, "400 Bad Request", R"({"error":"Fingerprinting failed. Check WAV format."})");
-                } else {
-                    std::ostringstream oss;
-                    oss << R"({"name":")" << name << R"("})";
-                    send_response(client, "200 OK", oss.str());
-                }
-            } catch (const std::exception &ex) {
-                std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
-                send_response(client, "500 Internal Server Error", err.str());
-            }
-            close(client);
-            continue;
-        }
-
-        // Recognize
-        if (method=="POST" && target.rfind("/recognize",0)==0) {
-            try {
-                std::filesystem::create_directories("./data/queries");
-                string qpath = "./data/queries/query_" + now_ts() + ".wav";
-                FILE* f = fopen(qpath.c_str(), "wb");
-                if (!f) {
-                    send_response(client, "500 Internal Server Error", R"({"error":"write_failed"})");
-                    close(client); continue;
-                }
-                fwrite(body.data(), 1, body.size(), f);
-                fclose(f);
-                auto res = identify_from_file(qpath);
-                // Optionally remove query file if you don't want disk persistence
-                // std::filesystem::remove(qpath);
-                send_response(client, "200 OK", res);
-            } catch (const std::exception &ex) {
-                std::ostringstream err; err << R"({"error":"server_exception","msg":")" << ex.what() << R"("})";
-                send_response(client, "500 Internal Server Error", err.str());
-            }
-            close(client);
-            continue;
-        }
-
-        // Not found
-        send_response(client, "404 Not Found", R"({"error":"not_found"})");
-        close(client);
-    }
+    cerr << "Server listening on http://localhost:" << cfg.port
+         << " (recognize workers=" << cfg.recognizeWorkers << " queue=" << cfg.recognizeQueue
+         << ", upload workers=" << cfg.uploadWorkers << " queue=" << cfg.uploadQueue << ")\n";
 
+    EventLoop loop(server_fd, cfg);
+    int rc = loop.run();
     close(server_fd);
-    return 0;
+    return rc;
 }
@@ -0,0 +1,479 @@
+#include "shards.h"
+#include "dsp.h"
+#include "engine.h"
+#include "fingerprint.h"
+#include "index.h"
+#include "metrics.h"
+#include "scoring.h"
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+    // Songs in a recognize reply, as identify_from_buffer() gives.
+    static const size_t TOP_SONGS = 5;
+    // Uploads fingerprint a whole song on the shard.
+    static const int UPLOAD_TIMEOUT_MS = 120000;
+    // How long a starting front end waits for its shards to come up.
+    static const int START_WAIT_MS = 30000;
+
+    struct Shard {
+        string addr;                     // host:port as listed
+        sockaddr_storage sa{};
+        socklen_t saLen = 0;
+        unique_ptr<metrics::Histogram> seconds;
+        unique_ptr<metrics::Counter> timeouts;
+        unique_ptr<metrics::Counter> errors;
+    };
+
+    vector<Shard> SHARDS;
+    int TIMEOUT_MS = 1000;
+
+    // One HTTP exchange with a shard, over its own connection.
+    struct Call {
+        Shard* shard;
+        string out;                      // the serialized request
+        size_t outPos = 0;
+        string in;
+        int fd = -1;
+        bool done = false;
+        bool ok = false;                 // a complete response arrived
+        string status;                   // e.g. "200 OK"
+        string body;
+    };
+
+    string http_request(const Shard& s, string_view method, string_view target, string_view body) {
+        std::ostringstream oss;
+        oss << method << " " << target << " HTTP/1.1\r\n"
+            << "Host: " << s.addr << "\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << "Connection: close\r\n\r\n"
+            << body;
+        return oss.str();
+    }
+
+    void finish_call(Call& c, bool received) {
+        if (c.fd >= 0) close(c.fd);
+        c.fd = -1;
+        c.done = true;
+        if (!received) return;
+        size_t eol = c.in.find("\r\n");
+        size_t head = c.in.find("\r\n\r\n");
+        if (c.in.compare(0, 5, "HTTP/") != 0 || eol == string::npos || head == string::npos) return;
+        size_t sp = c.in.find(' ');
+        if (sp == string::npos || sp > eol) return;
+        c.status = c.in.substr(sp + 1, eol - sp - 1);
+        c.body = c.in.substr(head + 4);
+        c.ok = true;
+    }
+
+    // Runs every call at once, each on a non-blocking socket, until all have
+    // answered or `timeoutMs` has passed; the server closes each connection
+    // after its response. Records per-shard latency and failures.
+    void exchange(vector<Call>& calls, int timeoutMs) {
+        const auto t0 = metrics::Clock::now();
+        const auto deadline = t0 + chrono::milliseconds(timeoutMs);
+        for (auto& c : calls) {
+            c.fd = socket(c.shard->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (c.fd < 0 || (connect(c.fd, reinterpret_cast<sockaddr*>(&c.shard->sa), c.shard->saLen) < 0
+                             && errno != EINPROGRESS))
+                finish_call(c, false);
+        }
+        vector<pollfd> fds;
+        vector<Call*> polled;
+        char buf[16384];
+        while (true) {
+            fds.clear();
+            polled.clear();
+            for (auto& c : calls) {
+                if (c.done) continue;
+                short ev = c.outPos < c.out.size() ? POLLOUT : POLLIN;
+                fds.push_back(pollfd{ c.fd, ev, 0 });
+                polled.push_back(&c);
+            }
+            if (fds.empty()) break;
+            auto left = chrono::duration_cast<chrono::milliseconds>(deadline - metrics::Clock::now()).count();
+            if (left <= 0) break;
+            int n = poll(fds.data(), fds.size(), static_cast<int>(left));
+            if (n < 0 && errno != EINTR) break;
+            for (size_t i = 0; n > 0 && i < fds.size(); ++i) {
+                if (!fds[i].revents) continue;
+                Call& c = *polled[i];
+                if (c.outPos < c.out.size()) {
+                    ssize_t w = send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL);
+                    if (w > 0) c.outPos += static_cast<size_t>(w);
+                    else if (w < 0 && errno != EAGAIN && errno != EINTR) finish_call(c, false);
+                    continue;
+                }
+                ssize_t r = recv(c.fd, buf, sizeof(buf), 0);
+                if (r > 0) c.in.append(buf, static_cast<size_t>(r));
+                else if (r == 0) finish_call(c, true);
+                else if (errno != EAGAIN && errno != EINTR) finish_call(c, false);
+            }
+        }
+        double secs = chrono::duration<double>(metrics::Clock::now() - t0).count();
+        for (auto& c : calls) {
+            if (!c.done) {
+                finish_call(c, false);
+                c.shard->timeouts->inc();
+                cerr << "shard " << c.shard->addr << " timed out after " << timeoutMs << " ms\n";
+            } else if (!c.ok) {
+                c.shard->errors->inc();
+            } else {
+                c.shard->seconds->observe(secs);
+            }
+        }
+    }
+
+    vector<Call> broadcast(const vector<Shard*>& to, const string& method, const string& target,
+                           const string& body, int timeoutMs) {
+        vector<Call> calls(to.size());
+        for (size_t i = 0; i < to.size(); ++i) {
+            calls[i].shard = to[i];
+            calls[i].out = http_request(*to[i], method, target, body);
+        }
+        exchange(calls, timeoutMs);
+        return calls;
+    }
+
+    vector<Shard*> all_shards() {
+        vector<Shard*> all;
+        for (auto& s : SHARDS) all.push_back(&s);
+        return all;
+    }
+
+    vector<Call> broadcast(const string& method, const string& target, const string& body, int timeoutMs) {
+        return broadcast(all_shards(), method, target, body, timeoutMs);
+    }
+
+    bool answered(const Call& c) { return c.ok && c.status.compare(0, 3, "200") == 0; }
+
+    void parse_hits(const string& body, vector<SearchHit>& out) {
+        std::istringstream in(body);
+        string line;
+        while (getline(in, line)) {
+            std::istringstream f(line);
+            SearchHit h{ 0, 0, 0, "", "" };
+            string id, score, offset;
+            if (!getline(f, id, '\t') || !getline(f, score, '\t') || !getline(f, offset, '\t')) continue;
+            getline(f, h.name, '\t');
+            getline(f, h.url, '\t');
+            h.songId = atoi(id.c_str());
+            h.score = atoi(score.c_str());
+            h.offset = atoi(offset.c_str());
+            out.push_back(std::move(h));
+        }
+    }
+
+    // IDF weights for the query's hashes over the shards that answer within
+    // `timeoutMs`, which are left in `counted`: each shard counts the songs it
+    // holds per hash (POST /search/df), and the counts add up, since shards
+    // hold disjoint songs. Empty when no shard answered.
+    vector<uint8_t> global_weights(const string& body, size_t n, int timeoutMs, vector<Shard*>& counted) {
+        counted.clear();
+        vector<Call> calls = broadcast("POST", "/search/df", body, timeoutMs);
+        vector<size_t> df(n, 0);
+        size_t songs = 0;
+        for (const auto& c : calls) {
+            if (!answered(c)) continue;
+            std::istringstream in(c.body);
+            size_t shardSongs = 0;
+            if (!(in >> shardSongs)) continue;
+            vector<size_t> shardDf(n, 0);
+            size_t i = 0;
+            while (i < n && in >> shardDf[i]) ++i;
+            if (i < n) continue;
+            counted.push_back(c.shard);
+            songs += shardSongs;
+            for (i = 0; i < n; ++i) df[i] += shardDf[i];
+        }
+        if (counted.empty()) return {};
+        vector<uint8_t> weights(n);
+        for (size_t i = 0; i < n; ++i) weights[i] = idf_weight(df[i], songs);
+        return weights;
+    }
+
+    // A number field of a flat JSON reply; -1 if missing.
+    long long json_number(const string& body, const string& key) {
+        size_t at = body.find("\"" + key + "\":");
+        return at == string::npos ? -1 : atoll(body.c_str() + at + key.size() + 3);
+    }
+
+    // Queries are fingerprinted here, so every shard's catalog must use
+    // `profile` at its sample rate (as GET /ping reports). Waits up to
+    // START_WAIT_MS for shards still loading their index; exits if one never
+    // answers or differs.
+    void check_shard_profiles(const FingerprintProfile& profile) {
+        const auto deadline = metrics::Clock::now() + chrono::milliseconds(START_WAIT_MS);
+        for (auto& s : SHARDS) {
+            vector<Call> calls(1);
+            for (;;) {
+                calls.assign(1, Call{});
+                calls[0].shard = &s;
+                calls[0].out = http_request(s, "GET", "/ping", "");
+                exchange(calls, TIMEOUT_MS);
+                if (answered(calls[0]) || metrics::Clock::now() >= deadline) break;
+                this_thread::sleep_for(chrono::milliseconds(200));
+            }
+            if (!answered(calls[0])) {
+                cerr << "Refusing to start: shard " << s.addr << " did not answer GET /ping\n";
+                exit(1);
+            }
+            const long long id = json_number(calls[0].body, "profile_id"), rate = json_number(calls[0].body, "rate");
+            if (id != static_cast<long long>(profile.id) || rate != profile.sampleRate) {
+                const FingerprintProfile* theirs = id >= 0 ? find_profile(static_cast<uint32_t>(id)) : nullptr;
+                cerr << "Refusing to start: shard " << s.addr << " uses the "
+                     << (theirs ? theirs->name : "unknown") << " profile at " << rate << " Hz, but this front end the "
+                     << profile.name << " profile at " << profile.sampleRate << " Hz; set MUSICREC_PROFILE to match\n";
+                exit(1);
+            }
+        }
+    }
+
+    // Tabs and newlines would break the reply's lines.
+    string field(string s) {
+        replace_if(s.begin(), s.end(), [](char ch){ return ch == '\t' || ch == '\n' || ch == '\r'; }, ' ');
+        return s;
+    }
+}
+
+bool shards_init(const std::string& data_dir) {
+    const char* list = getenv("MUSICREC_SHARDS");
+    if (!list || !*list) return false;
+    const char* t = getenv("MUSICREC_SHARD_TIMEOUT_MS");
+    if (t && atoi(t) > 0) TIMEOUT_MS = atoi(t);
+
+    std::istringstream in(list);
+    string addr;
+    while (getline(in, addr, ',')) {
+        if (addr.empty()) continue;
+        size_t colon = addr.rfind(':');
+        string host = colon == string::npos ? addr : addr.substr(0, colon);
+        string port = colon == string::npos ? "5001" : addr.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_INET;       // servers listen on IPv4
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+            cerr << "Refusing to start: cannot resolve shard " << addr << "\n";
+            exit(1);
+        }
+        Shard s;
+        s.addr = addr;
+        memcpy(&s.sa, res->ai_addr, res->ai_addrlen);
+        s.saLen = static_cast<socklen_t>(res->ai_addrlen);
+        freeaddrinfo(res);
+        string label = "shard=\"" + addr + "\"";
+        s.seconds.reset(new metrics::Histogram("musicrec_shard_seconds", label.c_str(),
+                                               "Time for a shard to answer a scattered request."));
+        s.timeouts.reset(new metrics::Counter("musicrec_shard_failures_total", (label + R"(,reason="timeout")").c_str(),
+                                              "Shard requests left out of a reply."));
+        s.errors.reset(new metrics::Counter("musicrec_shard_failures_total", (label + R"(,reason="error")").c_str(),
+                                            "Shard requests left out of a reply."));
+        SHARDS.push_back(std::move(s));
+    }
+    if (SHARDS.empty()) return false;
+    // Queries are fingerprinted here, with the profile the shards' catalogs
+    // were made with (MUSICREC_PROFILE must match theirs).
+    set_active_profile(profile_from_env());
+    check_shard_profiles(active_profile());
+    std::error_code ec;
+    std::filesystem::create_directories(data_dir, ec);
+    dsp_init(data_dir, active_profile().windowSize);
+    cerr << "Front end for " << SHARDS.size() << " shards (timeout " << TIMEOUT_MS << " ms, "
+         << active_profile().name << " profile)\n";
+    return true;
+}
+
+std::string sharded_recognize(const void* data, size_t size, std::string& status) {
+    status = "200 OK";
+    vector<pair<uint32_t, int32_t>> hashes;
+    string err = fingerprint_buffer(data, size, hashes);
+    if (!err.empty()) return err;
+    string body(hashes.size() * 8, '\0');
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        memcpy(&body[i * 8], &hashes[i].first, 4);
+        memcpy(&body[i * 8 + 4], &hashes[i].second, 4);
+    }
+
+    // Both rounds share one deadline; the counts may take half of it. The
+    // search then goes to the shards whose songs were counted, so the weights
+    // and the hits cover the same songs.
+    const auto t0 = metrics::Clock::now();
+    string target = "/search?top=" + to_string(TOP_SONGS);
+    vector<Shard*> to = all_shards();
+    if (hash_policy().idf) {
+        vector<Shard*> counted;
+        vector<uint8_t> weights = global_weights(body, hashes.size(), max(1, TIMEOUT_MS / 2), counted);
+        if (!weights.empty()) {
+            body.append(reinterpret_cast<const char*>(weights.data()), weights.size());
+            target += "&weighted=1";
+            to = std::move(counted);
+        }
+    }
+    const auto spent = chrono::duration_cast<chrono::milliseconds>(metrics::Clock::now() - t0).count();
+    vector<Call> calls = broadcast(to, "POST", target, body, max(1, TIMEOUT_MS - static_cast<int>(spent)));
+    // Shards hold disjoint songs, so the best songs overall are among each
+    // shard's best.
+    vector<SearchHit> top;
+    size_t ok = 0;
+    for (const auto& c : calls) {
+        if (!answered(c)) continue;
+        ++ok;
+        parse_hits(c.body, top);
+    }
+    if (ok == 0) {
+        status = "503 Service Unavailable";
+        return R"({"error":"shards_unavailable"})";
+    }
+    stable_sort(top.begin(), top.end(), [](const SearchHit& a, const SearchHit& b) {
+        return a.score != b.score ? a.score > b.score : a.songId < b.songId;
+    });
+    if (top.size() > TOP_SONGS) top.resize(TOP_SONGS);
+    std::ostringstream fields;
+    fields << R"("shards":)" << SHARDS.size() << R"(,"answered":)" << ok
+           << R"(,"partial":)" << (ok < SHARDS.size() ? "true" : "false") << ",";
+    return hits_json(top, fields.str());
+}
+
+// One process lists songs by id, so the first offset + limit songs of the
+// catalog are among each shard's first offset + limit.
+std::string sharded_songs(size_t offset, size_t limit, std::string& status) {
+    const size_t want = limit > SIZE_MAX - offset ? SIZE_MAX : offset + limit;
+    const string target = want == SIZE_MAX ? "/songs" : "/songs?limit=" + to_string(want);
+    vector<Call> calls = broadcast("GET", target, "", TIMEOUT_MS);
+    vector<pair<long long, string>> songs;   // (id, object)
+    size_t ok = 0, total = 0;
+    static const string START = R"({"id":)";
+    for (const auto& c : calls) {
+        if (!answered(c)) continue;
+        size_t b = c.body.find('['), e = c.body.rfind(']');
+        if (b == string::npos || e == string::npos || e < b) continue;
+        ++ok;
+        size_t t = c.body.find(R"("total":)", e);
+        if (t != string::npos) total += static_cast<size_t>(atoll(c.body.c_str() + t + 8));
+        // Each object starts with `{"id":` and ends before the comma ahead of the next.
+        vector<size_t> starts;
+        for (size_t at = c.body.find(START, b); at < e; at = c.body.find(START, at + 1)) starts.push_back(at);
+        for (size_t k = 0; k < starts.size(); ++k) {
+            const size_t end = k + 1 < starts.size() ? starts[k + 1] - 1 : e;
+            songs.emplace_back(atoll(c.body.c_str() + starts[k] + START.size()), c.body.substr(starts[k], end - starts[k]));
+        }
+    }
+    if (ok == 0) {
+        status = "503 Service Unavailable";
+        return R"({"error":"shards_unavailable"})";
+    }
+    sort(songs.begin(), songs.end(), [](const pair<long long, string>& a, const pair<long long, string>& b) {
+        return a.first < b.first;
+    });
+    string out = R"({"songs":[)";
+    for (size_t i = offset; i < songs.size() && i - offset < limit; ++i) {
+        if (i > offset) out += ",";
+        out += songs[i].second;
+    }
+    status = "200 OK";
+    return out + R"(],"total":)" + to_string(total) + (ok < calls.size() ? R"(,"partial":true)" : "") + "}";
+}
+
+// Songs go to the shards in turn. A shard that could not be reached is
+// skipped; one that failed after taking the upload is not retried, since it
+// may have added the song.
+std::string sharded_upload(std::string_view target, std::string_view body, std::string& status) {
+    static std::atomic<size_t> next{0};
+    size_t first = next.fetch_add(1);
+    for (size_t i = 0; i < SHARDS.size(); ++i) {
+        vector<Call> calls(1);
+        calls[0].shard = &SHARDS[(first + i) % SHARDS.size()];
+        calls[0].out = http_request(*calls[0].shard, "POST", target, body);
+        exchange(calls, UPLOAD_TIMEOUT_MS);
+        if (calls[0].ok) {
+            status = calls[0].status;
+            return calls[0].body;
+        }
+        if (calls[0].outPos > 0) break;
+    }
+    status = "502 Bad Gateway";
+    return R"({"error":"shard_unavailable"})";
+}
+
+std::string sharded_edit(std::string_view method, std::string_view target, std::string_view body,
+                         int songId, std::string& status) {
+    if (songId < 0) {
+        status = "404 Not Found";
+        return R"({"error":"no_song"})";
+    }
+    vector<Call> calls(1);
+    calls[0].shard = &SHARDS[static_cast<size_t>(songId) % SHARDS.size()];
+    calls[0].out = http_request(*calls[0].shard, method, target, body);
+    exchange(calls, UPLOAD_TIMEOUT_MS);
+    if (calls[0].ok) {
+        status = calls[0].status;
+        return calls[0].body;
+    }
+    status = "502 Bad Gateway";
+    return R"({"error":"shard_unavailable"})";
+}
+
+namespace {
+    // The (hash, frame) pairs at the front of a /search body, followed by
+    // `extra` bytes per pair; false if the size does not fit.
+    bool parse_pairs(std::string_view body, size_t extra, vector<pair<uint32_t, int32_t>>& hashes) {
+        if (body.size() % (8 + extra) != 0) return false;
+        hashes.resize(body.size() / (8 + extra));
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            memcpy(&hashes[i].first, &body[i * 8], 4);
+            memcpy(&hashes[i].second, &body[i * 8 + 4], 4);
+        }
+        return true;
+    }
+}
+
+std::string shard_search(std::string_view body, size_t topN, bool weighted, std::string& status) {
+    vector<pair<uint32_t, int32_t>> hashes;
+    if (!parse_pairs(body, weighted ? 1 : 0, hashes)) {
+        status = "400 Bad Request";
+        return weighted ? R"({"error":"expected (uint32 hash, int32 frame) pairs, then a weight byte each"})"
+                        : R"({"error":"expected (uint32 hash, int32 frame) pairs"})";
+    }
+    const uint8_t* weights = weighted ? reinterpret_cast<const uint8_t*>(body.data()) + hashes.size() * 8 : nullptr;
+    std::ostringstream out;
+    for (const auto& h : search_hashes(hashes.data(), hashes.size(), max<size_t>(topN, 1), weights))
+        out << h.songId << "\t" << h.score << "\t" << h.offset << "\t"
+            << field(h.name) << "\t" << field(h.url) << "\n";
+    status = "200 OK";
+    return out.str();
+}
+
+std::string shard_hash_songs(std::string_view body, std::string& status) {
+    vector<pair<uint32_t, int32_t>> hashes;
+    if (!parse_pairs(body, 0, hashes)) {
+        status = "400 Bad Request";
+        return R"({"error":"expected (uint32 hash, int32 frame) pairs"})";
+    }
+    size_t songs = 0;
+    vector<uint32_t> df = hash_songs(hashes.data(), hashes.size(), songs);
+    std::ostringstream out;
+    out << songs << "\n";
+    for (uint32_t d : df) out << d << "\n";
+    status = "200 OK";
+    return out.str();
+}
@@ -0,0 +1,40 @@
+#pragma once
+// Scatter-gather over shard processes. A catalog too big for one process is
+// split by song across N `server` processes started with MUSICREC_SHARD=i/N;
+// a front end started with MUSICREC_SHARDS=host:port,... holds no index. It
+// fingerprints each query once, sends the hashes to every shard in parallel
+// (POST /search), and merges their top songs into one recognize reply. Votes
+// are weighted by IDF over the whole catalog, from song counts per hash the
+// shards report first (POST /search/df), so the ranking is the one a single
+// process would give. Shards
+// that fail or miss the deadline (MUSICREC_SHARD_TIMEOUT_MS) are left out and
+// the reply is marked partial.
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Reads MUSICREC_SHARDS; false when unset (this process is not a front end).
+// Exits if a listed shard address cannot be resolved.
+bool shards_init(const std::string& data_dir);
+
+// Front end: each returns the reply body and sets `status` to the HTTP status.
+std::string sharded_recognize(const void* data, size_t size, std::string& status);
+// Songs [offset, offset + limit) of the whole catalog, by id, and the total.
+std::string sharded_songs(size_t offset, size_t limit, std::string& status);
+// Forwards an upload to the shards in turn; `target` is the request target.
+std::string sharded_upload(std::string_view target, std::string_view body, std::string& status);
+// Forwards a request about song `songId` (a global id, -1 if none) to the
+// shard holding it: shard songId % N, so MUSICREC_SHARDS must list the shards
+// in shard order.
+std::string sharded_edit(std::string_view method, std::string_view target, std::string_view body,
+                         int songId, std::string& status);
+
+// Shard: answers POST /search, whose body is the query's (uint32 hash, int32
+// frame) pairs in little-endian order, followed when `weighted` by one vote
+// weight byte per pair (else the shard's own IDF weights apply). The reply has
+// one tab-separated `songId score offset name url` line per song, best first.
+std::string shard_search(std::string_view body, size_t topN, bool weighted, std::string& status);
+// Shard: answers POST /search/df, whose body is as for /search. The reply is
+// the shard's live song count, then the live songs holding each hash, one
+// number per line.
+std::string shard_hash_songs(std::string_view body, std::string& status);
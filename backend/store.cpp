@@ -0,0 +1,315 @@
+#include "store.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// File layout (native little-endian, every section 8-byte aligned):
+//   IndexHeader | posting blob | FlatDirEntry[numHashes] | uint32 buckets[NUM_BUCKETS]
+//   | SongRec[numSongs] | strings
+// Postings of one hash are contiguous and varint-coded (see encode_postings);
+// the directory is sorted by hash.
+namespace {
+    static const char     INDEX_MAGIC[8] = { 'M','R','I','D','X','\0','\0','\0' };
+    static const uint32_t INDEX_VERSION  = 3;
+    static const uint32_t DELTA_MAGIC    = 0x534E4750; // "SNGP"
+    static const uint32_t DELETE_MAGIC   = 0x534E4744; // "SNGD"
+    // Largest record payload written or replayed (~33M fingerprints, hours of
+    // audio); a longer length field is a torn or corrupt header.
+    static const uint32_t MAX_RECORD_BYTES = 256u << 20;
+
+    struct IndexHeader {
+        char     magic[8];
+        uint32_t version;
+        uint32_t numSongs;
+        uint32_t sampleRate;   // rate the fingerprints were made at
+        uint32_t profile;      // ...and their profile
+        uint64_t numHashes;
+        uint64_t numPostings;
+        uint64_t blobOff, blobLen, dirOff, bucketsOff, songsOff, stringsOff, stringsLen;
+        uint64_t fileSize;
+    };
+
+    struct SongRec {
+        uint64_t numFps;
+        uint32_t nameOff, nameLen;
+        uint32_t urlOff, urlLen;
+    };
+
+    uint32_t fnv1a(const char* p, size_t n) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < n; ++i) { h ^= static_cast<uint8_t>(p[i]); h *= 16777619u; }
+        return h;
+    }
+
+    uint64_t align8(uint64_t v) { return (v + 7) & ~uint64_t(7); }
+
+    bool write_all(FILE* f, const void* p, size_t n) {
+        return n == 0 || fwrite(p, 1, n, f) == n;
+    }
+
+    bool pad_to(FILE* f, uint64_t& pos, uint64_t target) {
+        static const char zeros[8] = {0};
+        if (target > pos && !write_all(f, zeros, target - pos)) return false;
+        pos = target;
+        return true;
+    }
+}
+
+IndexFile::~IndexFile() {
+    if (base_) munmap(base_, size_);
+}
+
+IndexFile* IndexFile::open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(IndexHeader))) {
+        cerr << "index: " << path << " is truncated\n";
+        ::close(fd);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) { perror("mmap"); return nullptr; }
+
+    const IndexHeader* h = static_cast<const IndexHeader*>(base);
+    bool ok = memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+           && h->version == INDEX_VERSION
+           && h->fileSize == size
+           && h->blobOff + h->blobLen <= size
+           && h->dirOff + h->numHashes * sizeof(FlatDirEntry) <= size
+           && h->bucketsOff + FlatIndex::NUM_BUCKETS * sizeof(uint32_t) <= size
+           && h->songsOff + uint64_t(h->numSongs) * sizeof(SongRec) <= size
+           && h->stringsOff + h->stringsLen <= size;
+    if (!ok) {
+        cerr << "index: " << path << " has a bad header (magic/version/size)\n";
+        munmap(base, size);
+        return nullptr;
+    }
+
+    IndexFile* idx = new IndexFile();
+    const char* b = static_cast<const char*>(base);
+    idx->base_ = base;
+    idx->size_ = size;
+    idx->index_ = FlatIndex(reinterpret_cast<const FlatDirEntry*>(b + h->dirOff), h->numHashes,
+                            reinterpret_cast<const uint8_t*>(b + h->blobOff), h->blobLen,
+                            reinterpret_cast<const uint32_t*>(b + h->bucketsOff), h->numPostings);
+    idx->songs_ = b + h->songsOff;
+    idx->strings_ = b + h->stringsOff;
+    idx->numSongs_ = h->numSongs;
+    idx->sampleRate_ = h->sampleRate;
+    idx->profile_ = h->profile;
+    // Lookups jump through the bucket table into the directory and then the blob.
+    madvise(base, size, MADV_RANDOM);
+    return idx;
+}
+
+void IndexFile::read_songs(vector<Song>& out) const {
+    out.clear();
+    out.reserve(numSongs_);
+    const SongRec* recs = reinterpret_cast<const SongRec*>(songs_);
+    for (uint32_t i = 0; i < numSongs_; ++i) {
+        const SongRec& r = recs[i];
+        out.push_back(Song{ static_cast<int>(i),
+                            string(strings_ + r.nameOff, r.nameLen),
+                            static_cast<size_t>(r.numFps),
+                            string(strings_ + r.urlOff, r.urlLen) });
+    }
+}
+
+bool write_index_file(const string& path, const vector<Song>& songs, uint32_t sampleRate,
+                      uint32_t profile, const PostingSource& source, HashStats* stats) {
+    PostingSource next = apply_hash_policy(source, songs.size(), stats);
+    string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) { perror("fopen index"); return false; }
+
+    IndexHeader h{};
+    memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.version = INDEX_VERSION;
+    h.numSongs = static_cast<uint32_t>(songs.size());
+    h.sampleRate = sampleRate;
+    h.profile = profile;
+
+    bool ok = write_all(f, &h, sizeof(h));
+    uint64_t pos = sizeof(h);
+    ok = ok && pad_to(f, pos, align8(pos));
+    h.blobOff = pos;
+
+    vector<FlatDirEntry> dir;
+    vector<Posting> plist;
+    string enc;
+    uint32_t hash = 0;
+    while (ok && next(hash, plist)) {
+        if (plist.empty()) continue;
+        dir.push_back(FlatDirEntry{ hash, static_cast<uint32_t>(plist.size()), h.blobLen });
+        enc.clear();
+        encode_postings(plist, enc);
+        ok = write_all(f, enc.data(), enc.size());
+        h.blobLen += enc.size();
+        h.numPostings += plist.size();
+    }
+    pos += h.blobLen;
+    // Slack so the decoder's two-byte peek never reads past the blob.
+    ok = ok && pad_to(f, pos, align8(pos + 1));
+
+    h.dirOff = pos;
+    h.numHashes = dir.size();
+    ok = ok && write_all(f, dir.data(), dir.size() * sizeof(FlatDirEntry));
+    pos += dir.size() * sizeof(FlatDirEntry);
+
+    vector<uint32_t> buckets(FlatIndex::NUM_BUCKETS);
+    build_buckets(dir.data(), dir.size(), buckets.data());
+    h.bucketsOff = pos;
+    ok = ok && write_all(f, buckets.data(), buckets.size() * sizeof(uint32_t));
+    pos += buckets.size() * sizeof(uint32_t);
+
+    string strings;
+    vector<SongRec> recs;
+    recs.reserve(songs.size());
+    for (const auto& s : songs) {
+        SongRec r{};
+        r.numFps = s.numFingerprints;
+        r.nameOff = static_cast<uint32_t>(strings.size()); r.nameLen = static_cast<uint32_t>(s.name.size());
+        strings += s.name;
+        r.urlOff = static_cast<uint32_t>(strings.size()); r.urlLen = static_cast<uint32_t>(s.youtube_url.size());
+        strings += s.youtube_url;
+        recs.push_back(r);
+    }
+    h.songsOff = pos;
+    ok = ok && write_all(f, recs.data(), recs.size() * sizeof(SongRec));
+    pos += recs.size() * sizeof(SongRec);
+    h.stringsOff = pos;
+    h.stringsLen = strings.size();
+    ok = ok && write_all(f, strings.data(), strings.size());
+    pos += strings.size();
+    ok = ok && pad_to(f, pos, align8(pos));
+    h.fileSize = pos;
+
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && write_all(f, &h, sizeof(h));
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        cerr << "index: failed to write " << path << "\n";
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+DeltaLog::~DeltaLog() { close(); }
+
+bool DeltaLog::open(const string& path, uint32_t sampleRate, uint32_t profile) {
+    close();
+    sampleRate_ = sampleRate;
+    profile_ = profile;
+    f_ = fopen(path.c_str(), "ab");
+    if (!f_) { perror("fopen delta log"); return false; }
+    return true;
+}
+
+void DeltaLog::close() {
+    if (f_) { fclose(f_); f_ = nullptr; }
+}
+
+// Record: magic | payloadLen | payload | fnv1a(payload)
+// Payload: sampleRate | profile | songId | nameLen name | urlLen url | numFps (hash, offset)*
+bool DeltaLog::append(const Song& song, const vector<pair<uint32_t,int32_t>>& fps) {
+    if (!f_) return false;
+    string p;
+    auto put32 = [&p](uint32_t v){ p.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+    put32(sampleRate_);
+    put32(profile_);
+    put32(static_cast<uint32_t>(song.id));
+    put32(static_cast<uint32_t>(song.name.size())); p += song.name;
+    put32(static_cast<uint32_t>(song.youtube_url.size())); p += song.youtube_url;
+    put32(static_cast<uint32_t>(fps.size()));
+    for (const auto& fp : fps) { put32(fp.first); put32(static_cast<uint32_t>(fp.second)); }
+    if (p.size() > MAX_RECORD_BYTES) {
+        cerr << "delta log: song " << song.id << " has too many fingerprints (" << fps.size() << ") to log\n";
+        return false;
+    }
+
+    uint32_t hdr[2] = { DELTA_MAGIC, static_cast<uint32_t>(p.size()) };
+    uint32_t sum = fnv1a(p.data(), p.size());
+    bool ok = write_all(f_, hdr, sizeof(hdr)) && write_all(f_, p.data(), p.size())
+           && write_all(f_, &sum, sizeof(sum)) && fflush(f_) == 0;
+    if (!ok) cerr << "delta log: append failed for song " << song.id << "\n";
+    return ok;
+}
+
+// Delete record: DELETE_MAGIC | 4 | songId | fnv1a(songId)
+bool DeltaLog::append_delete(int songId) {
+    if (!f_) return false;
+    uint32_t id = static_cast<uint32_t>(songId);
+    uint32_t rec[4] = { DELETE_MAGIC, sizeof(id), id, fnv1a(reinterpret_cast<const char*>(&id), sizeof(id)) };
+    bool ok = write_all(f_, rec, sizeof(rec)) && fflush(f_) == 0;
+    if (!ok) cerr << "delta log: append failed for deleting song " << songId << "\n";
+    return ok;
+}
+
+bool DeltaLog::replay(const string& path, const ReplayFn& fn, const DeleteFn& onDelete) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return true; // nothing to replay
+    long good = 0;
+    string p;
+    vector<pair<uint32_t,int32_t>> fps;
+    while (true) {
+        uint32_t hdr[2];
+        if (fread(hdr, sizeof(hdr), 1, f) != 1) break;
+        if (hdr[0] != DELTA_MAGIC && hdr[0] != DELETE_MAGIC) break;
+        if (hdr[1] > MAX_RECORD_BYTES) break;
+        p.resize(hdr[1]);
+        uint32_t sum = 0;
+        if (fread(&p[0], 1, p.size(), f) != p.size() || fread(&sum, sizeof(sum), 1, f) != 1) break;
+        if (sum != fnv1a(p.data(), p.size())) break;
+        if (hdr[0] == DELETE_MAGIC) {
+            uint32_t id = 0;
+            if (p.size() != sizeof(id)) break;
+            memcpy(&id, p.data(), sizeof(id));
+            if (onDelete) onDelete(static_cast<int>(id));
+            good = ftell(f);
+            continue;
+        }
+
+        size_t at = 0;
+        auto get32 = [&](uint32_t& v){
+            if (at + sizeof(v) > p.size()) return false;
+            memcpy(&v, p.data() + at, sizeof(v)); at += sizeof(v); return true;
+        };
+        auto getstr = [&](string& s){
+            uint32_t n = 0;
+            if (!get32(n) || at + n > p.size()) return false;
+            s.assign(p.data() + at, n); at += n; return true;
+        };
+        Song song{};
+        uint32_t rate = 0, profile = 0, id = 0, n = 0;
+        if (!get32(rate) || !get32(profile)) break;
+        if (!get32(id) || !getstr(song.name) || !getstr(song.youtube_url) || !get32(n)) break;
+        if (at + uint64_t(n) * 8 != p.size()) break;
+        song.id = static_cast<int>(id);
+        song.numFingerprints = n;
+        fps.resize(n);
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t hv = 0, off = 0;
+            get32(hv); get32(off);
+            fps[i] = { hv, static_cast<int32_t>(off) };
+        }
+        fn(song, rate, profile, fps);
+        good = ftell(f);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    if (size != good) {
+        cerr << "delta log: dropping " << (size - good) << " torn bytes at end of " << path << "\n";
+        if (truncate(path.c_str(), good) != 0) { perror("truncate delta log"); return false; }
+    }
+    return true;
+}
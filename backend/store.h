@@ -0,0 +1,79 @@
+#pragma once
+// On-disk fingerprint index: a read-only, mmap'd base file plus an append-only
+// delta log of songs added since the last compaction.
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+#include "index.h"
+
+// Read-only view of a base index file. All sections live in one mapping, so
+// several server processes opening the same file share its page cache.
+class IndexFile {
+public:
+    ~IndexFile();
+    IndexFile(const IndexFile&) = delete;
+    IndexFile& operator=(const IndexFile&) = delete;
+
+    // Returns nullptr if the file is missing or malformed (reason on stderr).
+    static IndexFile* open(const std::string& path);
+
+    // CSR view over the mapped directory and posting blob.
+    const FlatIndex& index() const { return index_; }
+    size_t mapped_bytes() const { return size_; }
+    // Rate and profile (fingerprint.h) the fingerprints in this file were made with.
+    uint32_t sample_rate() const { return sampleRate_; }
+    uint32_t profile() const { return profile_; }
+
+    void read_songs(std::vector<Song>& out) const;
+
+private:
+    IndexFile() = default;
+    void* base_ = nullptr;
+    size_t size_ = 0;
+    FlatIndex index_;
+    const char* songs_ = nullptr;
+    const char* strings_ = nullptr;
+    uint32_t numSongs_ = 0;
+    uint32_t sampleRate_ = 0;
+    uint32_t profile_ = 0;
+};
+
+// Streams a new base file to `path` (via a temp file + rename), pulling hashes
+// and their postings from `next` in increasing hash order. `sampleRate` and
+// `profile` are recorded in the header. The hash policy is applied on the way (per-song
+// cap, stop hashes); `stats` receives the result if given.
+bool write_index_file(const std::string& path, const std::vector<Song>& songs,
+                      uint32_t sampleRate, uint32_t profile, const PostingSource& next,
+                      HashStats* stats = nullptr);
+
+// Append-only log of catalog changes not yet part of the base file. An add
+// record carries the song metadata and all its fingerprints, so replaying the
+// log on startup rebuilds the in-memory delta without touching any audio; a
+// delete record names a song (in the base file or earlier in the log).
+class DeltaLog {
+public:
+    ~DeltaLog();
+    // Records appended after this are tagged with `sampleRate` and `profile`.
+    bool open(const std::string& path, uint32_t sampleRate, uint32_t profile);
+    void close();
+    bool append(const Song& song, const std::vector<std::pair<uint32_t,int32_t>>& fps);
+    bool append_delete(int songId);
+
+    // Called with each song, the sample rate and profile its fingerprints
+    // were made with, and the fingerprints.
+    using ReplayFn = std::function<void(const Song&, uint32_t sampleRate, uint32_t profile,
+                                        const std::vector<std::pair<uint32_t,int32_t>>&)>;
+    using DeleteFn = std::function<void(int songId)>;
+    // Replays every complete record in order; a torn tail left by a crash is
+    // truncated. Delete records are skipped when `onDelete` is empty.
+    static bool replay(const std::string& path, const ReplayFn& fn, const DeleteFn& onDelete = nullptr);
+
+private:
+    FILE* f_ = nullptr;
+    uint32_t sampleRate_ = 0;
+    uint32_t profile_ = 0;
+};
@@ -194,7 +194,8 @@ async function refreshSongs() {
 refreshSongs();
 
 
-// 3) Record N seconds as WAV in-browser, then recognize
+// 3) Stream the microphone to the server until it is sure (at most N seconds);
+//    servers without streaming get a recorded WAV instead
 const btnRecord = $("btnRecord");
 let hasRequestedPermission = false;
 
@@ -210,7 +211,8 @@ async function checkMicrophonePermission() {
 }
 
 $("btnRecord").onclick = async () => {
-  const secs = 5;
+  const secs = 10;
+  const wavSecs = 5;
   const resultBox = $("idResult");
   let countdownInterval;
   let micStream = null;
@@ -235,33 +237,41 @@ $("btnRecord").onclick = async () => {
     // Mark that we've requested permission at least once
     hasRequestedPermission = true;
 
-    let timeLeft = secs;
-    setStatus(resultBox, `Recording... (${timeLeft}s)`, 'loading');
-    countdownInterval = setInterval(() => {
-      timeLeft--;
-      if (timeLeft >= 0) {
-        setStatus(resultBox, `Recording... (${timeLeft}s)`, 'loading');
-      } else {
-        clearInterval(countdownInterval);
-      }
-    }, 1000);
-
-    const blob = await recordAndEncodeWav(micStream, secs);
-    clearInterval(countdownInterval);
+    setStatus(resultBox, "Listening...", 'loading');
+    let result = await streamAndRecognize(micStream, API, secs);
+
+    if (!result) {
+      let timeLeft = wavSecs;
+      setStatus(resultBox, `Recording... (${timeLeft}s)`, 'loading');
+      countdownInterval = setInterval(() => {
+        timeLeft--;
+        if (timeLeft >= 0) {
+          setStatus(resultBox, `Recording... (${timeLeft}s)`, 'loading');
+        } else {
+          clearInterval(countdownInterval);
+        }
+      }, 1000);
+
+      const blob = await recordAndEncodeWav(micStream, wavSecs);
+      clearInterval(countdownInterval);
+
+      // Stop the microphone stream immediately after recording
+      micStream.getTracks().forEach(track => track.stop());
+      micStream = null;
 
-    // Stop the microphone stream immediately after recording
+      setStatus(resultBox, "Identifying...", 'loading');
+      const res = await fetch(`${API}/recognize`, {
+        method: "POST",
+        headers: { "Content-Type": "audio/wav" },
+        body: await blob.arrayBuffer()
+      });
+      result = await res.json();
+    }
+    // Stop the microphone stream as soon as there is an answer
     if (micStream) {
       micStream.getTracks().forEach(track => track.stop());
       micStream = null;
     }
-
-    setStatus(resultBox, "Identifying...", 'loading');
-    const res = await fetch(`${API}/recognize`, {
-      method: "POST",
-      headers: { "Content-Type": "audio/wav" },
-      body: await blob.arrayBuffer()
-    });
-    const result = await res.json();
     displayIdResult(result);
   } catch (e) {
     clearInterval(countdownInterval);
@@ -20,16 +20,88 @@ async function recordAndEncodeWav(stream, seconds = 5) {
   source.disconnect();
   ctx.close();
 
-  let length = samples.reduce((a, b) => a + b.length, 0);
-  let pcm = new Float32Array(length);
+  const pcm = concatChunks(samples);
+  const wavBytes = encodeWav(pcm, 44100);
+  return new Blob([wavBytes], { type: "audio/wav" });
+}
+
+// Streams the microphone to a recognition session on the server, half a
+// second at a time, and resolves with the server's answer as soon as it is
+// sure, or with its best guess after `seconds`. Resolves null when the server
+// has no session endpoint.
+async function streamAndRecognize(stream, api, seconds = 10, chunkSecs = 0.5) {
+  const ctx = new (window.AudioContext || window.webkitAudioContext)({ sampleRate: 44100 });
+  const open = await fetch(`${api}/session?rate=${ctx.sampleRate}`, { method: "POST" }).catch(() => null);
+  if (!open || !open.ok) {
+    ctx.close();
+    return null;
+  }
+  const url = `${api}/session/${(await open.json()).session}`;
+
+  const source = ctx.createMediaStreamSource(stream);
+  const processor = ctx.createScriptProcessor(4096, 1, 1);
+  let pending = [];
+  let pendingLen = 0;
+  let result = null;
+  let finish;
+  const finished = new Promise(res => finish = res);
+
+  // Chunks go out one at a time, in order; Float32Array bodies are
+  // little-endian on every platform browsers run on.
+  let sending = Promise.resolve();
+  const send = pcm => {
+    sending = sending.then(async () => {
+      if (result) return;
+      const res = await fetch(url, { method: "POST", body: pcm.buffer });
+      const reply = await res.json();
+      if (reply.done || reply.error) {
+        result = reply;
+        finish();
+      }
+    }).catch(e => {
+      result = { error: e.message };
+      finish();
+    });
+  };
+
+  processor.onaudioprocess = e => {
+    if (result) return;
+    pending.push(new Float32Array(e.inputBuffer.getChannelData(0)));
+    pendingLen += e.inputBuffer.length;
+    if (pendingLen >= chunkSecs * ctx.sampleRate) {
+      send(concatChunks(pending));
+      pending = [];
+      pendingLen = 0;
+    }
+  };
+  source.connect(processor);
+  processor.connect(ctx.destination);
+
+  const timer = setTimeout(finish, seconds * 1000);
+  await finished;
+  clearTimeout(timer);
+  processor.disconnect();
+  source.disconnect();
+  ctx.close();
+
+  await sending;
+  if (result) return result;
+  // Out of time: send what is left and take the best guess.
+  if (pendingLen) send(concatChunks(pending));
+  await sending;
+  if (result) return result;
+  const res = await fetch(url, { method: "DELETE" });
+  return res.json();
+}
+
+function concatChunks(chunks) {
+  const pcm = new Float32Array(chunks.reduce((a, b) => a + b.length, 0));
   let off = 0;
-  for (const chunk of samples) {
+  for (const chunk of chunks) {
     pcm.set(chunk, off);
     off += chunk.length;
   }
-
-  const wavBytes = encodeWav(pcm, 44100);
-  return new Blob([wavBytes], { type: "audio/wav" });
+  return pcm;
 }
 
 function encodeWav(samples, sampleRate) {